@@ -0,0 +1,41 @@
+using System.Diagnostics;
+using System.Runtime.CompilerServices;
+
+namespace Samples.Console
+{
+    // cost of a probe on a small hot method, run once without the profiler and
+    // once per probe mode with a trace.json rule on Samples.Console.Benchmark.Work
+    public class Benchmark
+    {
+        private const int Iterations = 10000000;
+
+        private int _value;
+
+        [MethodImpl(MethodImplOptions.NoInlining)]
+        public int Work(int i)
+        {
+            _value += i;
+            return _value;
+        }
+
+        public static void Run()
+        {
+            var benchmark = new Benchmark();
+            // first pass jits, and rewrites or hooks, Work
+            benchmark.Measure();
+            var ns = benchmark.Measure();
+            System.Console.WriteLine($"Benchmark Work {ns:F2} ns/call");
+        }
+
+        private double Measure()
+        {
+            var sw = Stopwatch.StartNew();
+            for (var i = 0; i < Iterations; i++)
+            {
+                Work(i);
+            }
+            sw.Stop();
+            return sw.Elapsed.TotalMilliseconds * 1000000.0 / Iterations;
+        }
+    }
+}
@@ -16,6 +16,18 @@ namespace Samples.Console
 
         static void Main(string[] args)
         {
+            if (args.Length > 0 && args[0] == "bench")
+            {
+                Benchmark.Run();
+                return;
+            }
+
+            if (args.Length > 0 && args[0] == "tiering")
+            {
+                Tiering.Run();
+                return;
+            }
+
             Run().GetAwaiter().GetResult();
 
             System.Console.ReadLine();
@@ -0,0 +1,43 @@
+using System.Runtime.CompilerServices;
+using System.Threading;
+
+namespace Samples.Console
+{
+    // hot loop on an instrumented method with tiered compilation on. With a
+    // counter probe on Samples.Console.Tiering.Work the runtime compiles tier-1
+    // code for Work, and the probe's Hits equal the calls printed here, so the
+    // tier-1 code still runs the probe. src/ClrProfiler/test/tiering_test.sh
+    // checks both
+    public class Tiering
+    {
+        private const int CallsPerRound = 100000;
+        private const int Rounds = 250;
+
+        private int _value;
+
+        [MethodImpl(MethodImplOptions.NoInlining)]
+        public int Work(int i)
+        {
+            _value += i;
+            return _value;
+        }
+
+        public static void Run()
+        {
+            var tiering = new Tiering();
+            long calls = 0;
+            for (var round = 0; round < Rounds; round++)
+            {
+                for (var i = 0; i < CallsPerRound; i++)
+                {
+                    tiering.Work(i);
+                }
+                calls += CallsPerRound;
+                // tier-1 is compiled in the background once the call count is
+                // reached and the startup delay passed
+                Thread.Sleep(20);
+            }
+            System.Console.WriteLine($"Tiering Work {calls} calls");
+        }
+    }
+}
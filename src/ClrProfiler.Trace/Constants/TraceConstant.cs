@@ -4,8 +4,10 @@
     {
 #if NET
         public const string PROFILER_HOME = "COR_PROFILER_HOME";
+        public const string PROFILER_PATH = "COR_PROFILER_PATH";
 #else
         public const string PROFILER_HOME = "CORECLR_PROFILER_HOME";
+        public const string PROFILER_PATH = "CORECLR_PROFILER_PATH";
 #endif
     }
 }
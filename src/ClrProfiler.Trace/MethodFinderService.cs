@@ -3,6 +3,8 @@ using System.Collections.Concurrent;
 using System.Collections.Generic;
 using System.IO;
 using System.Reflection;
+using System.Text.RegularExpressions;
+using System.Threading;
 using ClrProfiler.Trace.Constants;
 using Newtonsoft.Json;
 using Newtonsoft.Json.Linq;
@@ -12,8 +14,9 @@ namespace ClrProfiler.Trace
 {
     public class MethodFinderService
     {
-        private readonly ConcurrentDictionary<uint, FunctionInfoCache> _functionInfosCache =
-            new ConcurrentDictionary<uint, FunctionInfoCache>();
+        // indexed by the probe id the profiler assigned to the instrumented method
+        private FunctionInfoCache[] _functionInfosCache = new FunctionInfoCache[64];
+        private readonly object _functionInfosLock = new object();
 
         private readonly ConcurrentDictionary<string, AssemblyInfoCache> _assemblies = 
             new ConcurrentDictionary<string, AssemblyInfoCache>();
@@ -58,26 +61,24 @@ namespace ClrProfiler.Trace
             }
         }
 
-        public EndMethodDelegate BeforeWrappedMethod(object type,
-            object invocationTarget,
+        public EndMethodDelegate BeforeWrappedMethod(object invocationTarget,
             object[] methodArguments,
-            uint functionToken)
+            uint probeId)
         {      
             if (invocationTarget == null)
             {
                 throw new ArgumentException(nameof(invocationTarget));
             }
 
+            var functionInfo = GetFunctionInfoFromCache(probeId);
             var traceMethodInfo = new TraceMethodInfo
             {
                 InvocationTarget = invocationTarget,
                 MethodArguments = methodArguments,
-                Type = (Type) type
+                Type = functionInfo.MethodBase?.DeclaringType,
+                MethodBase = functionInfo.MethodBase
             };
 
-            var functionInfo = GetFunctionInfoFromCache(functionToken, traceMethodInfo);
-            traceMethodInfo.MethodBase = functionInfo.MethodBase;
-
             if (functionInfo.MethodWrapper == null)
             {
                 PrepareMethodWrapper(functionInfo, traceMethodInfo);
@@ -96,7 +97,7 @@ namespace ClrProfiler.Trace
             try
             {
                 var assemblyName = traceMethodInfo.Type.Assembly.GetName().Name;
-                if (_assemblies.TryGetValue(assemblyName, out var assemblyInfoCache))
+                if (TryGetAssemblyInfo(assemblyName, out var assemblyInfoCache))
                 {
                     if (assemblyInfoCache.Assembly == null)
                     {
@@ -157,23 +158,81 @@ namespace ClrProfiler.Trace
         }
 
         /// <summary>
-        /// GetFunctionInfo MethodBase FromCache
+        /// Find the AssemblyInfoCache of an assembly, assemblyName in trace.json may use '*' and '?' wildcards
         /// </summary>
-        /// <param name="functionToken"></param>
-        /// <param name="traceMethodInfo"></param>
+        /// <param name="assemblyName"></param>
+        /// <param name="assemblyInfoCache"></param>
         /// <returns></returns>
-        private FunctionInfoCache GetFunctionInfoFromCache(uint functionToken, TraceMethodInfo traceMethodInfo)
+        private bool TryGetAssemblyInfo(string assemblyName, out AssemblyInfoCache assemblyInfoCache)
         {
-            var functionInfo = _functionInfosCache.GetOrAdd(functionToken, token =>
+            if (_assemblies.TryGetValue(assemblyName, out assemblyInfoCache))
+            {
+                return true;
+            }
+
+            foreach (var item in _assemblies)
             {
-                var methodBase = traceMethodInfo.Type.Module.ResolveMethod((int) token);
-                var functionInfoCache = new FunctionInfoCache
+                if (item.Key.IndexOfAny(new[] { '*', '?' }) < 0)
                 {
-                    MethodBase = methodBase
-                };
-                return functionInfoCache;
-            });
-            return functionInfo;
+                    continue;
+                }
+
+                var pattern = "^" + Regex.Escape(item.Key).Replace("\\*", ".*").Replace("\\?", ".") + "$";
+                if (Regex.IsMatch(assemblyName, pattern))
+                {
+                    assemblyInfoCache = item.Value;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /// <summary>
+        /// GetFunctionInfo MethodBase FromCache, the first call of a probe resolves it through the profiler
+        /// </summary>
+        /// <param name="probeId"></param>
+        /// <returns></returns>
+        private FunctionInfoCache GetFunctionInfoFromCache(uint probeId)
+        {
+            var functionInfos = Volatile.Read(ref _functionInfosCache);
+            if (probeId < functionInfos.Length)
+            {
+                var functionInfo = functionInfos[probeId];
+                if (functionInfo != null)
+                {
+                    return functionInfo;
+                }
+            }
+
+            lock (_functionInfosLock)
+            {
+                functionInfos = _functionInfosCache;
+                if (probeId >= functionInfos.Length)
+                {
+                    var length = functionInfos.Length;
+                    while (length <= probeId)
+                    {
+                        length *= 2;
+                    }
+                    Array.Resize(ref functionInfos, length);
+                    Volatile.Write(ref _functionInfosCache, functionInfos);
+                }
+
+                var functionInfo = functionInfos[probeId];
+                if (functionInfo == null)
+                {
+                    functionInfo = new FunctionInfoCache
+                    {
+                        MethodBase = ProbeTable.ResolveMethod(probeId)
+                    };
+                    if (functionInfo.MethodBase == null)
+                    {
+                        functionInfo.MethodWrapper = new NoopMethodWrapper();
+                    }
+                    Volatile.Write(ref functionInfos[probeId], functionInfo);
+                }
+                return functionInfo;
+            }
         }
 
         /// <summary>
@@ -0,0 +1,131 @@
+﻿using System;
+using System.Reflection;
+using System.Runtime.InteropServices;
+using ClrProfiler.Trace.Constants;
+
+namespace ClrProfiler.Trace
+{
+    /// <summary>
+    /// Probe table published by the native profiler, the injected code passes a dense probe id
+    /// </summary>
+    internal static class ProbeTable
+    {
+        private const string GetProbeInfoExportName = "GetProbeInfo";
+
+        /// <summary>
+        /// same layout as trace::ProbeInfo in probe_table.h
+        /// </summary>
+        [StructLayout(LayoutKind.Sequential)]
+        private struct ProbeInfo
+        {
+            public uint MethodDef;
+
+            public Guid ModuleVersionId;
+
+            public IntPtr AssemblyName;
+        }
+
+        [UnmanagedFunctionPointer(CallingConvention.StdCall)]
+        private delegate int GetProbeInfoDelegate(uint probeId, out ProbeInfo probeInfo);
+
+        private static readonly Lazy<GetProbeInfoDelegate> GetProbeInfo =
+            new Lazy<GetProbeInfoDelegate>(LoadGetProbeInfo);
+
+        /// <summary>
+        /// Resolve the method a probe id was assigned to, null if it can not be found
+        /// </summary>
+        /// <param name="probeId"></param>
+        /// <returns></returns>
+        public static MethodBase ResolveMethod(uint probeId)
+        {
+            var getProbeInfo = GetProbeInfo.Value;
+            if (getProbeInfo == null || getProbeInfo(probeId, out var probeInfo) == 0)
+            {
+                return null;
+            }
+
+            var assemblyName = Marshal.PtrToStringUni(probeInfo.AssemblyName);
+            foreach (var assembly in AppDomain.CurrentDomain.GetAssemblies())
+            {
+                if (assembly.IsDynamic || assembly.GetName().Name != assemblyName)
+                {
+                    continue;
+                }
+
+                foreach (var module in assembly.GetModules())
+                {
+                    if (module.ModuleVersionId == probeInfo.ModuleVersionId)
+                    {
+                        return module.ResolveMethod((int)probeInfo.MethodDef);
+                    }
+                }
+            }
+            return null;
+        }
+
+        private static GetProbeInfoDelegate LoadGetProbeInfo()
+        {
+            try
+            {
+                var profilerPath = GetProfilerPath();
+                if (string.IsNullOrEmpty(profilerPath))
+                {
+                    return null;
+                }
+
+                var export = GetExport(profilerPath, GetProbeInfoExportName);
+                if (export == IntPtr.Zero)
+                {
+                    return null;
+                }
+                return (GetProbeInfoDelegate)Marshal.GetDelegateForFunctionPointer(export, typeof(GetProbeInfoDelegate));
+            }
+            catch (Exception ex)
+            {
+                System.Diagnostics.Trace.WriteLine(ex);
+                return null;
+            }
+        }
+
+        private static string GetProfilerPath()
+        {
+            var bitness = IntPtr.Size == 8 ? "_64" : "_32";
+            var profilerPath = Environment.GetEnvironmentVariable(TraceConstant.PROFILER_PATH + bitness);
+            if (string.IsNullOrEmpty(profilerPath))
+            {
+                profilerPath = Environment.GetEnvironmentVariable(TraceConstant.PROFILER_PATH);
+            }
+            return profilerPath;
+        }
+
+        private static IntPtr GetExport(string libraryPath, string name)
+        {
+#if NET
+            return GetProcAddress(LoadLibrary(libraryPath), name);
+#else
+            if (RuntimeInformation.IsOSPlatform(OSPlatform.Windows))
+            {
+                return GetProcAddress(LoadLibrary(libraryPath), name);
+            }
+            // the profiler is already loaded, dlopen only hands back its handle
+            return dlsym(dlopen(libraryPath, RTLD_NOW), name);
+#endif
+        }
+
+        [DllImport("kernel32", CharSet = CharSet.Unicode, SetLastError = true)]
+        private static extern IntPtr LoadLibrary(string fileName);
+
+        [DllImport("kernel32", CharSet = CharSet.Ansi, SetLastError = true)]
+        private static extern IntPtr GetProcAddress(IntPtr module, string procName);
+
+#if !NET
+        private const int RTLD_NOW = 2;
+
+        [DllImport("libdl.so.2")]
+        private static extern IntPtr dlopen(string fileName, int flags);
+
+        [DllImport("libdl.so.2")]
+        private static extern IntPtr dlsym(IntPtr handle, string symbol);
+#endif
+    }
+}
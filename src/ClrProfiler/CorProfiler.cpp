@@ -10,12 +10,24 @@
 #include "config_loader.h"
 #include "il_rewriter.h"
 #include "il_rewriter_wrapper.h"
+#include "il_template.h"
+#include "instrumentation_plan.h"
+#include "probe_table.h"
+#include "signature_builder.h"
+#include "thread_latency.h"
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <cassert>
 
 namespace trace {
 
+    //FunctionIDMapper2, clientData is the profiler
+    static UINT_PTR STDMETHODCALLTYPE MapEnterLeaveFunction(FunctionID functionId, void* clientData, BOOL* pbHookFunction)
+    {
+        return static_cast<CorProfiler*>(clientData)->HookFunction(functionId, pbHookFunction);
+    }
+
     CorProfiler::CorProfiler() : refCount(0), corProfilerInfo(nullptr)
     {
         Info("CorProfiler()");
@@ -40,14 +52,6 @@ namespace trace {
             return E_FAIL;
         }
 
-        const DWORD eventMask = COR_PRF_MONITOR_JIT_COMPILATION |
-            COR_PRF_DISABLE_TRANSPARENCY_CHECKS_UNDER_FULL_TRUST | /* helps the case where this profiler is used on Full CLR */
-            COR_PRF_DISABLE_INLINING |
-            COR_PRF_MONITOR_MODULE_LOADS |
-            COR_PRF_DISABLE_ALL_NGEN_IMAGES;
-
-        this->corProfilerInfo->SetEventMask(eventMask);
-
         this->clrProfilerHomeEnvValue = GetEnvironmentValue(GetClrProfilerHome());
 
         if(this->clrProfilerHomeEnvValue.empty()) {
@@ -56,10 +60,67 @@ namespace trace {
         }
 
         this->traceConfig = LoadTraceConfig(this->clrProfilerHomeEnvValue);
+
+        // the environment overrides the include list of trace.json
+        const auto processes = GetEnvironmentValues(GetClrProfilerProcesses());
+        if (!processes.empty()) {
+            this->traceConfig.processFilter.include = processes;
+        }
+
+        const auto processName = GetCurrentProcessName();
+        if (!this->traceConfig.processFilter.IsMatch(processName, GetCurrentProcessCommandLine())) {
+            // stay loaded but dormant, nothing is monitored in this process
+            Info("CorProfiler Disabled For Process {}", ToString(processName));
+            this->corProfilerInfo->SetEventMask(COR_PRF_MONITOR_NONE);
+            return S_OK;
+        }
+
         if (this->traceConfig.traceAssemblies.empty()) {
             Warn("TraceAssemblies Not Found");
             return E_FAIL;
         }
+        this->traceMatcher.Compile(this->traceConfig.traceAssemblies);
+        if (this->instrumentationPlan.Open(clrProfilerHomeEnvValue + PathSeparator + InstrumentationPlanFileName,
+            HashTraceRules(this->traceConfig.traceAssemblies))) {
+            Info("Instrumentation Plan Loaded");
+        }
+
+        // before the jit events are on, a method jitted without the segment can't be muted
+        if (this->traceConfig.control.enabled) {
+            if (this->controlSegment.Create(this->traceConfig.control.probeCapacity)) {
+                Info("Control Segment {}", ControlSegmentName(GetPID()));
+            }
+            else {
+                Warn("Control Segment {} Not Created", ControlSegmentName(GetPID()));
+            }
+        }
+
+        DWORD eventMask = COR_PRF_MONITOR_JIT_COMPILATION |
+            COR_PRF_DISABLE_TRANSPARENCY_CHECKS_UNDER_FULL_TRUST | /* helps the case where this profiler is used on Full CLR */
+            COR_PRF_DISABLE_INLINING |
+            COR_PRF_MONITOR_MODULE_LOADS |
+            COR_PRF_DISABLE_ALL_NGEN_IMAGES;
+        if (this->traceConfig.governor.enabled) {
+            eventMask |= COR_PRF_ENABLE_REJIT;
+        }
+        //exceptions tell which hooked frames were unwound without a leave
+        if (this->traceConfig.enterLeave.enabled) {
+            eventMask |= COR_PRF_MONITOR_ENTERLEAVE | COR_PRF_MONITOR_EXCEPTIONS;
+        }
+
+        this->moduleAnalysis.Start();
+        this->corProfilerInfo->SetEventMask(eventMask);
+
+        if (this->traceConfig.enterLeave.enabled) {
+            this->corProfilerInfo->SetFunctionIDMapper2(MapEnterLeaveFunction, this);
+            this->corProfilerInfo->SetEnterLeaveFunctionHooks3WithInfo(
+                EnterLeaveEnterHook, EnterLeaveLeaveHook, EnterLeaveTailcallHook);
+            Info("Enter Leave Timing Enabled, IL Is Not Rewritten");
+        }
+
+        if (this->traceConfig.governor.enabled) {
+            this->overheadGovernor.Start(this->corProfilerInfo, this->traceConfig.governor);
+        }
 
         Info("CorProfiler Initialize Success");
 
@@ -70,6 +131,35 @@ namespace trace {
     {
         Info("CorProfiler Shutdown");
 
+        {
+            std::lock_guard<std::mutex> guard(ilSizeLock);
+            if (rewrittenMethodCount > 0) {
+                Info("IL Size Methods:{} AvgOriginal:{} AvgGrowthBeforePeephole:{} AvgGrowthAfterPeephole:{}",
+                    rewrittenMethodCount,
+                    originalILBytes / rewrittenMethodCount,
+                    (unoptimizedILBytes - originalILBytes) / rewrittenMethodCount,
+                    (optimizedILBytes - originalILBytes) / rewrittenMethodCount);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(mapLock);
+            Info("Never Instrumented NoRule:{} InvalidMethod:{} ParseFailed:{} Static:{} ByRefReturn:{} RewriteFailed:{}",
+                skipCounts[SkipNoRule],
+                skipCounts[SkipInvalidMethod],
+                skipCounts[SkipParseFailed],
+                skipCounts[SkipStatic],
+                skipCounts[SkipByRefReturn],
+                skipCounts[SkipRewriteFailed]);
+        }
+
+        MergeThreadLatency();
+        ProbeTable::Instance()->LogCounters();
+
+        this->moduleAnalysis.Stop();
+        this->overheadGovernor.Stop();
+        this->controlSegment.Unlink();
+
         if (this->corProfilerInfo != nullptr)
         {
             this->corProfilerInfo->Release();
@@ -137,61 +227,90 @@ namespace trace {
             return S_OK;
         }
 
-        const auto entryPointToken = module_info.GetEntryPointToken();
-        ModuleMetaInfo* module_metadata = new ModuleMetaInfo(entryPointToken, module_info.assembly.name);
+        ModuleMetaInfo* module_metadata = new ModuleMetaInfo(module_info.assembly.name);
+        //enter/leave timing rewrites nothing, the module needs no analysis
+        const auto needTrace = !traceConfig.enterLeave.enabled && AssemblyIsNeedTrace(module_info.assembly.name);
+        if (!needTrace) {
+            module_metadata->SetReady();
+        }
         {
             std::lock_guard<std::mutex> guard(mapLock);
             moduleMetaInfoMap[moduleId] = module_metadata;
         }
 
-        if (entryPointToken != mdTokenNil)
-        {
-            Info("Assembly:{} EntryPointToken:{}", ToString(module_info.assembly.name), entryPointToken);
+        if (needTrace) {
+            //types and methods can only be added to a module while it loads
+            DefineModuleAgentHelper(moduleId, module_metadata);
+
+            //a module left unscanned at shutdown is released as it is, with
+            //no candidates none of its methods is rewritten
+            moduleAnalysis.Post([this, module_info, module_metadata]() {
+                ScanModuleMethods(module_info, module_metadata);
+                module_metadata->SetReady();
+            }, [module_metadata]() {
+                module_metadata->SetReady();
+            });
+            return S_OK;
         }
 
         if (module_info.assembly.name == "mscorlib"_W || module_info.assembly.name == "System.Private.CoreLib"_W) {
-                                  
-            if(!corAssemblyProperty.szName.empty()) {
-                return S_OK;
-            }
+            ReadCorAssemblyProperty(module_info);
+        }
+        return S_OK;
+    }
 
-            CComPtr<IUnknown> metadata_interfaces;
-            auto hr = corProfilerInfo->GetModuleMetaData(moduleId, ofRead | ofWrite,
-                IID_IMetaDataImport2,
-                metadata_interfaces.GetAddressOf());
-            RETURN_OK_IF_FAILED(hr);
+    HRESULT CorProfiler::ReadCorAssemblyProperty(const ModuleInfo& moduleInfo)
+    {
+        if(!corAssemblyProperty.szName.empty()) {
+            return S_OK;
+        }
 
-            auto pAssemblyImport = metadata_interfaces.As<IMetaDataAssemblyImport>(
-                IID_IMetaDataAssemblyImport);
-            if (pAssemblyImport.IsNull()) {
-                return S_OK;
-            }
+        CComPtr<IUnknown> metadata_interfaces;
+        auto hr = corProfilerInfo->GetModuleMetaData(moduleInfo.id, ofRead | ofWrite,
+            IID_IMetaDataImport2,
+            metadata_interfaces.GetAddressOf());
+        RETURN_OK_IF_FAILED(hr);
 
-            mdAssembly assembly;
-            hr = pAssemblyImport->GetAssemblyFromScope(&assembly);
-            RETURN_OK_IF_FAILED(hr);
+        auto pAssemblyImport = metadata_interfaces.As<IMetaDataAssemblyImport>(
+            IID_IMetaDataAssemblyImport);
+        if (pAssemblyImport.IsNull()) {
+            return S_OK;
+        }
 
-            hr = pAssemblyImport->GetAssemblyProps(
-                assembly,
-                &corAssemblyProperty.ppbPublicKey,
-                &corAssemblyProperty.pcbPublicKey,
-                &corAssemblyProperty.pulHashAlgId,
-                NULL,
-                0,
-                NULL,
-                &corAssemblyProperty.pMetaData,
-                &corAssemblyProperty.assemblyFlags);
-            RETURN_OK_IF_FAILED(hr);
+        mdAssembly assembly;
+        hr = pAssemblyImport->GetAssemblyFromScope(&assembly);
+        RETURN_OK_IF_FAILED(hr);
 
-            corAssemblyProperty.szName = module_info.assembly.name;
+        hr = pAssemblyImport->GetAssemblyProps(
+            assembly,
+            &corAssemblyProperty.ppbPublicKey,
+            &corAssemblyProperty.pcbPublicKey,
+            &corAssemblyProperty.pulHashAlgId,
+            NULL,
+            0,
+            NULL,
+            &corAssemblyProperty.pMetaData,
+            &corAssemblyProperty.assemblyFlags);
+        RETURN_OK_IF_FAILED(hr);
 
-            return S_OK;
-        }
+        corAssemblyProperty.szName = moduleInfo.assembly.name;
         return S_OK;
     }
 
     HRESULT STDMETHODCALLTYPE CorProfiler::ModuleUnloadStarted(ModuleID moduleId)
     {
+        //the worker may still be reading the module
+        ModuleMetaInfo* moduleMetaInfo = nullptr;
+        {
+            std::lock_guard<std::mutex> guard(mapLock);
+            const auto it = moduleMetaInfoMap.find(moduleId);
+            if (it != moduleMetaInfoMap.end()) {
+                moduleMetaInfo = it->second;
+            }
+        }
+        if (moduleMetaInfo != nullptr) {
+            moduleMetaInfo->WaitReady();
+        }
         return S_OK;
     }
 
@@ -206,6 +325,7 @@ namespace trace {
                 moduleMetaInfoMap.erase(moduleId);
             }
         }
+        overheadGovernor.ModuleUnloaded(moduleId);
         return S_OK;
     }
 
@@ -239,76 +359,76 @@ namespace trace {
         return S_OK;
     }
 
-    // add ret ex methodTrace var to local var
+    // append the locals of the template to the local var sig, e.g. ret ex
+    // methodTrace of a span, methodTrace is object so the method does not
+    // reference the agent
     HRESULT ModifyLocalSig(CComPtr<IMetaDataImport2>& pImport,
         CComPtr<IMetaDataEmit2>& pEmit,
         ILRewriter& reWriter, 
+        const std::vector<TemplateLocalType>& locals,
         mdTypeRef exTypeRef,
-        mdTypeRef methodTraceTypeRef)
-    {
-        HRESULT hr;
-        PCCOR_SIGNATURE rgbOrigSig = NULL;
-        ULONG cbOrigSig = 0;
-        UNALIGNED INT32 temp = 0;
-        if (reWriter.m_tkLocalVarSig != mdTokenNil)
+        const MethodArgument& retType,
+        ModuleMetaInfo* moduleMetaInfo)
+    {
+        SignatureBuilder newLocals;
+        for (const auto local : locals) {
+            switch (local) {
+            case LocalTypeException:
+                newLocals.Append(ELEMENT_TYPE_CLASS);
+                newLocals.AppendToken(exTypeRef);
+                break;
+            case LocalTypeReturn:
+                newLocals.Append(retType.pbBase + retType.offset, retType.length);
+                break;
+            case LocalTypeInt64:
+                newLocals.Append(ELEMENT_TYPE_I8);
+                break;
+            default:
+                newLocals.Append(ELEMENT_TYPE_OBJECT);
+                break;
+            }
+        }
+
+        const auto tkOrigLocalVarSig = reWriter.m_tkLocalVarSig;
+        const auto key = std::make_pair(tkOrigLocalVarSig, std::string((const char*)newLocals.Head(), newLocals.Size()));
         {
-            IfFailRet(pImport->GetSigFromToken(reWriter.m_tkLocalVarSig, &rgbOrigSig, &cbOrigSig));
-
-            //Check Is ReWrite or not
-            const auto len = CorSigCompressToken(methodTraceTypeRef, &temp);
-            if(cbOrigSig - len > 0){
-                if(rgbOrigSig[cbOrigSig - len -1]== ELEMENT_TYPE_CLASS){
-                    if (memcmp(&rgbOrigSig[cbOrigSig - len], &temp, len) == 0) {
-                        return E_FAIL;
-                    }
-                }
+            std::lock_guard<std::mutex> guard(moduleMetaInfo->localSigLock);
+            const auto it = moduleMetaInfo->localSigs.find(key);
+            if (it != moduleMetaInfo->localSigs.end()) {
+                reWriter.m_tkLocalVarSig = it->second.token;
+                reWriter.cNewLocals = it->second.cLocals;
+                return S_OK;
             }
         }
 
-        auto exTypeRefSize = CorSigCompressToken(exTypeRef, &temp);
-        auto methodTraceTypeRefSize = CorSigCompressToken(methodTraceTypeRef, &temp);
-        ULONG cbNewSize = cbOrigSig + 1 + 1 + methodTraceTypeRefSize + 1 + exTypeRefSize;
-        ULONG cOrigLocals;
-        ULONG cNewLocalsLen;
-        ULONG cbOrigLocals = 0;
+        PCCOR_SIGNATURE rgbOrigSig = NULL;
+        ULONG cbOrigSig = 0;
+        if (tkOrigLocalVarSig != mdTokenNil)
+        {
+            IfFailRet(pImport->GetSigFromToken(tkOrigLocalVarSig, &rgbOrigSig, &cbOrigSig));
+        }
 
+        const auto cLocals = (ULONG)locals.size();
+        SignatureBuilder newSig;
+        newSig.Append(IMAGE_CEE_CS_CALLCONV_LOCAL_SIG);
         if (cbOrigSig == 0) {
-            cbNewSize += 2;
-            reWriter.cNewLocals = 3;
-            cNewLocalsLen = CorSigCompressData(reWriter.cNewLocals, &temp);
+            reWriter.cNewLocals = cLocals;
+            newSig.AppendData(reWriter.cNewLocals);
         }
         else {
-            cbOrigLocals = CorSigUncompressData(rgbOrigSig + 1, &cOrigLocals);
-            reWriter.cNewLocals = cOrigLocals + 3;
-            cNewLocalsLen = CorSigCompressData(reWriter.cNewLocals, &temp);
-            cbNewSize += cNewLocalsLen - cbOrigLocals;
+            ULONG cOrigLocals;
+            const auto cbOrigLocals = CorSigUncompressData(rgbOrigSig + 1, &cOrigLocals);
+            reWriter.cNewLocals = cOrigLocals + cLocals;
+            newSig.AppendData(reWriter.cNewLocals);
+            newSig.Append(rgbOrigSig + 1 + cbOrigLocals, cbOrigSig - 1 - cbOrigLocals);
         }
+        newSig.Append(newLocals.Head(), newLocals.Size());
 
-        const auto rgbNewSig = new COR_SIGNATURE[cbNewSize];
-        *rgbNewSig = IMAGE_CEE_CS_CALLCONV_LOCAL_SIG;
-
-        ULONG rgbNewSigOffset = 1;
-        memcpy(rgbNewSig + rgbNewSigOffset, &temp, cNewLocalsLen);
-        rgbNewSigOffset += cNewLocalsLen;
-
-        if (cbOrigSig > 0) {
-            const auto cbOrigCopyLen = cbOrigSig - 1 - cbOrigLocals;
-            memcpy(rgbNewSig + rgbNewSigOffset, rgbOrigSig + 1 + cbOrigLocals, cbOrigCopyLen);
-            rgbNewSigOffset += cbOrigCopyLen;
-        }
-
-        rgbNewSig[rgbNewSigOffset++] = ELEMENT_TYPE_OBJECT;
-        rgbNewSig[rgbNewSigOffset++] = ELEMENT_TYPE_CLASS;
-        exTypeRefSize = CorSigCompressToken(exTypeRef, &temp);
-        memcpy(rgbNewSig + rgbNewSigOffset, &temp, exTypeRefSize);
-        rgbNewSigOffset += exTypeRefSize;
-        rgbNewSig[rgbNewSigOffset++] = ELEMENT_TYPE_CLASS;
-        methodTraceTypeRefSize = CorSigCompressToken(methodTraceTypeRef, &temp);
-        memcpy(rgbNewSig + rgbNewSigOffset, &temp, methodTraceTypeRefSize);
-        rgbNewSigOffset += methodTraceTypeRefSize;
-
-        IfFailRet(pEmit->GetTokenFromSig(&rgbNewSig[0], cbNewSize, &reWriter.m_tkLocalVarSig));
+        IfFailRet(pEmit->GetTokenFromSig(newSig.Head(), newSig.Size(), &reWriter.m_tkLocalVarSig));
 
+        std::lock_guard<std::mutex> guard(moduleMetaInfo->localSigLock);
+        moduleMetaInfo->localSigs.emplace(key,
+            ModuleMetaInfo::LocalSig{ reWriter.m_tkLocalVarSig, reWriter.cNewLocals });
         return S_OK;
     }
 
@@ -339,57 +459,210 @@ namespace trace {
         return paramIsMatch;
     }
 
-    bool CorProfiler::FunctionIsNeedTrace(CComPtr<IMetaDataImport2>& pImport, ModuleMetaInfo* moduleMetaInfo, FunctionInfo functionInfo)
+    bool CorProfiler::AssemblyIsNeedTrace(const WSTRING& assemblyName)
+    {
+        return traceMatcher.MatchAssembly(assemblyName);
+    }
+
+    void CorProfiler::ScanModuleMethods(const ModuleInfo& moduleInfo, ModuleMetaInfo* moduleMetaInfo)
+    {
+        ULONG metadataSize = 0;
+        const auto pMetadata = moduleInfo.GetMetadata(&metadataSize);
+        auto& reader = moduleMetaInfo->metadataReader;
+        if (!reader.Open(pMetadata, metadataSize)) {
+            return;
+        }
+
+        //a plan compiled offline for this build of the module saves the scan
+        GUID mvid;
+        const mdMethodDef* planMethods;
+        ULONG planMethodCount;
+        if (reader.GetModuleMvid(&mvid) &&
+            instrumentationPlan.TryGetMethods(mvid, &planMethods, &planMethodCount)) {
+            moduleMetaInfo->candidateMethods.insert(planMethods, planMethods + planMethodCount);
+            Info("Assembly:{} Planned Candidates:{}", ToString(moduleMetaInfo->assemblyName), planMethodCount);
+            return;
+        }
+
+        ResolveCandidateMethods(reader, traceMatcher, moduleMetaInfo->assemblyName,
+            [moduleMetaInfo](mdMethodDef methodDef, const WSTRING&, LPCSTR, const std::vector<TraceRule>&) {
+                moduleMetaInfo->candidateMethods.insert(methodDef);
+            });
+        Info("Assembly:{} Methods:{} Candidates:{}", ToString(moduleMetaInfo->assemblyName),
+            reader.GetRowCount(TableMethodDef), moduleMetaInfo->candidateMethods.size());
+    }
+
+    void CorProfiler::DefineModuleAgentHelper(ModuleID moduleId, ModuleMetaInfo* moduleMetaInfo)
+    {
+        CComPtr<IUnknown> metadata_interfaces;
+        auto hr = corProfilerInfo->GetModuleMetaData(moduleId, ofRead | ofWrite,
+            IID_IMetaDataImport2,
+            metadata_interfaces.GetAddressOf());
+        if (FAILED(hr)) {
+            return;
+        }
+
+        const mdAssemblyRef corLibAssemblyRef = GetCorLibAssemblyRef(metadata_interfaces, corAssemblyProperty);
+        if (corLibAssemblyRef == mdAssemblyRefNil) {
+            return;
+        }
+
+        const mdAssemblyRef profilerAssemblyRef = GetProfilerAssemblyRef(metadata_interfaces,
+            traceConfig.managedAssembly.assemblyMetaData,
+            traceConfig.managedAssembly.publicKey);
+        if (profilerAssemblyRef == mdAssemblyRefNil) {
+            return;
+        }
+
+        //.net framework resolves the agent from the gac
+        //.net core loads it on the first probe hit
+        WSTRING agentPath;
+        if (corAssemblyProperty.szName != "mscorlib"_W) {
+            agentPath = clrProfilerHomeEnvValue + PathSeparator + ProfilerAssemblyName + ".dll"_W;
+        }
+
+        //fetched once, every rewrite in the module allocates from it
+        CComPtr<IMethodMalloc> methodMalloc;
+        hr = corProfilerInfo->GetILFunctionBodyAllocator(moduleId, methodMalloc.GetAddressOf());
+        if (FAILED(hr)) {
+            return;
+        }
+
+        AgentHelper agentHelper{};
+        hr = DefineAgentHelper(corProfilerInfo, moduleId, metadata_interfaces,
+            corLibAssemblyRef, profilerAssemblyRef, agentPath, methodMalloc.Get(), &agentHelper);
+        if (FAILED(hr)) {
+            Warn("Assembly:{} DefineAgentHelper Failed:{}", ToString(moduleMetaInfo->assemblyName), hr);
+            return;
+        }
+
+        std::lock_guard<std::mutex> guard(mapLock);
+        moduleMetaInfo->methodMalloc = methodMalloc;
+        moduleMetaInfo->agentHelper = agentHelper;
+    }
+
+    void CorProfiler::SkipToken(ModuleMetaInfo* moduleMetaInfo, mdToken token, SkipReason reason)
     {
-        auto isTrace = false;
-        for (const auto& assembly : this->traceConfig.traceAssemblies)
+        std::lock_guard<std::mutex> guard(mapLock);
+        if (moduleMetaInfo->skippedTokens.emplace(token, reason).second) {
+            skipCounts[reason]++;
+        }
+    }
+
+    bool CorProfiler::FunctionIsNeedTrace(CComPtr<IMetaDataImport2>& pImport, ModuleMetaInfo* moduleMetaInfo, FunctionInfo functionInfo,
+        std::vector<const TraceMethod*>* tracedBy)
+    {
+        std::vector<TraceRule> rules;
+        if (!traceMatcher.Match(moduleMetaInfo->assemblyName, functionInfo.type.name, functionInfo.name, &rules)) {
+            return false;
+        }
+        for (const auto& rule : rules)
         {
-            if (assembly.assemblyName == moduleMetaInfo->assemblyName && assembly.className == functionInfo.type.name)
+            const auto& method = this->traceConfig.traceAssemblies[rule.assemblyIndex].methods[rule.methodIndex];
+            if (MethodParamsNameIsMatch(method.paramsName, functionInfo, pImport))
             {
-                for (const auto& method : assembly.methods)
-                {
-                    if (method.methodName == functionInfo.name) 
-                    {
-                        if (MethodParamsNameIsMatch(method.paramsName, functionInfo, pImport))
-                        {
-                            isTrace = true;
-                            break;
-                        }
-                    }
-                }
+                tracedBy->push_back(&method);
             }
-            if (isTrace) 
-                break;
         }
-        return isTrace;
+        return !tracedBy->empty();
     }
 
-    HRESULT STDMETHODCALLTYPE CorProfiler::JITCompilationStarted(FunctionID functionId, BOOL fIsSafeToBlock)
+    //called once per function as it is jitted, a matched function is hooked
+    //with its probe id as client id
+    UINT_PTR CorProfiler::HookFunction(FunctionID functionId, BOOL* pbHookFunction)
     {
+        *pbHookFunction = FALSE;
         mdToken function_token = mdTokenNil;
         ModuleID moduleId;
         auto hr = corProfilerInfo->GetFunctionInfo(functionId, NULL, &moduleId, &function_token);
-        RETURN_OK_IF_FAILED(hr);
+        if (FAILED(hr)) {
+            return functionId;
+        }
 
         ModuleMetaInfo* moduleMetaInfo = nullptr;
         {
             std::lock_guard<std::mutex> guard(mapLock);
-            if (moduleMetaInfoMap.count(moduleId) > 0) {
-                moduleMetaInfo = moduleMetaInfoMap[moduleId];
+            const auto it = moduleMetaInfoMap.find(moduleId);
+            if (it != moduleMetaInfoMap.end()) {
+                moduleMetaInfo = it->second;
             }
         }
-        if(moduleMetaInfo == nullptr) {
-            return S_OK;
+        if (moduleMetaInfo == nullptr || !AssemblyIsNeedTrace(moduleMetaInfo->assemblyName)) {
+            return functionId;
+        }
+
+        CComPtr<IUnknown> metadata_interfaces;
+        hr = corProfilerInfo->GetModuleMetaData(moduleId, ofRead,
+            IID_IMetaDataImport2,
+            metadata_interfaces.GetAddressOf());
+        if (FAILED(hr)) {
+            return functionId;
+        }
+        auto pImport = metadata_interfaces.As<IMetaDataImport2>(IID_IMetaDataImport);
+        if (pImport.IsNull()) {
+            return functionId;
+        }
+
+        auto functionInfo = GetFunctionInfo(pImport, function_token);
+        std::vector<const TraceMethod*> tracedBy;
+        if (!functionInfo.IsValid() || FAILED(functionInfo.signature.TryParse()) ||
+            !FunctionIsNeedTrace(pImport, moduleMetaInfo, functionInfo, &tracedBy)) {
+            return functionId;
         }
 
-        bool isiLRewrote = false;
+        GUID moduleVersionId;
+        hr = pImport->GetScopeProps(NULL, 0, NULL, &moduleVersionId);
+        if (FAILED(hr)) {
+            return functionId;
+        }
+        const auto probeId = ProbeTable::Instance()->GetOrAdd(moduleId, function_token,
+            moduleVersionId, moduleMetaInfo->assemblyName, functionInfo.type.name + "."_W + functionInfo.name);
         {
-            std::lock_guard<std::mutex> guard(mapLock);
-            if (iLRewriteMap.count(function_token) > 0) {
-                isiLRewrote = true;
+            std::lock_guard<std::mutex> guard(hookLock);
+            hookedFunctions.insert(functionId);
+        }
+
+        Info("TypeName:{} MethodName:{} ProbeId:{} Enter Leave Hooked", ToString(functionInfo.type.name), ToString(functionInfo.name), probeId);
+        *pbHookFunction = TRUE;
+        return (UINT_PTR)probeId;
+    }
+
+    HRESULT STDMETHODCALLTYPE CorProfiler::JITCompilationStarted(FunctionID functionId, BOOL fIsSafeToBlock)
+    {
+        mdToken function_token = mdTokenNil;
+        ModuleID moduleId;
+        auto hr = corProfilerInfo->GetFunctionInfo(functionId, NULL, &moduleId, &function_token);
+        RETURN_OK_IF_FAILED(hr);
+
+        ModuleMetaInfo* moduleMetaInfo = nullptr;
+        {
+            std::unique_lock<std::mutex> guard(mapLock);
+            const auto it = moduleMetaInfoMap.find(moduleId);
+            if (it != moduleMetaInfoMap.end()) {
+                moduleMetaInfo = it->second;
+                // jitted before the worker scanned the module
+                if (!moduleMetaInfo->IsReady()) {
+                    guard.unlock();
+                    moduleMetaInfo->WaitReady();
+                    guard.lock();
+                }
+                // tier-1, OSR and further instantiations of a rewritten method
+                if (moduleMetaInfo->rewrittenMethods.count(function_token) > 0) {
+                    return S_OK;
+                }
+                // decided before never to be instrumented
+                if (moduleMetaInfo->skippedTokens.count(function_token) > 0) {
+                    return S_OK;
+                }
+                // methods of the image that match no rule, methods defined
+                // after load are past the row count and take the slow path
+                if (RidFromToken(function_token) <= moduleMetaInfo->metadataReader.GetRowCount(TableMethodDef) &&
+                    moduleMetaInfo->candidateMethods.count(function_token) == 0) {
+                    return S_OK;
+                }
             }
         }
-        if (isiLRewrote) {
+        if(moduleMetaInfo == nullptr || !moduleMetaInfo->agentHelper.IsValid()) {
             return S_OK;
         }
 
@@ -409,171 +682,85 @@ namespace trace {
         hr = pImport->GetModuleFromScope(&module);
         RETURN_OK_IF_FAILED(hr);
 
-        auto functionInfo = GetFunctionInfo(pImport, function_token);
-        if (!functionInfo.IsValid()) {
-            return S_OK;
-        }
-
-        //.net framework need add gac 
-        //.net core add premain il
-        if (corAssemblyProperty.szName != "mscorlib"_W &&
-            !entryPointReWrote &&
-            functionInfo.id == moduleMetaInfo->entryPointToken)
+        //types matching no rule are recorded by the first of their methods to jit
+        mdTypeDef typeDef = mdTypeDefNil;
+        hr = pImport->GetMethodProps(function_token, &typeDef, NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL);
+        RETURN_OK_IF_FAILED(hr);
         {
-            const mdAssemblyRef corLibAssemblyRef = GetCorLibAssemblyRef(metadata_interfaces, corAssemblyProperty);
-            if (corLibAssemblyRef == mdAssemblyRefNil) {
+            std::lock_guard<std::mutex> guard(mapLock);
+            if (moduleMetaInfo->skippedTokens.count(typeDef) > 0) {
                 return S_OK;
             }
+        }
 
-            mdTypeRef assemblyTypeRef;
-            hr = pEmit->DefineTypeRefByName(
-                corLibAssemblyRef,
-                AssemblyTypeName.data(),
-                &assemblyTypeRef);
-            RETURN_OK_IF_FAILED(hr);
-
-            unsigned buffer;
-            auto size = CorSigCompressToken(assemblyTypeRef, &buffer);
-            auto* assemblyLoadSig = new COR_SIGNATURE[size + 4];
-            unsigned offset = 0;
-            assemblyLoadSig[offset++] = IMAGE_CEE_CS_CALLCONV_DEFAULT;
-            assemblyLoadSig[offset++] = 0x01;
-            assemblyLoadSig[offset++] = ELEMENT_TYPE_CLASS;
-            memcpy(&assemblyLoadSig[offset], &buffer, size);
-            offset += size;
-            assemblyLoadSig[offset] = ELEMENT_TYPE_STRING;
-
-            mdMemberRef assemblyLoadMemberRef;
-            hr = pEmit->DefineMemberRef(
-                assemblyTypeRef,
-                AssemblyLoadMethodName.data(),
-                assemblyLoadSig,
-                sizeof(assemblyLoadSig),
-                &assemblyLoadMemberRef);
-
-            mdString profilerTraceDllNameTextToken;
-            auto clrProfilerTraceDllName = clrProfilerHomeEnvValue + PathSeparator + ProfilerAssemblyName + ".dll"_W;
-            hr = pEmit->DefineUserString(clrProfilerTraceDllName.data(), (ULONG)clrProfilerTraceDllName.length(), &profilerTraceDllNameTextToken);
-            RETURN_OK_IF_FAILED(hr);
-
-            ILRewriter rewriter(corProfilerInfo, NULL, moduleId, function_token);
-            RETURN_OK_IF_FAILED(rewriter.Import());
-
-            auto pReWriter = &rewriter;
-            ILRewriterWrapper reWriterWrapper(pReWriter);
-            ILInstr * pFirstOriginalInstr = pReWriter->GetILList()->m_pNext;
-            reWriterWrapper.SetILPosition(pFirstOriginalInstr);
-            reWriterWrapper.LoadStr(profilerTraceDllNameTextToken);
-            reWriterWrapper.CallMember(assemblyLoadMemberRef, false);
-            reWriterWrapper.Pop();
-            hr = rewriter.Export();
-            RETURN_OK_IF_FAILED(hr);
-
-            {
-                std::lock_guard<std::mutex> guard(mapLock);
-                iLRewriteMap[function_token] = true;
-            }
-            entryPointReWrote = true;
+        auto functionInfo = GetFunctionInfo(pImport, function_token);
+        if (!functionInfo.IsValid()) {
+            SkipToken(moduleMetaInfo, function_token, SkipInvalidMethod);
             return S_OK;
         }
 
         hr = functionInfo.signature.TryParse();
-        RETURN_OK_IF_FAILED(hr);
+        if (FAILED(hr)) {
+            SkipToken(moduleMetaInfo, function_token, SkipParseFailed);
+            return S_OK;
+        }
 
         if (!(functionInfo.signature.CallingConvention() & IMAGE_CEE_CS_CALLCONV_HASTHIS)) {
+            SkipToken(moduleMetaInfo, function_token, SkipStatic);
             return S_OK;
         }
 
-        if(!FunctionIsNeedTrace(pImport, moduleMetaInfo, functionInfo))
+        std::vector<const TraceMethod*> tracedBy;
+        if(!FunctionIsNeedTrace(pImport, moduleMetaInfo, functionInfo, &tracedBy))
         {
+            if (!traceMatcher.MatchClass(moduleMetaInfo->assemblyName, functionInfo.type.name)) {
+                SkipToken(moduleMetaInfo, typeDef, SkipNoRule);
+            }
+            else {
+                SkipToken(moduleMetaInfo, function_token, SkipNoRule);
+            }
             return S_OK;
         }
 
         //return ref not support
         unsigned elementType;
-        auto retTypeFlags = functionInfo.signature.GetRet().GetTypeFlags(elementType);
+        const auto retTypeFlags = functionInfo.signature.GetRet().GetTypeFlags(elementType);
         if (retTypeFlags & TypeFlagByRef) {
+            SkipToken(moduleMetaInfo, function_token, SkipByRefReturn);
             return S_OK;
         }
 
-        mdAssemblyRef assemblyRef = GetProfilerAssemblyRef(metadata_interfaces,
-            traceConfig.managedAssembly.assemblyMetaData,
-            traceConfig.managedAssembly.publicKey);
-
-        if (assemblyRef == mdAssemblyRefNil) {
-            return S_OK;
-        }
-
-        mdTypeRef traceAgentTypeRef;
-        hr = pEmit->DefineTypeRefByName(
-            assemblyRef,
-            TraceAgentTypeName.data(),
-            &traceAgentTypeRef);
-        RETURN_OK_IF_FAILED(hr);
-
-        COR_SIGNATURE traceInstanceSig[] =
+        //claim the method so concurrent jits of other instantiations don't inject twice,
+        //a failed rewrite is not retried
         {
-            IMAGE_CEE_CS_CALLCONV_DEFAULT,
-            0x00,
-            ELEMENT_TYPE_OBJECT
-        };
-        mdMemberRef getInstanceMemberRef;
-        hr = pEmit->DefineMemberRef(
-            traceAgentTypeRef,
-            GetInstanceMethodName.data(),
-            traceInstanceSig,
-            sizeof(traceInstanceSig),
-            &getInstanceMemberRef);
-        RETURN_OK_IF_FAILED(hr);
-
-        mdTypeRef methodTraceTypeRef;
-        hr = pEmit->DefineTypeRefByName(
-            assemblyRef,
-            MethodTraceTypeName.data(),
-            &methodTraceTypeRef);
-        RETURN_OK_IF_FAILED(hr);
+            std::lock_guard<std::mutex> guard(mapLock);
+            if (!moduleMetaInfo->rewrittenMethods.insert(function_token).second) {
+                return S_OK;
+            }
+        }
 
-        COR_SIGNATURE traceBeforeSig[] =
-        {
-            IMAGE_CEE_CS_CALLCONV_DEFAULT | IMAGE_CEE_CS_CALLCONV_HASTHIS ,
-            0x04,
-            ELEMENT_TYPE_OBJECT,
-            ELEMENT_TYPE_OBJECT,
-            ELEMENT_TYPE_OBJECT,
-            ELEMENT_TYPE_SZARRAY,
-            ELEMENT_TYPE_OBJECT,
-            ELEMENT_TYPE_U4
-        };
-
-        mdMemberRef beforeMemberRef;
-        hr = pEmit->DefineMemberRef(
-            traceAgentTypeRef,
-            BeforeMethodName.data(),
-            traceBeforeSig,
-            sizeof(traceBeforeSig),
-            &beforeMemberRef);
-        RETURN_OK_IF_FAILED(hr);
+        hr = RewriteMethod(moduleId, moduleMetaInfo, metadata_interfaces, pImport, pEmit, functionInfo, retTypeFlags, tracedBy);
+        if (FAILED(hr)) {
+            SkipToken(moduleMetaInfo, function_token, SkipRewriteFailed);
+        }
+        return S_OK;
+    }
 
-        COR_SIGNATURE traceEndSig[] =
-        {
-            IMAGE_CEE_CS_CALLCONV_DEFAULT | IMAGE_CEE_CS_CALLCONV_HASTHIS,
-            0x02,
-            ELEMENT_TYPE_VOID,
-            ELEMENT_TYPE_OBJECT,
-            ELEMENT_TYPE_OBJECT
-        };
-        mdMemberRef endMemberRef;
-        hr = pEmit->DefineMemberRef(
-            methodTraceTypeRef,
-            EndMethodName.data(),
-            traceEndSig,
-            sizeof(traceEndSig),
-            &endMemberRef);
-        RETURN_OK_IF_FAILED(hr);
+    HRESULT CorProfiler::RewriteMethod(ModuleID moduleId,
+        ModuleMetaInfo* moduleMetaInfo,
+        CComPtr<IUnknown>& metadata_interfaces,
+        CComPtr<IMetaDataImport2>& pImport,
+        CComPtr<IMetaDataEmit2>& pEmit,
+        FunctionInfo& functionInfo,
+        unsigned retTypeFlags,
+        const std::vector<const TraceMethod*>& tracedBy)
+    {
+        const mdMethodDef function_token = functionInfo.id;
+        HRESULT hr;
 
         mdAssemblyRef corLibAssemblyRef = GetCorLibAssemblyRef(metadata_interfaces, corAssemblyProperty);
         if (corLibAssemblyRef == mdAssemblyRefNil) {
-            return S_OK;
+            return E_FAIL;
         }
 
         mdTypeRef exTypeRef;
@@ -581,212 +768,186 @@ namespace trace {
             corLibAssemblyRef,
             SystemException.data(),
             &exTypeRef);
-        RETURN_OK_IF_FAILED(hr);
-
-        if (moduleMetaInfo->getTypeFromHandleToken == 0)
-        {
-            mdTypeRef typeRef;
-            hr = pEmit->DefineTypeRefByName(
-                corLibAssemblyRef,
-                SystemTypeName.data(),
-                &typeRef);
-            RETURN_OK_IF_FAILED(hr);
-
-            mdTypeRef runtimeTypeHandleRef;
-            hr = pEmit->DefineTypeRefByName(
-                corLibAssemblyRef,
-                RuntimeTypeHandleTypeName.data(),
-                &runtimeTypeHandleRef);
-            RETURN_OK_IF_FAILED(hr);
-
-            unsigned runtimeTypeHandle_buffer;
-            unsigned type_buffer;
-            auto runtimeTypeHandle_size = CorSigCompressToken(runtimeTypeHandleRef, &runtimeTypeHandle_buffer);
-            auto type_size = CorSigCompressToken(typeRef, &type_buffer);
-            auto* getTypeFromHandleSig = new COR_SIGNATURE[runtimeTypeHandle_size + type_size + 4];
-            unsigned offset = 0;
-            getTypeFromHandleSig[offset++] = IMAGE_CEE_CS_CALLCONV_DEFAULT;
-            getTypeFromHandleSig[offset++] = 0x01;
-            getTypeFromHandleSig[offset++] = ELEMENT_TYPE_CLASS;
-            memcpy(&getTypeFromHandleSig[offset], &type_buffer, type_size);
-            offset += type_size;
-            getTypeFromHandleSig[offset++] = ELEMENT_TYPE_VALUETYPE;
-            memcpy(&getTypeFromHandleSig[offset], &runtimeTypeHandle_buffer, runtimeTypeHandle_size);
-            offset += runtimeTypeHandle_size;
-
-            hr = pEmit->DefineMemberRef(
-                typeRef,
-                GetTypeFromHandleMethodName.data(),
-                getTypeFromHandleSig,
-                sizeof(getTypeFromHandleSig),
-                &moduleMetaInfo->getTypeFromHandleToken);
-            RETURN_OK_IF_FAILED(hr);
-        }
-
-        ILRewriter rewriter(corProfilerInfo, NULL, moduleId, function_token);
-        RETURN_OK_IF_FAILED(rewriter.Import());
+        RETURN_IF_FAILED(hr);
 
-        //ModifyLocalSig
-        hr = ModifyLocalSig(pImport, pEmit, rewriter, exTypeRef, methodTraceTypeRef);
-        RETURN_OK_IF_FAILED(hr);
-
-        //add try catch finally
-        auto pReWriter = &rewriter;
         mdTypeRef objectTypeRef;
         hr = pEmit->DefineTypeRefByName(
             corLibAssemblyRef,
             SystemObject.data(),
             &objectTypeRef);
-        RETURN_OK_IF_FAILED(hr);
-
-        auto indexRet = rewriter.cNewLocals - 3;
-        auto indexEx = rewriter.cNewLocals - 2;
-        auto indexMethodTrace = rewriter.cNewLocals - 1;
-
-        ILRewriterWrapper reWriterWrapper(pReWriter);
-        ILInstr * pFirstOriginalInstr = pReWriter->GetILList()->m_pNext;
-        reWriterWrapper.SetILPosition(pFirstOriginalInstr);
-        reWriterWrapper.LoadNull();
-        reWriterWrapper.StLocal(indexMethodTrace);
-        reWriterWrapper.LoadNull();
-        reWriterWrapper.StLocal(indexEx);
-        reWriterWrapper.LoadNull();
-        reWriterWrapper.StLocal(indexRet);
-        ILInstr* pTryStartInstr = reWriterWrapper.CallMember0(getInstanceMemberRef, false);
-        reWriterWrapper.Cast(traceAgentTypeRef);
-        reWriterWrapper.LoadToken(functionInfo.type.id);
-        reWriterWrapper.CallMember(moduleMetaInfo->getTypeFromHandleToken, false);
-        reWriterWrapper.LoadArgument(0);
-        auto argNum = functionInfo.signature.NumberOfArguments();
-        reWriterWrapper.CreateArray(objectTypeRef, argNum);
-        auto arguments = functionInfo.signature.GetMethodArguments();
-        for (unsigned i = 0; i < argNum; i++) {
-            reWriterWrapper.BeginLoadValueIntoArray(i);
-            reWriterWrapper.LoadArgument(i + 1);
-            auto argTypeFlags = arguments[i].GetTypeFlags(elementType);
-            if(argTypeFlags & TypeFlagByRef) {
-                reWriterWrapper.LoadIND(elementType);
-            }
-            if (argTypeFlags & TypeFlagBoxedType) {
-                auto tok = arguments[i].GetTypeTok(pEmit, corLibAssemblyRef);
-                if (tok == mdTokenNil) {
-                    return S_OK;
-                }
-                reWriterWrapper.Box(tok);
-            }
-            reWriterWrapper.EndLoadValueIntoArray();
-        }
-        reWriterWrapper.LoadInt32((INT32)function_token);
-        reWriterWrapper.CallMember(beforeMemberRef, true);
-        reWriterWrapper.Cast(methodTraceTypeRef);
-        reWriterWrapper.StLocal(rewriter.cNewLocals - 1);
-
-        ILInstr* pRetInstr = pReWriter->NewILInstr();
-        pRetInstr->m_opcode = CEE_RET;
-        pReWriter->InsertAfter(pReWriter->GetILList()->m_pPrev, pRetInstr);
-
-        bool isVoidMethod = (retTypeFlags & TypeFlagVoid) > 0;
-        auto ret = functionInfo.signature.GetRet();
-        bool retIsBoxedType = false;
-        mdToken retTypeTok;
-        if (!isVoidMethod) {
-            retTypeTok = ret.GetTypeTok(pEmit, corLibAssemblyRef);
-            if (ret.GetTypeFlags(elementType) & TypeFlagBoxedType) {
-                retIsBoxedType = true;
+        RETURN_IF_FAILED(hr);
+
+        GUID moduleVersionId;
+        hr = pImport->GetScopeProps(NULL, 0, NULL, &moduleVersionId);
+        RETURN_IF_FAILED(hr);
+
+        const auto probeId = ProbeTable::Instance()->GetOrAdd(moduleId, function_token,
+            moduleVersionId, moduleMetaInfo->assemblyName, functionInfo.type.name + "."_W + functionInfo.name);
+        const auto pCounters = ProbeTable::Instance()->GetCounters(probeId);
+
+        //the injected code only depends on the signature shape, tokens are patched in
+        MethodShape shape;
+        shape.retTypeFlags = retTypeFlags;
+        //the richest probe kind of the rules wins, a sampled span takes the highest rate
+        //and is rate limited only when all its rules are
+        shape.probeKind = ProbeKind::Counter;
+        shape.sampleEvery = UINT32_MAX;
+        auto rateLimited = true;
+        for (const auto method : tracedBy) {
+            shape.probeKind = std::max(shape.probeKind, method->probe);
+            if (method->probe == ProbeKind::SampledSpan) {
+                shape.sampleEvery = std::min(shape.sampleEvery, method->sampleEvery);
+                shape.maxPerSecond = std::max(shape.maxPerSecond, method->maxPerSecond);
+                rateLimited = rateLimited && method->maxPerSecond > 0;
             }
         }
-        reWriterWrapper.SetILPosition(pRetInstr);
-        reWriterWrapper.StLocal(indexEx);
-        ILInstr* pRethrowInstr = reWriterWrapper.Rethrow();
-
-        reWriterWrapper.LoadLocal(indexMethodTrace);
-        ILInstr* pNewInstr = pReWriter->NewILInstr();
-        pNewInstr->m_opcode = CEE_BRFALSE_S;
-        pReWriter->InsertBefore(pRetInstr, pNewInstr);
-
-        reWriterWrapper.LoadLocal(indexMethodTrace);
-        reWriterWrapper.LoadLocal(indexRet);
-        reWriterWrapper.LoadLocal(indexEx);
-        reWriterWrapper.CallMember(endMemberRef, true);
-
-        ILInstr* pEndFinallyInstr = reWriterWrapper.EndFinally();
-        pNewInstr->m_pTarget = pEndFinallyInstr;
-
-        if (!isVoidMethod) {
-            reWriterWrapper.LoadLocal(indexRet);
-            if (retIsBoxedType) {
-                reWriterWrapper.UnboxAny(retTypeTok);
-            }
-            else {
-                reWriterWrapper.Cast(retTypeTok);
-            }
+        if (!rateLimited) {
+            shape.maxPerSecond = 0;
+        }
+        if (shape.probeKind == ProbeKind::SampledSpan && shape.sampleEvery <= 1 && shape.maxPerSecond == 0) {
+            shape.probeKind = ProbeKind::Span;
+        }
+        if (shape.probeKind != ProbeKind::SampledSpan) {
+            shape.sampleEvery = 1;
+            shape.maxPerSecond = 0;
+        }
+        shape.exceptionCapture = traceConfig.exceptionCapture;
+        shape.countHits = traceConfig.governor.enabled;
+        //an argument or the return value is captured when any rule of the method asks for it
+        shape.captureReturn = std::any_of(tracedBy.begin(), tracedBy.end(),
+            [](const TraceMethod* method) { return method->captureReturn; });
+        std::vector<mdToken> tokens(SlotArgumentTypeBase, mdTokenNil);
+        tokens[SlotObjectType] = objectTypeRef;
+        tokens[SlotBeforeMethod] = moduleMetaInfo->agentHelper.beforeMethodDef;
+        tokens[SlotEndMethod] = moduleMetaInfo->agentHelper.endMethodDef;
+        tokens[SlotExceptionType] = exTypeRef;
+        tokens[SlotProbeId] = probeId;
+        const auto isSpan = shape.probeKind == ProbeKind::Span || shape.probeKind == ProbeKind::SampledSpan;
+        shape.controlled = isSpan && controlSegment.GetProbeByte(probeId) != nullptr;
+        if (!(retTypeFlags & TypeFlagVoid) && shape.captureReturn && isSpan) {
+            tokens[SlotReturnType] = functionInfo.signature.GetRet().GetTypeTok(pEmit, corLibAssemblyRef);
+        }
+        if (shape.probeKind == ProbeKind::Timing) {
+            // unmanaged cdecl int64 TimingProbeEnter()
+            const COR_SIGNATURE enterSig[] = { IMAGE_CEE_CS_CALLCONV_C, 0, ELEMENT_TYPE_I8 };
+            hr = pEmit->GetTokenFromSig(enterSig, sizeof(enterSig), &tokens[SlotTimingEnter]);
+            RETURN_IF_FAILED(hr);
+            // unmanaged cdecl void TimingProbeExit(uint32, int64)
+            const COR_SIGNATURE exitSig[] = { IMAGE_CEE_CS_CALLCONV_C, 2, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U4, ELEMENT_TYPE_I8 };
+            hr = pEmit->GetTokenFromSig(exitSig, sizeof(exitSig), &tokens[SlotTimingExit]);
+            RETURN_IF_FAILED(hr);
+        }
+        if (shape.maxPerSecond > 0) {
+            mdTypeRef environmentTypeRef;
+            hr = pEmit->DefineTypeRefByName(corLibAssemblyRef, SystemEnvironment.data(), &environmentTypeRef);
+            RETURN_IF_FAILED(hr);
+            // static int32 get_TickCount()
+            const COR_SIGNATURE getTickCountSig[] = { IMAGE_CEE_CS_CALLCONV_DEFAULT, 0, ELEMENT_TYPE_I4 };
+            hr = pEmit->DefineMemberRef(environmentTypeRef, GetTickCountMethodName.data(),
+                getTickCountSig, sizeof(getTickCountSig), &tokens[SlotTickCount]);
+            RETURN_IF_FAILED(hr);
         }
 
-        for (ILInstr * pInstr = pReWriter->GetILList()->m_pNext;
-            pInstr != pReWriter->GetILList();
-            pInstr = pInstr->m_pNext) {
-            switch (pInstr->m_opcode)
-            {
-            case CEE_RET:
-            {
-                if (pInstr != pRetInstr) {
-                    if (!isVoidMethod) {
-                        reWriterWrapper.SetILPosition(pInstr);
-                        if (retIsBoxedType) {
-                            reWriterWrapper.Box(retTypeTok);
-                        }
-                        reWriterWrapper.StLocal(indexRet);
-                    }
-                    pInstr->m_opcode = CEE_LEAVE_S;
-                    pInstr->m_pTarget = pEndFinallyInstr->m_pNext;
+        const auto arguments = functionInfo.signature.GetMethodArguments();
+        for (unsigned i = 0; i < arguments.size(); i++) {
+            const auto& argument = arguments[i];
+            ArgumentShape argumentShape{};
+            argumentShape.typeFlags = argument.GetTypeFlags(argumentShape.elementType);
+            argumentShape.captured = isSpan && std::any_of(tracedBy.begin(), tracedBy.end(),
+                [i](const TraceMethod* method) { return method->CapturesArgument(i); });
+            mdToken argumentTypeTok = mdTokenNil;
+            if (argumentShape.captured && (argumentShape.typeFlags & TypeFlagBoxedType)) {
+                argumentTypeTok = argument.GetTypeTok(pEmit, corLibAssemblyRef);
+                if (argumentTypeTok == mdTokenNil) {
+                    return E_FAIL;
                 }
-                break;
-            }
-            default:
-                break;
             }
+            shape.arguments.push_back(argumentShape);
+            tokens.push_back(argumentTypeTok);
         }
 
-        EHClause exClause{};
-        exClause.m_Flags = COR_ILEXCEPTION_CLAUSE_NONE;
-        exClause.m_pTryBegin = pTryStartInstr;
-        exClause.m_pTryEnd = pRethrowInstr->m_pPrev;
-        exClause.m_pHandlerBegin = pRethrowInstr->m_pPrev;
-        exClause.m_pHandlerEnd = pRethrowInstr;
-        exClause.m_ClassToken = exTypeRef;
+        //the governor needs the original body to revert to
+        LPCBYTE pOriginalIL = nullptr;
+        ULONG originalILSize = 0;
+        if (shape.countHits) {
+            hr = corProfilerInfo->GetILFunctionBody(moduleId, function_token, &pOriginalIL, &originalILSize);
+            RETURN_IF_FAILED(hr);
+        }
+
+        ILRewriter rewriter(corProfilerInfo, NULL, moduleId, function_token);
+        rewriter.SetILFunctionBodyAllocator(moduleMetaInfo->methodMalloc.Get());
+        RETURN_IF_FAILED(rewriter.Import());
 
-        EHClause finallyClause{};
-        finallyClause.m_Flags = COR_ILEXCEPTION_CLAUSE_FINALLY;
-        finallyClause.m_pTryBegin = pTryStartInstr;
-        finallyClause.m_pTryEnd = pRethrowInstr->m_pNext;
-        finallyClause.m_pHandlerBegin = pRethrowInstr->m_pNext;
-        finallyClause.m_pHandlerEnd = pEndFinallyInstr;
+        const auto ilTemplate = ilTemplateCache.Get(shape);
+
+        //ModifyLocalSig
+        if (!ilTemplate->locals.empty()) {
+            hr = ModifyLocalSig(pImport, pEmit, rewriter, ilTemplate->locals, exTypeRef,
+                functionInfo.signature.GetRet(), moduleMetaInfo);
+            RETURN_IF_FAILED(hr);
+        }
 
-        auto m_pEHNew = new EHClause[rewriter.m_nEH + 2];
-        for (unsigned i = 0; i < rewriter.m_nEH; i++) {
-            m_pEHNew[i] = rewriter.m_pEH[i];
+        //add try catch finally
+        const auto localBase = rewriter.cNewLocals - (unsigned)ilTemplate->locals.size();
+        ProbeAddresses addresses{};
+        addresses.pCounters = pCounters;
+        if (shape.controlled) {
+            addresses.pKillSwitch = controlSegment.GetKillSwitch();
+            addresses.pProbeByte = controlSegment.GetProbeByte(probeId);
+            addresses.probeMask = ControlSegment::GetProbeMask(probeId);
         }
+        hr = StampILTemplate(rewriter, *ilTemplate, tokens, localBase, addresses);
+        RETURN_IF_FAILED(hr);
 
-        rewriter.m_nEH += 2;
-        m_pEHNew[rewriter.m_nEH - 2] = exClause;
-        m_pEHNew[rewriter.m_nEH - 1] = finallyClause;
-        rewriter.m_pEH = m_pEHNew;
+        const auto unoptimizedSize = rewriter.GetCodeSize();
+        rewriter.Peephole();
 
         hr = rewriter.Export();
-        RETURN_OK_IF_FAILED(hr);
+        if (FAILED(hr)) {
+            Warn("TypeName:{} MethodName:{} IL ReWirte Rejected HRESULT:{}", ToString(functionInfo.type.name), ToString(functionInfo.name), hr);
+            return hr;
+        }
 
+        const auto originalSize = rewriter.GetImportedCodeSize();
+        const auto optimizedSize = rewriter.GetCodeSize();
         {
-            std::lock_guard<std::mutex> guard(mapLock);
-            iLRewriteMap[function_token] = true;
+            std::lock_guard<std::mutex> guard(ilSizeLock);
+            rewrittenMethodCount++;
+            originalILBytes += originalSize;
+            unoptimizedILBytes += unoptimizedSize;
+            optimizedILBytes += optimizedSize;
         }
 
-        Info("TypeName:{} MethodName:{} IL ReWirte ", ToString(functionInfo.type.name), ToString(functionInfo.name));
+        if (shape.countHits) {
+            overheadGovernor.Track(probeId, moduleId, function_token, &pCounters->hits, pOriginalIL, originalILSize);
+        }
+
+        Info("TypeName:{} MethodName:{} ProbeId:{} ILSize:{}->{} IL ReWirte ", ToString(functionInfo.type.name), ToString(functionInfo.name), probeId, originalSize, optimizedSize);
 
-        return  S_OK;
+        return S_OK;
     }
 
     HRESULT STDMETHODCALLTYPE CorProfiler::JITCompilationFinished(FunctionID functionId, HRESULT hrStatus, BOOL fIsSafeToBlock)
     {
+        //every tier compiles from the rewritten IL, at debug level the
+        //compilations after the first of a method are its tier-1 (or OSR) code
+        if (!CLogger::Instance()->m_fileout->should_log(spdlog::level::debug)) {
+            return S_OK;
+        }
+
+        mdToken function_token = mdTokenNil;
+        ModuleID moduleId;
+        auto hr = corProfilerInfo->GetFunctionInfo(functionId, NULL, &moduleId, &function_token);
+        RETURN_OK_IF_FAILED(hr);
+        {
+            std::lock_guard<std::mutex> guard(mapLock);
+            const auto it = moduleMetaInfoMap.find(moduleId);
+            if (it == moduleMetaInfoMap.end() || it->second->rewrittenMethods.count(function_token) == 0) {
+                return S_OK;
+            }
+        }
+
+        Debug("FunctionId:{} Token:{} Status:{} Rewritten Method Jitted", functionId, function_token, hrStatus);
         return S_OK;
     }
 
@@ -977,6 +1138,16 @@ namespace trace {
 
     HRESULT STDMETHODCALLTYPE CorProfiler::ExceptionUnwindFunctionEnter(FunctionID functionId)
     {
+        if (!traceConfig.enterLeave.enabled) {
+            return S_OK;
+        }
+        {
+            std::lock_guard<std::mutex> guard(hookLock);
+            if (hookedFunctions.count(functionId) == 0) {
+                return S_OK;
+            }
+        }
+        EnterLeaveUnwind();
         return S_OK;
     }
 
@@ -1087,6 +1258,15 @@ namespace trace {
 
     HRESULT STDMETHODCALLTYPE CorProfiler::GetReJITParameters(ModuleID moduleId, mdMethodDef methodId, ICorProfilerFunctionControl *pFunctionControl)
     {
+        std::vector<BYTE> originalIL;
+        if (!overheadGovernor.TryGetRevertedIL(moduleId, methodId, &originalIL)) {
+            return S_OK;
+        }
+
+        auto hr = pFunctionControl->SetILFunctionBody((ULONG)originalIL.size(), originalIL.data());
+        RETURN_OK_IF_FAILED(hr);
+
+        Info("Governor Reverted ModuleID:{} MethodDef:{}", moduleId, methodId);
         return S_OK;
     }
 
@@ -1097,6 +1277,7 @@ namespace trace {
 
     HRESULT STDMETHODCALLTYPE CorProfiler::ReJITError(ModuleID moduleId, mdMethodDef methodId, FunctionID functionId, HRESULT hrStatus)
     {
+        Warn("ReJITError ModuleID:{} MethodDef:{} HRESULT:{}", moduleId, methodId, hrStatus);
         return S_OK;
     }
 
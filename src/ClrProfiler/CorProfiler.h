@@ -6,11 +6,19 @@
 #include <mutex>
 #include <atomic>
 #include <unordered_map>
+#include <unordered_set>
 #include "cor.h"
 #include "corprof.h"
 #include "clr_helpers.h"
 #include "il_rewriter.h"
 #include "config_loader.h"
+#include "control_segment.h"
+#include "enter_leave.h"
+#include "il_template.h"
+#include "trace_matcher.h"
+#include "instrumentation_plan.h"
+#include "overhead_governor.h"
+#include "work_queue.h"
 
 namespace trace {
 
@@ -25,17 +33,45 @@ namespace trace {
         //clrProfilerHomeEnvValue
         WSTRING clrProfilerHomeEnvValue;
 
-        //iLRewriteMap ,because generic method has multi functionid
-        std::unordered_map<mdMethodDef, bool> iLRewriteMap{};
-
         AssemblyProperty corAssemblyProperty{};
-        bool entryPointReWrote = false;
 
         //moduleMetaInfoMap
         std::unordered_map<ModuleID, ModuleMetaInfo*> moduleMetaInfoMap{};
 
         //TraceConfig
         TraceConfig traceConfig;
+
+        //traceConfig rules compiled for name lookups
+        TraceMatcher traceMatcher;
+
+        //candidate methods compiled offline, keyed by module mvid
+        InstrumentationPlan instrumentationPlan;
+
+        //injected code per signature shape
+        ILTemplateCache ilTemplateCache;
+
+        //reads the metadata of loaded modules off the loader thread
+        WorkQueue moduleAnalysis;
+
+        //reverts methods whose probes cost too much
+        OverheadGovernor overheadGovernor;
+
+        //probe enable bits ClrProfilerCtl flips at runtime
+        ControlSegment controlSegment;
+
+        //functions with enter/leave hooks, an unwind of any other frame is ignored
+        std::mutex hookLock;
+        std::unordered_set<FunctionID> hookedFunctions{};
+
+        //never instrument decisions per reason, reported at shutdown
+        UINT64 skipCounts[SkipReasonCount]{};
+
+        //IL size of instrumented methods, reported at shutdown
+        std::mutex ilSizeLock;
+        UINT64 rewrittenMethodCount = 0;
+        UINT64 originalILBytes = 0;
+        UINT64 unoptimizedILBytes = 0;
+        UINT64 optimizedILBytes = 0;
     public:
         CorProfiler();
         virtual ~CorProfiler();
@@ -170,6 +206,29 @@ namespace trace {
             return count;
         }
 
-        bool FunctionIsNeedTrace(CComPtr<IMetaDataImport2>& pImport, ModuleMetaInfo* moduleMetaInfo, FunctionInfo functionInfo);
+        bool AssemblyIsNeedTrace(const WSTRING& assemblyName);
+
+        void DefineModuleAgentHelper(ModuleID moduleId, ModuleMetaInfo* moduleMetaInfo);
+
+        HRESULT ReadCorAssemblyProperty(const ModuleInfo& moduleInfo);
+
+        void ScanModuleMethods(const ModuleInfo& moduleInfo, ModuleMetaInfo* moduleMetaInfo);
+
+        void SkipToken(ModuleMetaInfo* moduleMetaInfo, mdToken token, SkipReason reason);
+
+        UINT_PTR HookFunction(FunctionID functionId, BOOL* pbHookFunction);
+
+        HRESULT RewriteMethod(ModuleID moduleId,
+            ModuleMetaInfo* moduleMetaInfo,
+            CComPtr<IUnknown>& metadata_interfaces,
+            CComPtr<IMetaDataImport2>& pImport,
+            CComPtr<IMetaDataEmit2>& pEmit,
+            FunctionInfo& functionInfo,
+            unsigned retTypeFlags,
+            const std::vector<const TraceMethod*>& tracedBy);
+
+        //tracedBy gets every rule matching the method, its names and params
+        bool FunctionIsNeedTrace(CComPtr<IMetaDataImport2>& pImport, ModuleMetaInfo* moduleMetaInfo, FunctionInfo functionInfo,
+            std::vector<const TraceMethod*>* tracedBy);
     };
 }
@@ -0,0 +1,225 @@
+#include "agent_helper.h"
+#include "clr_helpers.h"
+#include "il_rewriter.h"
+#include "il_rewriter_wrapper.h"
+#include "signature_builder.h"
+#include "macros.h"
+
+namespace trace
+{
+    static HRESULT FindAgentHelper(CComPtr<IMetaDataImport2>& pImport,
+        PCCOR_SIGNATURE beforeSig, ULONG beforeSigSize,
+        PCCOR_SIGNATURE endSig, ULONG endSigSize,
+        AgentHelper* agentHelper)
+    {
+        mdTypeDef helperTypeDef;
+        auto hr = pImport->FindTypeDefByName(AgentHelperTypeName.data(), mdTokenNil, &helperTypeDef);
+        if (FAILED(hr)) {
+            return hr;
+        }
+
+        IfFailRet(pImport->FindMethod(helperTypeDef, HelperBeforeMethodName.data(),
+            beforeSig, beforeSigSize, &agentHelper->beforeMethodDef));
+        IfFailRet(pImport->FindMethod(helperTypeDef, HelperEndMethodName.data(),
+            endSig, endSigSize, &agentHelper->endMethodDef));
+        return S_OK;
+    }
+
+    HRESULT DefineAgentHelper(ICorProfilerInfo* corProfilerInfo,
+        ModuleID moduleId,
+        CComPtr<IUnknown>& metadata_interfaces,
+        mdAssemblyRef corLibAssemblyRef,
+        mdAssemblyRef profilerAssemblyRef,
+        const WSTRING& agentPath,
+        IMethodMalloc* methodMalloc,
+        AgentHelper* agentHelper)
+    {
+        auto pImport = metadata_interfaces.As<IMetaDataImport2>(IID_IMetaDataImport);
+        auto pEmit = metadata_interfaces.As<IMetaDataEmit2>(IID_IMetaDataEmit);
+        if (pEmit.IsNull() || pImport.IsNull()) {
+            return E_FAIL;
+        }
+
+        COR_SIGNATURE beforeSig[] =
+        {
+            IMAGE_CEE_CS_CALLCONV_DEFAULT,
+            0x03,
+            ELEMENT_TYPE_OBJECT,
+            ELEMENT_TYPE_OBJECT,
+            ELEMENT_TYPE_SZARRAY,
+            ELEMENT_TYPE_OBJECT,
+            ELEMENT_TYPE_U4
+        };
+
+        COR_SIGNATURE endSig[] =
+        {
+            IMAGE_CEE_CS_CALLCONV_DEFAULT,
+            0x03,
+            ELEMENT_TYPE_VOID,
+            ELEMENT_TYPE_OBJECT,
+            ELEMENT_TYPE_OBJECT,
+            ELEMENT_TYPE_OBJECT
+        };
+
+        // metadata shared by several loads of the module already has the helper
+        if (SUCCEEDED(FindAgentHelper(pImport, beforeSig, sizeof(beforeSig), endSig, sizeof(endSig), agentHelper))) {
+            return S_OK;
+        }
+
+        mdTypeRef objectTypeRef;
+        IfFailRet(pEmit->DefineTypeRefByName(corLibAssemblyRef, SystemObject.data(), &objectTypeRef));
+
+        mdTypeRef traceAgentTypeRef;
+        IfFailRet(pEmit->DefineTypeRefByName(profilerAssemblyRef, TraceAgentTypeName.data(), &traceAgentTypeRef));
+
+        mdTypeRef methodTraceTypeRef;
+        IfFailRet(pEmit->DefineTypeRefByName(profilerAssemblyRef, MethodTraceTypeName.data(), &methodTraceTypeRef));
+
+        COR_SIGNATURE traceInstanceSig[] =
+        {
+            IMAGE_CEE_CS_CALLCONV_DEFAULT,
+            0x00,
+            ELEMENT_TYPE_OBJECT
+        };
+        mdMemberRef getInstanceMemberRef;
+        IfFailRet(pEmit->DefineMemberRef(traceAgentTypeRef, GetInstanceMethodName.data(),
+            traceInstanceSig, sizeof(traceInstanceSig), &getInstanceMemberRef));
+
+        COR_SIGNATURE traceBeforeSig[] =
+        {
+            IMAGE_CEE_CS_CALLCONV_DEFAULT | IMAGE_CEE_CS_CALLCONV_HASTHIS,
+            0x03,
+            ELEMENT_TYPE_OBJECT,
+            ELEMENT_TYPE_OBJECT,
+            ELEMENT_TYPE_SZARRAY,
+            ELEMENT_TYPE_OBJECT,
+            ELEMENT_TYPE_U4
+        };
+        mdMemberRef traceBeforeMemberRef;
+        IfFailRet(pEmit->DefineMemberRef(traceAgentTypeRef, BeforeMethodName.data(),
+            traceBeforeSig, sizeof(traceBeforeSig), &traceBeforeMemberRef));
+
+        COR_SIGNATURE traceEndSig[] =
+        {
+            IMAGE_CEE_CS_CALLCONV_DEFAULT | IMAGE_CEE_CS_CALLCONV_HASTHIS,
+            0x02,
+            ELEMENT_TYPE_VOID,
+            ELEMENT_TYPE_OBJECT,
+            ELEMENT_TYPE_OBJECT
+        };
+        mdMemberRef traceEndMemberRef;
+        IfFailRet(pEmit->DefineMemberRef(methodTraceTypeRef, EndMethodName.data(),
+            traceEndSig, sizeof(traceEndSig), &traceEndMemberRef));
+
+        mdTypeDef helperTypeDef;
+        IfFailRet(pEmit->DefineTypeDef(AgentHelperTypeName.data(),
+            tdNotPublic | tdAbstract | tdSealed,
+            objectTypeRef, NULL, &helperTypeDef));
+
+        // the only method that references the agent, it is jitted on the first probe hit
+        mdMethodDef beforeThunkMethodDef;
+        IfFailRet(pEmit->DefineMethod(helperTypeDef, HelperBeforeThunkMethodName.data(),
+            mdPrivate | mdStatic | mdHideBySig,
+            beforeSig, sizeof(beforeSig), 0, miIL | miManaged | miNoInlining,
+            &beforeThunkMethodDef));
+
+        IfFailRet(pEmit->DefineMethod(helperTypeDef, HelperBeforeMethodName.data(),
+            mdAssem | mdStatic | mdHideBySig,
+            beforeSig, sizeof(beforeSig), 0, miIL | miManaged,
+            &agentHelper->beforeMethodDef));
+
+        IfFailRet(pEmit->DefineMethod(helperTypeDef, HelperEndMethodName.data(),
+            mdAssem | mdStatic | mdHideBySig,
+            endSig, sizeof(endSig), 0, miIL | miManaged | miNoInlining,
+            &agentHelper->endMethodDef));
+
+        {
+            ILRewriter rewriter(corProfilerInfo, NULL, moduleId, beforeThunkMethodDef);
+            rewriter.SetILFunctionBodyAllocator(methodMalloc);
+            rewriter.InitializeTiny();
+            ILRewriterWrapper reWriterWrapper(&rewriter);
+            reWriterWrapper.SetILPosition(rewriter.GetCodeEnd());
+            reWriterWrapper.CallMember(getInstanceMemberRef, false);
+            reWriterWrapper.Cast(traceAgentTypeRef);
+            reWriterWrapper.LoadArgument(0);
+            reWriterWrapper.LoadArgument(1);
+            reWriterWrapper.LoadArgument(2);
+            reWriterWrapper.CallMember(traceBeforeMemberRef, true);
+            reWriterWrapper.Return();
+            IfFailRet(rewriter.Export());
+        }
+
+        {
+            ILRewriter rewriter(corProfilerInfo, NULL, moduleId, agentHelper->beforeMethodDef);
+            rewriter.SetILFunctionBodyAllocator(methodMalloc);
+            rewriter.InitializeTiny();
+            ILRewriterWrapper reWriterWrapper(&rewriter);
+            reWriterWrapper.SetILPosition(rewriter.GetCodeEnd());
+            reWriterWrapper.LoadArgument(0);
+            reWriterWrapper.LoadArgument(1);
+            reWriterWrapper.LoadArgument(2);
+            reWriterWrapper.CallMember(beforeThunkMethodDef, false);
+            reWriterWrapper.Return();
+
+            if (!agentPath.empty()) {
+                COR_SIGNATURE agentLoadedSig[] =
+                {
+                    IMAGE_CEE_CS_CALLCONV_FIELD,
+                    ELEMENT_TYPE_BOOLEAN
+                };
+                mdFieldDef agentLoadedFieldDef;
+                IfFailRet(pEmit->DefineField(helperTypeDef, AgentLoadedFieldName.data(),
+                    fdPrivate | fdStatic,
+                    agentLoadedSig, sizeof(agentLoadedSig),
+                    ELEMENT_TYPE_VOID, NULL, 0, &agentLoadedFieldDef));
+
+                mdTypeRef assemblyTypeRef;
+                IfFailRet(pEmit->DefineTypeRefByName(corLibAssemblyRef, AssemblyTypeName.data(), &assemblyTypeRef));
+
+                SignatureBuilder assemblyLoadSig;
+                assemblyLoadSig.Append(IMAGE_CEE_CS_CALLCONV_DEFAULT);
+                assemblyLoadSig.AppendData(1);
+                assemblyLoadSig.Append(ELEMENT_TYPE_CLASS);
+                assemblyLoadSig.AppendToken(assemblyTypeRef);
+                assemblyLoadSig.Append(ELEMENT_TYPE_STRING);
+
+                mdMemberRef assemblyLoadMemberRef;
+                IfFailRet(pEmit->DefineMemberRef(assemblyTypeRef, AssemblyLoadMethodName.data(),
+                    assemblyLoadSig.Head(), assemblyLoadSig.Size(), &assemblyLoadMemberRef));
+
+                mdString agentPathToken;
+                IfFailRet(pEmit->DefineUserString(agentPath.data(), (ULONG)agentPath.length(), &agentPathToken));
+
+                // once-guard in front of the thunk call, a racing second LoadFrom returns the same assembly
+                rewriter.Commit();
+                const unsigned invokeThunk = 0;
+                reWriterWrapper.SetILPosition(invokeThunk);
+                reWriterWrapper.LoadStaticField(agentLoadedFieldDef);
+                reWriterWrapper.BranchTrue(invokeThunk);
+                reWriterWrapper.LoadStr(agentPathToken);
+                reWriterWrapper.CallMember(assemblyLoadMemberRef, false);
+                reWriterWrapper.Pop();
+                reWriterWrapper.LoadInt32(1);
+                reWriterWrapper.StoreStaticField(agentLoadedFieldDef);
+            }
+            IfFailRet(rewriter.Export());
+        }
+
+        {
+            ILRewriter rewriter(corProfilerInfo, NULL, moduleId, agentHelper->endMethodDef);
+            rewriter.SetILFunctionBodyAllocator(methodMalloc);
+            rewriter.InitializeTiny();
+            ILRewriterWrapper reWriterWrapper(&rewriter);
+            reWriterWrapper.SetILPosition(rewriter.GetCodeEnd());
+            reWriterWrapper.LoadArgument(0);
+            reWriterWrapper.Cast(methodTraceTypeRef);
+            reWriterWrapper.LoadArgument(1);
+            reWriterWrapper.LoadArgument(2);
+            reWriterWrapper.CallMember(traceEndMemberRef, true);
+            reWriterWrapper.Return();
+            IfFailRet(rewriter.Export());
+        }
+
+        return S_OK;
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef CLR_PROFILER_AGENT_HELPER_H_
+#define CLR_PROFILER_AGENT_HELPER_H_
+
+#include "cor.h"
+#include "corprof.h"
+#include "CComPtr.h"
+#include "string.h"  // NOLINT
+
+namespace trace {
+
+    // static methods the profiler defines in every traced module, the injected code
+    // only calls these so nothing references the agent before a probe runs
+    struct AgentHelper
+    {
+        // object Before(object invocationTarget, object[] args, uint probeId)
+        mdMethodDef beforeMethodDef = mdMethodDefNil;
+        // void End(object methodTrace, object ret, object ex)
+        mdMethodDef endMethodDef = mdMethodDefNil;
+
+        bool IsValid() const
+        {
+            return beforeMethodDef != mdMethodDefNil && endMethodDef != mdMethodDefNil;
+        }
+    };
+
+    // Before loads the agent from agentPath on its first call, an empty agentPath
+    // leaves resolving the agent to the runtime (.net framework gac)
+    HRESULT DefineAgentHelper(ICorProfilerInfo* corProfilerInfo,
+        ModuleID moduleId,
+        CComPtr<IUnknown>& metadata_interfaces,
+        mdAssemblyRef corLibAssemblyRef,
+        mdAssemblyRef profilerAssemblyRef,
+        const WSTRING& agentPath,
+        IMethodMalloc* methodMalloc,
+        AgentHelper* agentHelper);
+}
+
+#endif  // CLR_PROFILER_AGENT_HELPER_H_
@@ -1,11 +1,19 @@
 #ifndef CLR_PROFILER_CLRHELPER_H_
 #define CLR_PROFILER_CLRHELPER_H_
 
+#include <atomic>
+#include <condition_variable>
 #include <functional>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include "string.h"  // NOLINT
 #include "util.h"
 #include "CComPtr.h"
+#include "agent_helper.h"
+#include "metadata_reader.h"
 #include <corprof.h>
 #include "logging.h"
 
@@ -21,13 +29,15 @@ namespace trace {
     const auto EndMethodName = "EndMethod"_W;
     const auto MethodTraceTypeName = "ClrProfiler.Trace.MethodTrace"_W;
 
+    const auto AgentHelperTypeName = "ClrProfiler.Trace.Injected.AgentHelper"_W;
+    const auto AgentLoadedFieldName = "agentLoaded"_W;
+    const auto HelperBeforeMethodName = "Before"_W;
+    const auto HelperBeforeThunkMethodName = "BeforeThunk"_W;
+    const auto HelperEndMethodName = "End"_W;
+
     const auto AssemblyTypeName = "System.Reflection.Assembly"_W;
     const auto AssemblyLoadMethodName = "LoadFrom"_W;
 
-    const auto SystemTypeName = "System.Type"_W;
-    const auto GetTypeFromHandleMethodName = "GetTypeFromHandle"_W;
-    const auto RuntimeTypeHandleTypeName = "System.RuntimeTypeHandle"_W;
-
     const auto SystemBoolean = "System.Boolean"_W;
     const auto SystemChar = "System.Char"_W;
     const auto SystemByte = "System.Byte"_W;
@@ -45,6 +55,8 @@ namespace trace {
     const auto SystemString = "System.String"_W;
     const auto SystemObject = "System.Object"_W;
     const auto SystemException = "System.Exception"_W;
+    const auto SystemEnvironment = "System.Environment"_W;
+    const auto GetTickCountMethodName = "get_TickCount"_W;
 
     template <typename T>
     class EnumeratorIterator;
@@ -273,16 +285,72 @@ namespace trace {
         bool is_valid() const { return id != 0; }
     };
 
+    // why a method is never instrumented
+    enum SkipReason
+    {
+        SkipNoRule,
+        SkipInvalidMethod,
+        SkipParseFailed,
+        SkipStatic,
+        SkipByRefReturn,
+        SkipRewriteFailed,
+        SkipReasonCount
+    };
+
     class ModuleMetaInfo {
     private:
+        std::atomic<bool> ready{ false };
+        std::mutex readyLock;
+        std::condition_variable readySignal;
     public:
-        const mdToken entryPointToken;
         const WSTRING assemblyName;
-        ModuleMetaInfo(mdToken entry_point_token, WSTRING assembly_name)
-            : entryPointToken(entry_point_token),
-              assemblyName(assembly_name){}
+        ModuleMetaInfo(WSTRING assembly_name)
+            : assemblyName(assembly_name){}
+
+        // traced modules are analyzed on the profiler worker, until then
+        // metadataReader, candidateMethods and agentHelper are incomplete
+        bool IsReady() const { return ready.load(std::memory_order_acquire); }
+
+        void SetReady() {
+            {
+                std::lock_guard<std::mutex> guard(readyLock);
+                ready.store(true, std::memory_order_release);
+            }
+            readySignal.notify_all();
+        }
+
+        void WaitReady() {
+            std::unique_lock<std::mutex> guard(readyLock);
+            readySignal.wait(guard, [this] { return IsReady(); });
+        }
+
+        AgentHelper agentHelper{};
 
-        mdToken getTypeFromHandleToken = 0;
+        // tables of the loaded image, not open for dynamic modules
+        MetadataReader metadataReader{};
+        // image methods whose names match a rule, the others are skipped at JIT
+        std::unordered_set<mdMethodDef> candidateMethods{};
+
+        // IL allocator of the module, every rewrite allocates its body from it
+        CComPtr<IMethodMalloc> methodMalloc{};
+
+        // methods claimed for rewriting, SetILFunctionBody makes the rewrite
+        // stick for every later tier, OSR and instantiation of the method
+        std::unordered_set<mdMethodDef> rewrittenMethods{};
+
+        // methods never to be instrumented, and types matching no rule
+        // (a method token and a type token never collide)
+        std::unordered_map<mdToken, SkipReason> skippedTokens{};
+
+        struct LocalSig {
+            mdSignature token;
+            ULONG cLocals;
+        };
+        std::mutex localSigLock;
+        // original local var sig and the encoded types of the template locals
+        // to the sig with those locals appended, methods sharing their locals
+        // share the augmented sig
+        std::map<std::pair<mdSignature, std::string>, LocalSig> localSigs{};
     };
 
     struct ModuleInfo {
@@ -302,12 +370,27 @@ namespace trace {
             return ((flags & COR_PRF_MODULE_WINDOWS_RUNTIME) != 0);
         }
 
-        mdToken GetEntryPointToken() const {
-            if (baseLoadAddress == nullptr) {
-                return  mdTokenNil;
+        // the metadata root of the loaded image, nullptr for dynamic modules
+        LPCBYTE GetMetadata(ULONG* size) const {
+            const auto corHeader = GetCorHeader();
+            if (corHeader == nullptr || corHeader->MetaData.VirtualAddress == 0) {
+                return nullptr;
             }
+            *size = VAL32(corHeader->MetaData.Size);
+            return GetRvaData(VAL32(corHeader->MetaData.VirtualAddress), GetNtHeaders());
+        }
 
-            const auto pntHeaders = baseLoadAddress + VAL32(((IMAGE_DOS_HEADER*)baseLoadAddress)->e_lfanew);
+    private:
+        LPCBYTE GetNtHeaders() const {
+            return baseLoadAddress + VAL32(((IMAGE_DOS_HEADER*)baseLoadAddress)->e_lfanew);
+        }
+
+        const IMAGE_COR20_HEADER* GetCorHeader() const {
+            if (baseLoadAddress == nullptr || (flags & COR_PRF_MODULE_DYNAMIC)) {
+                return nullptr;
+            }
+
+            const auto pntHeaders = GetNtHeaders();
             const auto ntHeaders = (IMAGE_NT_HEADERS64*)pntHeaders;
             IMAGE_DATA_DIRECTORY directoryEntry;
             if (ntHeaders->OptionalHeader.Magic == VAL16(IMAGE_NT_OPTIONAL_HDR32_MAGIC)) 
@@ -318,11 +401,12 @@ namespace trace {
             {
                 directoryEntry = ntHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_COMHEADER];
             }
-            const auto corHeader = (IMAGE_COR20_HEADER*)GetRvaData(VAL32(directoryEntry.VirtualAddress), pntHeaders);
-            return corHeader->EntryPointToken;
+            if (directoryEntry.VirtualAddress == 0) {
+                return nullptr;
+            }
+            return (IMAGE_COR20_HEADER*)GetRvaData(VAL32(directoryEntry.VirtualAddress), pntHeaders);
         }
 
-    private:
         static ULONG AlignUp(ULONG value, UINT alignment)
         {
             return (value + alignment - 1)&~(alignment - 1);
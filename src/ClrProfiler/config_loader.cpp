@@ -2,6 +2,7 @@
 #include "util.h"
 #include "json.hpp"
 #include "logging.h"
+#include <algorithm>
 #include <fstream>
 
 namespace trace
@@ -28,7 +29,43 @@ namespace trace
                 if (methodName.empty()) {
                     continue;
                 }
-                traceMethods.push_back(TraceMethod{ methodName,paramsName });
+                TraceMethod traceMethod{ methodName,paramsName };
+                const auto captureArguments = el.find("captureArguments");
+                if (captureArguments != el.end() && captureArguments->is_array()) {
+                    traceMethod.captureAllArguments = false;
+                    for (auto& index : *captureArguments) {
+                        if (index.is_number_unsigned()) {
+                            traceMethod.captureArguments.push_back(index.get<unsigned>());
+                        }
+                    }
+                }
+                traceMethod.captureReturn = el.value("captureReturn", true);
+                const auto probe = el.value("probe", "span");
+                if (probe == "counter") {
+                    traceMethod.probe = ProbeKind::Counter;
+                }
+                else if (probe == "exception") {
+                    traceMethod.probe = ProbeKind::Exception;
+                }
+                else if (probe == "timing") {
+                    traceMethod.probe = ProbeKind::Timing;
+                }
+                else if (probe == "sampled") {
+                    // "sampleRate": 0.01 spans one call in 100
+                    const auto sampleRate = el.value("sampleRate", 1.0);
+                    traceMethod.probe = ProbeKind::SampledSpan;
+                    traceMethod.sampleEvery = sampleRate > 0 && sampleRate < 1
+                        ? (unsigned)std::min(1.0 / sampleRate + 0.5, 4294967295.0)
+                        : 1;
+                }
+                // "maxPerSecond": 100 caps the spans of a span or sampled rule,
+                // the calls over it are only counted
+                const auto maxPerSecond = el.value("maxPerSecond", 0u);
+                if (maxPerSecond > 0 && traceMethod.probe >= ProbeKind::SampledSpan) {
+                    traceMethod.probe = ProbeKind::SampledSpan;
+                    traceMethod.maxPerSecond = maxPerSecond;
+                }
+                traceMethods.push_back(traceMethod);
             }
         }
         if(traceMethods.empty()) {
@@ -37,6 +74,94 @@ namespace trace
         return std::make_pair<TraceAssembly, bool>({ assemblyName, className, traceMethods }, true);
     }
 
+    bool TraceMethod::CapturesArgument(unsigned index) const
+    {
+        return captureAllArguments ||
+            std::find(captureArguments.begin(), captureArguments.end(), index) != captureArguments.end();
+    }
+
+    std::vector<WSTRING> PatternsFromJson(const json::value_type& src, const char* key)
+    {
+        std::vector<WSTRING> patterns;
+        auto arr = src.value(key, json::array());
+        if (arr.is_array()) {
+            for (auto& el : arr) {
+                if (!el.is_string()) {
+                    continue;
+                }
+                const auto pattern = Trim(ToWSTRING(el.get<std::string>()));
+                if (!pattern.empty()) {
+                    patterns.push_back(pattern);
+                }
+            }
+        }
+        return patterns;
+    }
+
+    ProcessFilter LoadProcessFilter(const json::value_type& src)
+    {
+        ProcessFilter processFilter;
+        if (src.is_object()) {
+            processFilter.include = PatternsFromJson(src, "include");
+            processFilter.exclude = PatternsFromJson(src, "exclude");
+        }
+        return processFilter;
+    }
+
+    static bool AnyMatch(const std::vector<WSTRING>& patterns,
+        const WSTRING& processName, const WSTRING& commandLine)
+    {
+        for (const auto& pattern : patterns) {
+            if (WildcardMatch(pattern, processName) || WildcardMatch(pattern, commandLine)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool ProcessFilter::IsMatch(const WSTRING& processName, const WSTRING& commandLine) const
+    {
+        if (AnyMatch(exclude, processName, commandLine)) {
+            return false;
+        }
+        return include.empty() || AnyMatch(include, processName, commandLine);
+    }
+
+    GovernorConfig LoadGovernorConfig(const json::value_type& src)
+    {
+        GovernorConfig governor;
+        if (src.is_object()) {
+            governor.enabled = src.value("enabled", governor.enabled);
+            governor.intervalMs = src.value("intervalMs", governor.intervalMs);
+            governor.maxCallsPerSecond = src.value("maxCallsPerSecond", governor.maxCallsPerSecond);
+            governor.probeCostNs = src.value("probeCostNs", governor.probeCostNs);
+            governor.cpuBudgetPercent = src.value("cpuBudgetPercent", governor.cpuBudgetPercent);
+            if (governor.intervalMs == 0) {
+                governor.intervalMs = 1000;
+            }
+        }
+        return governor;
+    }
+
+    ControlConfig LoadControlConfig(const json::value_type& src)
+    {
+        ControlConfig control;
+        if (src.is_object()) {
+            control.enabled = src.value("enabled", control.enabled);
+            control.probeCapacity = src.value("probeCapacity", control.probeCapacity);
+        }
+        return control;
+    }
+
+    EnterLeaveConfig LoadEnterLeaveConfig(const json::value_type& src)
+    {
+        EnterLeaveConfig enterLeave;
+        if (src.is_object()) {
+            enterLeave.enabled = src.value("enabled", enterLeave.enabled);
+        }
+        return enterLeave;
+    }
+
     ManagedAssembly LoadManagedAssembly(const json::value_type& src)
     {
         ManagedAssembly managedAssembly;
@@ -60,11 +185,25 @@ namespace trace
         TraceConfig traceConfig;
         std::vector<TraceAssembly> traceAssemblies;
         ManagedAssembly managedAssembly;
+        auto exceptionCapture = ExceptionCapture::Filter;
+        ProcessFilter processFilter;
+        GovernorConfig governor;
+        ControlConfig control;
+        EnterLeaveConfig enterLeave;
         try {
             json j;
             // parse the stream
             stream >> j;
 
+            if (j.value("exceptionCapture", "filter") == "rethrow") {
+                exceptionCapture = ExceptionCapture::Rethrow;
+            }
+
+            processFilter = LoadProcessFilter(j.value("processFilter", json::object()));
+            governor = LoadGovernorConfig(j.value("governor", json::object()));
+            control = LoadControlConfig(j.value("control", json::object()));
+            enterLeave = LoadEnterLeaveConfig(j.value("enterLeave", json::object()));
+
             for (auto& el : j["instrumentation"]) {
                 auto i = TraceAssemblyFromJson(el);
                 if (std::get<1>(i)) {
@@ -92,6 +231,11 @@ namespace trace
         }
         traceConfig.traceAssemblies = traceAssemblies;
         traceConfig.managedAssembly = managedAssembly;
+        traceConfig.exceptionCapture = exceptionCapture;
+        traceConfig.processFilter = processFilter;
+        traceConfig.governor = governor;
+        traceConfig.control = control;
+        traceConfig.enterLeave = enterLeave;
         return traceConfig;
     }
 
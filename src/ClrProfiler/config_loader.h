@@ -7,12 +7,42 @@
 
 namespace trace {
 
+    // what the injected code of a method does, cheapest first, when several
+    // rules match a method the most expensive kind of them wins
+    enum class ProbeKind
+    {
+        // bumps the probe's hit counter, nothing else
+        Counter,
+        // counts exceptions leaving the method, no call on entry
+        Exception,
+        // native latency histogram of the method, no managed call
+        Timing,
+        // a span for every sampleEvery-th call
+        SampledSpan,
+        // BeforeMethod and EndMethod around every call
+        Span
+    };
+
     struct TraceMethod
     {
          WSTRING methodName;
         WSTRING paramsName;
+        // argument indexes copied into the object[] BeforeMethod gets, the others
+        // stay null, every argument when captureAllArguments
+        bool captureAllArguments = true;
+        std::vector<unsigned> captureArguments;
+        // EndMethod gets null instead of the return value when false
+        bool captureReturn = true;
+        ProbeKind probe = ProbeKind::Span;
+        // SampledSpan takes one call in sampleEvery
+        unsigned sampleEvery = 1;
+        // SampledSpan starts at most maxPerSecond spans a second, 0 has no limit
+        unsigned maxPerSecond = 0;
         TraceMethod() : methodName(""_W), paramsName(""_W) {}
-        TraceMethod(WSTRING methodName, WSTRING paramsName) : methodName(methodName), paramsName(paramsName) {}    };
+        TraceMethod(WSTRING methodName, WSTRING paramsName) : methodName(methodName), paramsName(paramsName) {}
+
+        bool CapturesArgument(unsigned index) const;
+    };
 
     struct TraceAssembly
     {
@@ -51,10 +81,65 @@ namespace trace {
         ASSEMBLYMETADATA assemblyMetaData{};
     };
 
+    // how the injected code observes an exception leaving the traced method
+    enum class ExceptionCapture
+    {
+        // filter that records the exception and returns false, nothing is caught
+        Filter,
+        // catch, record and rethrow
+        Rethrow
+    };
+
+    // processes the profiler stays active in, a pattern matches either the
+    // executable name or the whole command line, '*' and '?' are wildcards
+    struct ProcessFilter
+    {
+        // empty means every process
+        std::vector<WSTRING> include;
+        std::vector<WSTRING> exclude;
+
+        bool IsMatch(const WSTRING& processName, const WSTRING& commandLine) const;
+    };
+
+    // thresholds of the overhead governor, a probe over either limit has its
+    // method reverted to the original IL through ReJIT
+    struct GovernorConfig
+    {
+        bool enabled = false;
+        // how often hit counters are sampled
+        unsigned intervalMs = 1000;
+        // calls per second of a single probe, 0 means no limit
+        UINT64 maxCallsPerSecond = 0;
+        // estimated cost of one BeforeMethod/EndMethod pair
+        unsigned probeCostNs = 500;
+        // estimated probe cost as a percentage of the machine's cpu time
+        double cpuBudgetPercent = 1.0;
+    };
+
+    // shared memory segment ClrProfilerCtl mutes probes through
+    struct ControlConfig
+    {
+        bool enabled = false;
+        // probe ids from 0 up to this have a bit, the probes after it can't be muted
+        unsigned probeCapacity = 65536;
+    };
+
+    // times every function the rules match through the enter/leave hooks of
+    // the profiling api instead of rewriting IL, for exploring whole namespaces
+    struct EnterLeaveConfig
+    {
+        bool enabled = false;
+    };
+
     struct TraceConfig
     {
         std::vector<TraceAssembly> traceAssemblies;
         ManagedAssembly managedAssembly{};
+        ExceptionCapture exceptionCapture = ExceptionCapture::Filter;
+        ProcessFilter processFilter{};
+        GovernorConfig governor{};
+        ControlConfig control{};
+        EnterLeaveConfig enterLeave{};
     };
 
     TraceConfig LoadTraceConfig(const WSTRING& traceHomePath);
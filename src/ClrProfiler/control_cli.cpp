@@ -0,0 +1,78 @@
+// ClrProfilerCtl, mutes and unmutes the probes of a running process through
+// its control segment, probe ids are in the "IL ReWirte" lines of the log
+//
+// usage: ClrProfilerCtl <pid>                      shows the muted probes
+//        ClrProfilerCtl <pid> kill on|off          mutes or unmutes every probe
+//        ClrProfilerCtl <pid> mute <probe id>...
+//        ClrProfilerCtl <pid> unmute <probe id>...
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "control_segment.h"
+
+using namespace trace;
+
+static bool ParseProbeId(const char* arg, UINT32* probeId)
+{
+    char* end;
+    const auto value = strtoul(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0') {
+        return false;
+    }
+    *probeId = (UINT32)value;
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <pid> [kill on|off | mute <probe id>... | unmute <probe id>...]\n", argv[0]);
+        return 2;
+    }
+    const auto processId = atoi(argv[1]);
+    ControlSegment segment;
+    if (!segment.Open(processId)) {
+        fprintf(stderr, "no control segment %s\n", ControlSegmentName(processId).c_str());
+        return 2;
+    }
+
+    if (argc == 2) {
+        printf("Kill:%s Capacity:%u\n", *segment.GetKillSwitch() ? "on" : "off", segment.GetProbeCapacity());
+        for (UINT32 probeId = 0; probeId < segment.GetProbeCapacity(); probeId++) {
+            if (*segment.GetProbeByte(probeId) & ControlSegment::GetProbeMask(probeId)) {
+                printf("Muted %u\n", probeId);
+            }
+        }
+        return 0;
+    }
+
+    const auto command = std::string(argv[2]);
+    if (command == "kill" && argc == 4) {
+        *segment.GetKillSwitch() = strcmp(argv[3], "on") == 0 ? 1 : 0;
+        return 0;
+    }
+    if (command != "mute" && command != "unmute") {
+        fprintf(stderr, "unknown command %s\n", argv[2]);
+        return 2;
+    }
+    auto result = 0;
+    for (auto i = 3; i < argc; i++) {
+        UINT32 probeId;
+        volatile BYTE* pByte;
+        if (!ParseProbeId(argv[i], &probeId) || (pByte = segment.GetProbeByte(probeId)) == nullptr) {
+            fprintf(stderr, "invalid probe id %s\n", argv[i]);
+            result = 2;
+            continue;
+        }
+        // the profiler only reads the bits, another ClrProfilerCtl racing on
+        // the same byte is the only writer that can lose an update
+        if (command == "mute") {
+            *pByte |= ControlSegment::GetProbeMask(probeId);
+        }
+        else {
+            *pByte &= (BYTE)~ControlSegment::GetProbeMask(probeId);
+        }
+    }
+    return result;
+}
@@ -0,0 +1,161 @@
+#include "control_segment.h"
+#include <cstring>
+#include "util.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace trace
+{
+    const DWORD ControlMagic = 0x4C435043;  // CPCL
+    const DWORD ControlVersion = 1;
+
+    std::string ControlSegmentName(int processId)
+    {
+#ifdef _WIN32
+        return "Local\\ClrProfiler." + std::to_string(processId);
+#else
+        return "/ClrProfiler." + std::to_string(processId);
+#endif
+    }
+
+    bool ControlSegment::Map(const std::string& name, bool create, size_t mapSize)
+    {
+#ifdef _WIN32
+        const auto wideName = std::wstring(name.begin(), name.end());
+        mapping = create
+            ? CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, (DWORD)mapSize, wideName.c_str())
+            : OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, wideName.c_str());
+        if (mapping == nullptr) {
+            return false;
+        }
+        if (create && GetLastError() == ERROR_ALREADY_EXISTS) {
+            CloseHandle(mapping);
+            mapping = nullptr;
+            return false;
+        }
+        const auto view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, mapSize);
+        if (view == nullptr) {
+            CloseHandle(mapping);
+            mapping = nullptr;
+            return false;
+        }
+        data = (LPBYTE)view;
+        size = mapSize;
+#else
+        // a stale segment of a crashed process with a reused pid is replaced
+        const auto fd = create
+            ? shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600)
+            : shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0) {
+            return false;
+        }
+        if (create && ftruncate(fd, (off_t)mapSize) != 0) {
+            close(fd);
+            shm_unlink(name.c_str());
+            return false;
+        }
+        struct stat st;
+        if (!create && (fstat(fd, &st) != 0 || (size_t)st.st_size < mapSize)) {
+            close(fd);
+            return false;
+        }
+        const auto view = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (view == MAP_FAILED) {
+            if (create) {
+                shm_unlink(name.c_str());
+            }
+            return false;
+        }
+        data = (LPBYTE)view;
+        size = mapSize;
+#endif
+        return true;
+    }
+
+    bool ControlSegment::Create(DWORD probeCapacity)
+    {
+        Close();
+        const auto name = ControlSegmentName(GetPID());
+        if (!Map(name, true, sizeof(ControlHeader) + (probeCapacity + 7) / 8)) {
+            return false;
+        }
+        ownedName = name;
+        created = true;
+        // new shared memory is zeroed, the magic goes in last
+        const auto header = (ControlHeader*)data;
+        header->version = ControlVersion;
+        header->probeCapacity = probeCapacity;
+        header->magic = ControlMagic;
+        return true;
+    }
+
+    bool ControlSegment::Open(int processId)
+    {
+        Close();
+        created = false;
+        const auto name = ControlSegmentName(processId);
+        if (!Map(name, false, sizeof(ControlHeader))) {
+            return false;
+        }
+        ControlHeader header;
+        memcpy(&header, data, sizeof(header));
+        Close();
+        if (header.magic != ControlMagic || header.version != ControlVersion) {
+            return false;
+        }
+        return Map(name, false, sizeof(ControlHeader) + (header.probeCapacity + 7) / 8);
+    }
+
+    void ControlSegment::Close()
+    {
+        Unlink();
+        if (data == nullptr || created) {
+            return;
+        }
+#ifdef _WIN32
+        UnmapViewOfFile(data);
+        CloseHandle(mapping);
+        mapping = nullptr;
+#else
+        munmap(data, size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+
+    void ControlSegment::Unlink()
+    {
+        if (ownedName.empty()) {
+            return;
+        }
+#ifndef _WIN32
+        // the name of a windows mapping goes away with its last handle
+        shm_unlink(ownedName.c_str());
+#endif
+        ownedName.clear();
+    }
+
+    DWORD ControlSegment::GetProbeCapacity() const
+    {
+        return data != nullptr ? ((const ControlHeader*)data)->probeCapacity : 0;
+    }
+
+    volatile BYTE* ControlSegment::GetKillSwitch() const
+    {
+        return data != nullptr ? &((ControlHeader*)data)->killSwitch : nullptr;
+    }
+
+    volatile BYTE* ControlSegment::GetProbeByte(UINT32 probeId) const
+    {
+        if (probeId >= GetProbeCapacity()) {
+            return nullptr;
+        }
+        return data + sizeof(ControlHeader) + probeId / 8;
+    }
+}
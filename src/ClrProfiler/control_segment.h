@@ -0,0 +1,67 @@
+#ifndef CLR_PROFILER_CONTROL_SEGMENT_H_
+#define CLR_PROFILER_CONTROL_SEGMENT_H_
+
+#include <string>
+#include "cor.h"
+
+namespace trace {
+
+    // layout of the segment, shared with ClrProfilerCtl: ControlHeader then one
+    // bit per probe id, a set bit mutes the probe
+    struct ControlHeader
+    {
+        DWORD magic;
+        DWORD version;
+        DWORD probeCapacity;
+        // not 0 mutes every controlled probe
+        BYTE killSwitch;
+        BYTE reserved[3];
+    };
+
+    // name of the segment of a process, /dev/shm/ClrProfiler.<pid> on linux
+    std::string ControlSegmentName(int processId);
+
+    // shared memory the injected code of span probes reads on every call, so an
+    // external process can mute a probe or all tracing without a ReJIT
+    class ControlSegment
+    {
+    private:
+        LPBYTE data = nullptr;
+        size_t size = 0;
+        // the creating process removes the name again
+        std::string ownedName;
+        // a created segment is never unmapped, jitted code embeds its
+        // addresses and may run until the process exits
+        bool created = false;
+#ifdef _WIN32
+        HANDLE mapping = nullptr;
+#endif
+
+        bool Map(const std::string& name, bool create, size_t mapSize);
+    public:
+        ControlSegment() = default;
+        ControlSegment(const ControlSegment&) = delete;
+        ControlSegment& operator=(const ControlSegment&) = delete;
+        // only unlinks a created segment, see Close
+        ~ControlSegment() { Close(); }
+
+        // creates the zeroed segment of the current process, every probe enabled
+        bool Create(DWORD probeCapacity);
+        // maps the segment another process created
+        bool Open(int processId);
+        // unmaps an opened segment, a created one is unlinked and stays mapped
+        void Close();
+        // removes the name of a created segment and keeps it mapped, the
+        // injected code may still run until the process is gone
+        void Unlink();
+        bool IsOpen() const { return data != nullptr; }
+
+        DWORD GetProbeCapacity() const;
+        volatile BYTE* GetKillSwitch() const;
+        // byte holding the probe's bit, nullptr past the capacity
+        volatile BYTE* GetProbeByte(UINT32 probeId) const;
+        static BYTE GetProbeMask(UINT32 probeId) { return (BYTE)(1 << (probeId & 7)); }
+    };
+}
+
+#endif  // CLR_PROFILER_CONTROL_SEGMENT_H_
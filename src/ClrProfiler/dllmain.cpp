@@ -3,6 +3,7 @@
 
 #include "ClassFactory.h"
 #include "util.h"
+#include "probe_table.h"
 
 const IID IID_IUnknown      = { 0x00000000, 0x0000, 0x0000, { 0xC0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46 } };
 
@@ -41,3 +42,9 @@ extern "C" HRESULT STDMETHODCALLTYPE DllCanUnloadNow()
 {
     return S_OK;
 }
+
+// called by the managed agent the first time it sees a probe id
+extern "C" BOOL STDMETHODCALLTYPE GetProbeInfo(UINT32 probeId, trace::ProbeInfo* pInfo)
+{
+    return trace::ProbeTable::Instance()->TryGet(probeId, pInfo) ? TRUE : FALSE;
+}
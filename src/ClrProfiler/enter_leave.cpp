@@ -0,0 +1,49 @@
+#include "enter_leave.h"
+#include "thread_latency.h"
+
+namespace trace
+{
+    // timestamps of the hooked frames of one thread
+    struct EnterLeaveThread
+    {
+        INT64 starts[EnterLeaveStackDepth];
+        unsigned depth = 0;
+    };
+
+    static thread_local EnterLeaveThread enterLeaveThread;
+
+    void STDMETHODCALLTYPE EnterLeaveEnterHook(FunctionIDOrClientID functionIDOrClientID, COR_PRF_ELT_INFO eltInfo)
+    {
+        auto& thread = enterLeaveThread;
+        if (thread.depth < EnterLeaveStackDepth) {
+            thread.starts[thread.depth] = TimingProbeEnter();
+        }
+        thread.depth++;
+    }
+
+    void STDMETHODCALLTYPE EnterLeaveLeaveHook(FunctionIDOrClientID functionIDOrClientID, COR_PRF_ELT_INFO eltInfo)
+    {
+        auto& thread = enterLeaveThread;
+        if (thread.depth == 0) {
+            return;
+        }
+        thread.depth--;
+        if (thread.depth < EnterLeaveStackDepth) {
+            RecordThreadLatency((UINT32)functionIDOrClientID.clientID, thread.starts[thread.depth]);
+        }
+    }
+
+    // the frame is replaced by its callee, which gets its own enter
+    void STDMETHODCALLTYPE EnterLeaveTailcallHook(FunctionIDOrClientID functionIDOrClientID, COR_PRF_ELT_INFO eltInfo)
+    {
+        EnterLeaveLeaveHook(functionIDOrClientID, eltInfo);
+    }
+
+    void EnterLeaveUnwind()
+    {
+        auto& thread = enterLeaveThread;
+        if (thread.depth > 0) {
+            thread.depth--;
+        }
+    }
+}
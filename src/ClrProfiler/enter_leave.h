@@ -0,0 +1,25 @@
+#ifndef CLR_PROFILER_ENTER_LEAVE_H_
+#define CLR_PROFILER_ENTER_LEAVE_H_
+
+#include "cor.h"
+#include "corprof.h"
+#include "probe_table.h"
+
+namespace trace {
+
+    // hooked frames deeper than this on a thread are not timed
+    const unsigned EnterLeaveStackDepth = 256;
+
+    // hooks for SetEnterLeaveFunctionHooks3WithInfo, the client id of a hooked
+    // function is its probe id. Enter pushes a timestamp on the thread's stack,
+    // leave and tailcall pop it into the thread's latency of the probe, see
+    // RecordThreadLatency
+    void STDMETHODCALLTYPE EnterLeaveEnterHook(FunctionIDOrClientID functionIDOrClientID, COR_PRF_ELT_INFO eltInfo);
+    void STDMETHODCALLTYPE EnterLeaveLeaveHook(FunctionIDOrClientID functionIDOrClientID, COR_PRF_ELT_INFO eltInfo);
+    void STDMETHODCALLTYPE EnterLeaveTailcallHook(FunctionIDOrClientID functionIDOrClientID, COR_PRF_ELT_INFO eltInfo);
+
+    // an exception unwound a hooked frame, its leave hook never runs
+    void EnterLeaveUnwind();
+}
+
+#endif  // CLR_PROFILER_ENTER_LEAVE_H_
@@ -104,6 +104,43 @@ static int k_rgnStackPushes[] = {
 #undef OPDEF
 };
 
+// VarPop is resolved from the call signature, see GetStackPops
+static int k_rgnStackPops[] = {
+
+#define OPDEF(c, s, pop, push, args, type, l, s1, s2, ctrl) pop,
+
+#define Pop0 0
+#define Pop1 1
+#define PopI 1
+#define PopI8 1
+#define PopR4 1
+#define PopR8 1
+#define PopRef 1
+#define VarPop 0
+
+#include "opcode.def"
+
+#undef Pop0
+#undef Pop1
+#undef PopI
+#undef PopI8
+#undef PopR4
+#undef PopR8
+#undef PopRef
+#undef VarPop
+#undef OPDEF
+    0,
+    // CEE_COUNT
+    0,
+    // CEE_SWITCH_ARG
+};
+
+const unsigned ILRewriter::kLoggedInstr;
+const unsigned ILRewriter::kNoInstr;
+
+// Room for the code a template adds, reserved along with the original body
+static const unsigned kInjectedInstrs = 128;
+
 ILRewriter::ILRewriter(
     ICorProfilerInfo* pICorProfilerInfo,
     ICorProfilerFunctionControl* pICorProfilerFunctionControl,
@@ -113,38 +150,40 @@ ILRewriter::ILRewriter(
       m_moduleId(moduleID),
       m_tkMethod(tkMethod),
       m_fGenerateTinyHeader(false),
-      m_pEH(nullptr),
-      m_pOffsetToInstr(nullptr),
-      m_pOutputBuffer(nullptr),
-      m_pIMethodMalloc(nullptr) {
-  m_IL.m_pNext = &m_IL;
-  m_IL.m_pPrev = &m_IL;
-
-  m_nInstrs = 0;
-}
+      m_CodeSize(0),
+      m_endOffset(0),
+      m_pIMethodMalloc(nullptr),
+      m_nEH(0),
+      m_pEH(nullptr) {}
 
 ILRewriter::~ILRewriter() {
-  ILInstr* p = m_IL.m_pNext;
-  while (p != &m_IL) {
-    ILInstr* t = p->m_pNext;
-    delete p;
-    p = t;
-  }
   delete[] m_pEH;
-  delete[] m_pOffsetToInstr;
-  delete[] m_pOutputBuffer;
 
   if (m_pIMethodMalloc) {
     m_pIMethodMalloc->Release();
   }
 }
 
+void ILRewriter::SetILFunctionBodyAllocator(IMethodMalloc* pIMethodMalloc) {
+  if (pIMethodMalloc) {
+    pIMethodMalloc->AddRef();
+  }
+  if (m_pIMethodMalloc) {
+    m_pIMethodMalloc->Release();
+  }
+  m_pIMethodMalloc = pIMethodMalloc;
+}
+
 HRESULT ILRewriter::Import() {
   LPCBYTE pMethodBytes;
 
   IfFailRet(m_pICorProfilerInfo->GetILFunctionBody(m_moduleId, m_tkMethod,
                                                    &pMethodBytes, NULL));
 
+  return Import(pMethodBytes);
+}
+
+HRESULT ILRewriter::Import(LPCBYTE pMethodBytes) {
   COR_ILMETHOD_DECODER decoder((COR_ILMETHOD*)pMethodBytes);
 
   // Import the header flags
@@ -161,15 +200,19 @@ HRESULT ILRewriter::Import() {
   return S_OK;
 }
 
-HRESULT ILRewriter::ImportIL(LPCBYTE pIL) {
-  m_pOffsetToInstr = new ILInstr*[m_CodeSize + 1];
-  IfNullRet(m_pOffsetToInstr);
-
-  ZeroMemory(m_pOffsetToInstr, m_CodeSize * sizeof(ILInstr*));
+void ILRewriter::InitializeTiny() {
+  m_tkLocalVarSig = mdTokenNil;
+  m_maxStack = 0;
+  m_flags = CorILMethod_InitLocals;
+  m_CodeSize = 0;
+  m_nEH = 0;
+}
 
-  // Set the sentinel instruction
-  m_pOffsetToInstr[m_CodeSize] = &m_IL;
-  m_IL.m_opcode = -1;
+HRESULT ILRewriter::ImportIL(LPCBYTE pIL) {
+  // A method never has more instructions than bytes, so with room for the
+  // injected code Commit merges without growing the array
+  m_code.reserve(m_CodeSize + kInjectedInstrs);
+  m_offsetToInstr.assign(m_CodeSize + 1, kNoInstr);
 
   bool fBranch = false;
   unsigned offset = 0;
@@ -204,14 +247,14 @@ HRESULT ILRewriter::ImportIL(LPCBYTE pIL) {
       return COR_E_INVALIDPROGRAM;
     }
 
-    ILInstr* pInstr = NewILInstr();
-    IfNullRet(pInstr);
+    if (opcode == CEE_RET) m_rets.push_back(GetCodeEnd());
 
-    pInstr->m_opcode = opcode;
+    m_offsetToInstr[startOffset] = GetCodeEnd();
 
-    InsertBefore(&m_IL, pInstr);
-
-    m_pOffsetToInstr[startOffset] = pInstr;
+    m_code.push_back(ILInstr());
+    ILInstr* pInstr = &m_code.back();
+    pInstr->m_opcode = opcode;
+    pInstr->m_Arg64 = 0;
 
     switch (flags) {
       case 0:
@@ -254,15 +297,12 @@ HRESULT ILRewriter::ImportIL(LPCBYTE pIL) {
             return COR_E_INVALIDPROGRAM;
           }
 
-          pInstr = NewILInstr();
-          IfNullRet(pInstr);
-
+          m_code.push_back(ILInstr());
+          pInstr = &m_code.back();
           pInstr->m_opcode = CEE_SWITCH_ARG;
-
+          pInstr->m_Arg64 = 0;
           pInstr->m_Arg32 = base + *(UNALIGNED INT32*)&(pIL[offset]);
           offset += sizeof(INT32);
-
-          InsertBefore(&m_IL, pInstr);
         }
         fBranch = true;
         break;
@@ -275,12 +315,17 @@ HRESULT ILRewriter::ImportIL(LPCBYTE pIL) {
   }
   assert(offset == m_CodeSize);
 
+  // The end of the code
+  m_offsetToInstr[m_CodeSize] = GetCodeEnd();
+
   if (fBranch) {
     // Go over all control flow instructions and resolve the targets
-    for (ILInstr* pInstr = m_IL.m_pNext; pInstr != &m_IL;
-         pInstr = pInstr->m_pNext) {
-      if (s_OpCodeFlags[pInstr->m_opcode] & OPCODEFLAGS_BranchTarget)
-        pInstr->m_pTarget = GetInstrFromOffset(pInstr->m_Arg32);
+    for (ILInstr& instr : m_code) {
+      if (s_OpCodeFlags[instr.m_opcode] & OPCODEFLAGS_BranchTarget) {
+        unsigned target = GetInstrFromOffset(instr.m_Arg32);
+        if (target == kNoInstr) return COR_E_INVALIDPROGRAM;
+        instr.m_target = target;
+      }
     }
   }
 
@@ -307,93 +352,563 @@ HRESULT ILRewriter::ImportEH(const COR_ILMETHOD_SECT_EH* pILEH, unsigned nEH) {
     EHClause* clause = &(m_pEH[iEH]);
     clause->m_Flags = ehInfo->GetFlags();
 
-    clause->m_pTryBegin = GetInstrFromOffset(ehInfo->GetTryOffset());
-    clause->m_pTryEnd =
+    clause->m_tryBegin = GetInstrFromOffset(ehInfo->GetTryOffset());
+    clause->m_tryEnd =
         GetInstrFromOffset(ehInfo->GetTryOffset() + ehInfo->GetTryLength());
-    clause->m_pHandlerBegin = GetInstrFromOffset(ehInfo->GetHandlerOffset());
-    clause->m_pHandlerEnd = GetInstrFromOffset(ehInfo->GetHandlerOffset() +
-                                               ehInfo->GetHandlerLength())
-                                ->m_pPrev;
-    if ((clause->m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER) == 0)
+    clause->m_handlerBegin = GetInstrFromOffset(ehInfo->GetHandlerOffset());
+    unsigned handlerEnd = GetInstrFromOffset(ehInfo->GetHandlerOffset() +
+                                             ehInfo->GetHandlerLength());
+    if (clause->m_tryBegin == kNoInstr || clause->m_tryEnd == kNoInstr ||
+        clause->m_handlerBegin == kNoInstr || handlerEnd == kNoInstr ||
+        handlerEnd == 0) {
+      return COR_E_INVALIDPROGRAM;
+    }
+    clause->m_handlerEnd = handlerEnd - 1;
+    if ((clause->m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER) == 0) {
       clause->m_ClassToken = ehInfo->GetClassToken();
-    else
-      clause->m_pFilter = GetInstrFromOffset(ehInfo->GetFilterOffset());
+    } else {
+      clause->m_filter = GetInstrFromOffset(ehInfo->GetFilterOffset());
+      if (clause->m_filter == kNoInstr) return COR_E_INVALIDPROGRAM;
+    }
   }
 
   return S_OK;
 }
 
-ILInstr* ILRewriter::NewILInstr() {
-  m_nInstrs++;
-  return new ILInstr();
+unsigned ILRewriter::GetInstrFromOffset(unsigned offset) const {
+  if (offset >= m_offsetToInstr.size()) return kNoInstr;
+  return m_offsetToInstr[offset];
+}
+
+unsigned ILRewriter::InsertBefore(unsigned where, unsigned opcode) {
+  assert(where <= GetCodeEnd());
+
+  m_log.push_back(ILInstr());
+  m_log.back().m_opcode = opcode;
+  m_log.back().m_Arg64 = 0;
+  m_logWhere.push_back(where);
+
+  AdjustState(opcode);
+  return kLoggedInstr | (unsigned)(m_log.size() - 1);
+}
+
+ILInstr* ILRewriter::GetInstr(unsigned index) {
+  if (index & kLoggedInstr) return &m_log[index & ~kLoggedInstr];
+  return &m_code[index];
+}
+
+void ILRewriter::Commit() {
+  if (m_log.empty()) return;
+
+  const unsigned nCode = GetCodeEnd();
+  const unsigned nLog = (unsigned)m_log.size();
+
+  // Counting sort of the log by insertion point. shift[i] first counts the
+  // instructions logged in front of code instruction i, then where the
+  // first of them lands, and ends up as how far instruction i moves.
+  std::vector<unsigned> shift(nCode + 1, 0);
+  for (unsigned where : m_logWhere) shift[where]++;
+  unsigned before = 0;
+  for (unsigned i = 0; i <= nCode; i++) {
+    unsigned count = shift[i];
+    shift[i] = before;
+    before += count;
+  }
+  // Instructions logged in front of the same one keep their order
+  std::vector<unsigned> loggedIndex(nLog);
+  for (unsigned k = 0; k < nLog; k++) {
+    unsigned where = m_logWhere[k];
+    loggedIndex[k] = where + shift[where]++;
+  }
+
+  // Moved back to front, an instruction only ever moves up over slots
+  // already vacated
+  m_code.resize(nCode + nLog);
+  for (unsigned i = nCode; i-- > 0 && shift[i] != 0;) {
+    m_code[i + shift[i]] = m_code[i];
+  }
+  for (unsigned k = 0; k < nLog; k++) {
+    m_code[loggedIndex[k]] = m_log[k];
+  }
+
+  auto remap = [&](unsigned index) -> unsigned {
+    if (index & kLoggedInstr) return loggedIndex[index & ~kLoggedInstr];
+    return index + shift[index];
+  };
+
+  for (ILInstr& instr : m_code) {
+    if (s_OpCodeFlags[instr.m_opcode] & OPCODEFLAGS_BranchTarget) {
+      instr.m_target = remap(instr.m_target);
+    }
+  }
+  for (unsigned iEH = 0; iEH < m_nEH; iEH++) {
+    EHClause* pClause = &m_pEH[iEH];
+    pClause->m_tryBegin = remap(pClause->m_tryBegin);
+    pClause->m_tryEnd = remap(pClause->m_tryEnd);
+    pClause->m_handlerBegin = remap(pClause->m_handlerBegin);
+    pClause->m_handlerEnd = remap(pClause->m_handlerEnd);
+    if (pClause->m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER) {
+      pClause->m_filter = remap(pClause->m_filter);
+    }
+  }
+  for (unsigned& ret : m_rets) ret = remap(ret);
+
+  m_log.clear();
+  m_logWhere.clear();
+}
+
+void ILRewriter::AdjustState(unsigned opcode) {
+  m_maxStack += k_rgnStackPushes[opcode];
 }
 
-ILInstr* ILRewriter::GetInstrFromOffset(unsigned offset) {
-  ILInstr* pInstr = NULL;
+static unsigned GetInstrSize(const ILInstr* pInstr) {
+  unsigned size = 0;
+  unsigned opcode = pInstr->m_opcode;
+  if (opcode < CEE_COUNT) size += (opcode >= 0x100) ? 2 : 1;
+
+  BYTE flags = s_OpCodeFlags[opcode];
+  size += (flags & OPCODEFLAGS_SizeMask);
+  // The switch operand count, the targets follow as CEE_SWITCH_ARG
+  if (flags == (0 | OPCODEFLAGS_Switch)) size += sizeof(INT32);
+  return size;
+}
 
-  if (offset <= m_CodeSize) pInstr = m_pOffsetToInstr[offset];
+unsigned ILRewriter::GetCodeSize() {
+  Commit();
 
-  assert(pInstr != NULL);
-  return pInstr;
+  unsigned size = 0;
+  for (const ILInstr& instr : m_code) {
+    size += GetInstrSize(&instr);
+  }
+  return size;
 }
 
-void ILRewriter::InsertBefore(ILInstr* pWhere, ILInstr* pWhat) {
-  pWhat->m_pNext = pWhere;
-  pWhat->m_pPrev = pWhere->m_pPrev;
+void ILRewriter::ShortenBranches() {
+  for (ILInstr& instr : m_code) {
+    unsigned opcode = instr.m_opcode;
+    if (opcode == CEE_LEAVE) {
+      instr.m_opcode = CEE_LEAVE_S;
+    } else if (opcode >= CEE_BR && opcode <= CEE_BLT_UN) {
+      instr.m_opcode = opcode - CEE_BR + CEE_BR_S;
+    }
+  }
+}
 
-  pWhat->m_pNext->m_pPrev = pWhat;
-  pWhat->m_pPrev->m_pNext = pWhat;
+unsigned ILRewriter::LayoutCode() {
+  // Widening only ever grows the code, so this stops once every short
+  // branch reaches its target
+  for (;;) {
+    unsigned offset = 0;
+    for (ILInstr& instr : m_code) {
+      instr.m_offset = offset;
+      offset += GetInstrSize(&instr);
+    }
+    m_endOffset = offset;
+
+    bool fWidened = false;
+    for (unsigned i = 0; i < GetCodeEnd(); i++) {
+      ILInstr* pInstr = &m_code[i];
+      unsigned opcode = pInstr->m_opcode;
+      if (s_OpCodeFlags[opcode] != (1 | OPCODEFLAGS_BranchTarget)) continue;
+
+      int delta = GetOffset(pInstr->m_target) - GetOffset(i + 1);
+      // Check if delta is too big to fit into an INT8.
+      if ((INT8)delta == delta) continue;
+
+      if (opcode == CEE_LEAVE_S) {
+        pInstr->m_opcode = CEE_LEAVE;
+      } else {
+        assert(opcode >= CEE_BR_S && opcode <= CEE_BLT_UN_S);
+        pInstr->m_opcode = opcode - CEE_BR_S + CEE_BR;
+        assert(pInstr->m_opcode >= CEE_BR && pInstr->m_opcode <= CEE_BLT_UN);
+      }
+      fWidened = true;
+    }
+
+    if (!fWidened) return offset;
+  }
+}
+
+unsigned ILRewriter::GetOffset(unsigned index) const {
+  return index < GetCodeEnd() ? m_code[index].m_offset : m_endOffset;
+}
+
+void ILRewriter::Peephole() {
+  Commit();
+
+  for (ILInstr& instr : m_code) {
+    ShortenInstr(&instr);
+  }
+
+  if (m_flags & CorILMethod_InitLocals) {
+    RemoveDeadInitializers();
+  }
+}
+
+// Switches a variable instruction to its macro form (index 0-3) when it has
+// one, else to its short form when the index fits a byte.
+static void ShortenVarInstr(ILInstr* pInstr, bool fLong, unsigned shortOpcode,
+                            int macroOpcode) {
+  unsigned index =
+      fLong ? (UINT16)pInstr->m_Arg16 : (UINT8)pInstr->m_Arg8;
+
+  if (macroOpcode >= 0 && index <= 3) {
+    pInstr->m_opcode = macroOpcode + index;
+    pInstr->m_Arg64 = 0;
+  } else if (fLong && index <= 255) {
+    pInstr->m_opcode = shortOpcode;
+    pInstr->m_Arg64 = 0;
+    pInstr->m_Arg8 = static_cast<INT8>(index);
+  }
+}
+
+void ILRewriter::ShortenInstr(ILInstr* pInstr) {
+  switch (pInstr->m_opcode) {
+    case CEE_LDC_I4:
+    case CEE_LDC_I4_S: {
+      INT32 value = (pInstr->m_opcode == CEE_LDC_I4) ? pInstr->m_Arg32
+                                                     : pInstr->m_Arg8;
+      if (value >= 0 && value <= 8) {
+        pInstr->m_opcode = CEE_LDC_I4_0 + value;
+      } else if (value == -1) {
+        pInstr->m_opcode = CEE_LDC_I4_M1;
+      } else if (-128 <= value && value <= 127) {
+        pInstr->m_opcode = CEE_LDC_I4_S;
+        pInstr->m_Arg64 = 0;
+        pInstr->m_Arg8 = static_cast<INT8>(value);
+      }
+      break;
+    }
+    case CEE_LDARG:
+    case CEE_LDARG_S:
+      ShortenVarInstr(pInstr, pInstr->m_opcode == CEE_LDARG, CEE_LDARG_S,
+                      CEE_LDARG_0);
+      break;
+    case CEE_LDARGA:
+      ShortenVarInstr(pInstr, true, CEE_LDARGA_S, -1);
+      break;
+    case CEE_STARG:
+      ShortenVarInstr(pInstr, true, CEE_STARG_S, -1);
+      break;
+    case CEE_LDLOC:
+    case CEE_LDLOC_S:
+      ShortenVarInstr(pInstr, pInstr->m_opcode == CEE_LDLOC, CEE_LDLOC_S,
+                      CEE_LDLOC_0);
+      break;
+    case CEE_STLOC:
+    case CEE_STLOC_S:
+      ShortenVarInstr(pInstr, pInstr->m_opcode == CEE_STLOC, CEE_STLOC_S,
+                      CEE_STLOC_0);
+      break;
+    case CEE_LDLOCA:
+      ShortenVarInstr(pInstr, true, CEE_LDLOCA_S, -1);
+      break;
+    default:
+      break;
+  }
+}
+
+static bool IsStoreLocal(unsigned opcode) {
+  return opcode == CEE_STLOC || opcode == CEE_STLOC_S ||
+         (CEE_STLOC_0 <= opcode && opcode <= CEE_STLOC_3);
+}
+
+void ILRewriter::RemoveDeadInitializers() {
+  Commit();
+
+  // Instructions something else points at have to stay
+  std::vector<bool> referenced(GetCodeEnd() + 1, false);
+  for (const ILInstr& instr : m_code) {
+    if (s_OpCodeFlags[instr.m_opcode] & OPCODEFLAGS_BranchTarget) {
+      referenced[instr.m_target] = true;
+    }
+  }
+  for (unsigned iEH = 0; iEH < m_nEH; iEH++) {
+    EHClause* pClause = &m_pEH[iEH];
+    referenced[pClause->m_tryBegin] = true;
+    referenced[pClause->m_tryEnd] = true;
+    referenced[pClause->m_handlerBegin] = true;
+    referenced[pClause->m_handlerEnd] = true;
+    if (pClause->m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER) {
+      referenced[pClause->m_filter] = true;
+    }
+  }
+
+  // Every local is still zero until the first instruction that is not such
+  // a pair runs, so storing null into one is dead
+  unsigned removed = 0;
+  while (removed + 1 < GetCodeEnd() &&
+         m_code[removed].m_opcode == CEE_LDNULL &&
+         IsStoreLocal(m_code[removed + 1].m_opcode) && !referenced[removed] &&
+         !referenced[removed + 1]) {
+    removed += 2;
+  }
+  if (removed == 0) return;
+
+  // Nothing points into the removed prefix, so every index just moves down
+  m_code.erase(m_code.begin(), m_code.begin() + removed);
+  for (ILInstr& instr : m_code) {
+    if (s_OpCodeFlags[instr.m_opcode] & OPCODEFLAGS_BranchTarget) {
+      instr.m_target -= removed;
+    }
+  }
+  for (unsigned iEH = 0; iEH < m_nEH; iEH++) {
+    EHClause* pClause = &m_pEH[iEH];
+    pClause->m_tryBegin -= removed;
+    pClause->m_tryEnd -= removed;
+    pClause->m_handlerBegin -= removed;
+    pClause->m_handlerEnd -= removed;
+    if (pClause->m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER) {
+      pClause->m_filter -= removed;
+    }
+  }
+  for (unsigned& ret : m_rets) ret -= removed;
+}
+
+// Stack effect of a call site or method signature.
+struct CallShape {
+  unsigned nArgs;  // including this
+  bool fReturnsValue;
+};
+
+static HRESULT ParseCallShape(PCCOR_SIGNATURE pSig, ULONG cbSig,
+                              CallShape* pShape) {
+  if (cbSig < 2) return COR_E_INVALIDPROGRAM;
+
+  ULONG callConv = CorSigUncompressCallingConv(pSig);
+  if (callConv & IMAGE_CEE_CS_CALLCONV_GENERIC) CorSigUncompressData(pSig);
+  pShape->nArgs = CorSigUncompressData(pSig);
+  // An explicit this is already one of the parameters
+  if ((callConv & IMAGE_CEE_CS_CALLCONV_HASTHIS) &&
+      !(callConv & IMAGE_CEE_CS_CALLCONV_EXPLICITTHIS)) {
+    pShape->nArgs++;
+  }
 
-  AdjustState(pWhat);
+  while (*pSig == ELEMENT_TYPE_CMOD_REQD || *pSig == ELEMENT_TYPE_CMOD_OPT) {
+    pSig++;
+    CorSigUncompressToken(pSig);
+  }
+  pShape->fReturnsValue = (*pSig != ELEMENT_TYPE_VOID);
+  return S_OK;
 }
 
-void ILRewriter::InsertAfter(ILInstr* pWhere, ILInstr* pWhat) {
-  pWhat->m_pNext = pWhere->m_pNext;
-  pWhat->m_pPrev = pWhere;
+static HRESULT GetCallShape(IMetaDataImport2* pImport, mdToken tk,
+                            CallShape* pShape) {
+  PCCOR_SIGNATURE pSig = NULL;
+  ULONG cbSig = 0;
 
-  pWhat->m_pNext->m_pPrev = pWhat;
-  pWhat->m_pPrev->m_pNext = pWhat;
+  if (TypeFromToken(tk) == mdtMethodSpec) {
+    IfFailRet(pImport->GetMethodSpecProps(tk, &tk, NULL, NULL));
+  }
 
-  AdjustState(pWhat);
+  switch (TypeFromToken(tk)) {
+    case mdtMethodDef:
+      IfFailRet(pImport->GetMethodProps(tk, NULL, NULL, 0, NULL, NULL, &pSig,
+                                        &cbSig, NULL, NULL));
+      break;
+    case mdtMemberRef:
+      IfFailRet(pImport->GetMemberRefProps(tk, NULL, NULL, 0, NULL, &pSig,
+                                           &cbSig));
+      break;
+    case mdtSignature:
+      IfFailRet(pImport->GetSigFromToken(tk, &pSig, &cbSig));
+      break;
+    default:
+      return COR_E_INVALIDPROGRAM;
+  }
+  return ParseCallShape(pSig, cbSig, pShape);
 }
 
-void ILRewriter::AdjustState(ILInstr* pNewInstr) {
-  m_maxStack += k_rgnStackPushes[pNewInstr->m_opcode];
+static bool FallsThrough(unsigned opcode) {
+  switch (opcode) {
+    case CEE_BR:
+    case CEE_BR_S:
+    case CEE_LEAVE:
+    case CEE_LEAVE_S:
+    case CEE_RET:
+    case CEE_THROW:
+    case CEE_RETHROW:
+    case CEE_ENDFINALLY:
+    case CEE_ENDFILTER:
+    case CEE_JMP:
+      return false;
+    default:
+      return true;
+  }
 }
 
-ILInstr* ILRewriter::GetILList() { return &m_IL; }
+HRESULT ILRewriter::ComputeMaxStack() {
+  IMetaDataImport2* pImport = NULL;
+  if (m_pICorProfilerInfo == NULL ||
+      FAILED(m_pICorProfilerInfo->GetModuleMetaData(
+          m_moduleId, ofRead, IID_IMetaDataImport2, (IUnknown**)&pImport))) {
+    // Keep the conservative estimate of AdjustState
+    return S_FALSE;
+  }
+
+  HRESULT hr = ComputeMaxStack(pImport);
+  pImport->Release();
+  return hr;
+}
+
+HRESULT ILRewriter::ComputeMaxStack(IMetaDataImport2* pImport) {
+  Commit();
+
+  CallShape methodShape;
+  IfFailRet(GetCallShape(pImport, m_tkMethod, &methodShape));
+
+  // Stack depth on entry of every instruction, -1 until it is reached
+  std::vector<int> depths(GetCodeEnd(), -1);
+  std::vector<unsigned> pending;
+  unsigned maxStack = 0;
+
+  auto reach = [&](unsigned index, int depth) -> HRESULT {
+    if (index >= GetCodeEnd()) {
+      // Falling off the end of the method
+      return COR_E_INVALIDPROGRAM;
+    }
+    if (depths[index] >= 0) {
+      return (depths[index] == depth) ? S_OK : COR_E_INVALIDPROGRAM;
+    }
+    depths[index] = depth;
+    pending.push_back(index);
+    return S_OK;
+  };
+
+  if (GetCodeEnd() != 0) IfFailRet(reach(0, 0));
+  for (unsigned iEH = 0; iEH < m_nEH; iEH++) {
+    EHClause* pClause = &m_pEH[iEH];
+    // Catch and filter blocks start with the exception object
+    if (pClause->m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER) {
+      IfFailRet(reach(pClause->m_filter, 1));
+      IfFailRet(reach(pClause->m_handlerBegin, 1));
+    } else if (pClause->m_Flags &
+               (COR_ILEXCEPTION_CLAUSE_FINALLY | COR_ILEXCEPTION_CLAUSE_FAULT)) {
+      IfFailRet(reach(pClause->m_handlerBegin, 0));
+    } else {
+      IfFailRet(reach(pClause->m_handlerBegin, 1));
+    }
+  }
+
+  while (!pending.empty()) {
+    unsigned index = pending.back();
+    pending.pop_back();
+
+    const ILInstr* pInstr = &m_code[index];
+    unsigned opcode = pInstr->m_opcode;
+    int depth = depths[index];
+    int pops = k_rgnStackPops[opcode];
+    int pushes = (opcode < CEE_COUNT) ? k_rgnStackPushes[opcode] : 0;
+
+    switch (opcode) {
+      case CEE_CALL:
+      case CEE_CALLVIRT:
+      case CEE_CALLI: {
+        CallShape shape;
+        IfFailRet(GetCallShape(pImport, pInstr->m_Arg32, &shape));
+        // calli pops the function pointer as well
+        pops = shape.nArgs + (opcode == CEE_CALLI ? 1 : 0);
+        pushes = shape.fReturnsValue ? 1 : 0;
+        break;
+      }
+      case CEE_NEWOBJ: {
+        CallShape shape;
+        IfFailRet(GetCallShape(pImport, pInstr->m_Arg32, &shape));
+        // The new object is this, it is pushed rather than popped
+        pops = shape.nArgs - 1;
+        break;
+      }
+      case CEE_RET:
+        pops = methodShape.fReturnsValue ? 1 : 0;
+        break;
+      default:
+        break;
+    }
+
+    if (pops > depth) return COR_E_INVALIDPROGRAM;
+    depth += pushes - pops;
+    if ((unsigned)depth > maxStack) maxStack = depth;
+
+    if (opcode == CEE_RET && depth != 0) return COR_E_INVALIDPROGRAM;
+
+    if (s_OpCodeFlags[opcode] & OPCODEFLAGS_BranchTarget) {
+      // leave empties the stack
+      bool fLeave = (opcode == CEE_LEAVE || opcode == CEE_LEAVE_S);
+      IfFailRet(reach(pInstr->m_target, fLeave ? 0 : depth));
+    }
+    if (FallsThrough(opcode)) {
+      IfFailRet(reach(index + 1, depth));
+    }
+  }
+
+  m_maxStack = maxStack;
+  return S_OK;
+}
 
 HRESULT ILRewriter::Export() {
-  // One instruction produces 2 + sizeof(native int) bytes in the worst case
-  // which can be 10 bytes for 64-bit. For simplification we just use 10 here.
-  unsigned maxSize = m_nInstrs * 10;
+  Commit();
 
-  m_pOutputBuffer = new BYTE[maxSize];
-  IfNullRet(m_pOutputBuffer);
+  // Fails on an inconsistent stack, before the body reaches the JIT
+  IfFailRet(ComputeMaxStack());
 
-again:
-  BYTE* pIL = m_pOutputBuffer;
+  // Every branch starts short, LayoutCode widens the ones that don't reach
+  ShortenBranches();
+  unsigned codeSize = LayoutCode();
 
-  bool fBranch = false;
-  unsigned offset = 0;
+  // Sizes are final, so the body is written straight into the memory handed
+  // to the runtime
+  unsigned headerSize;
+  unsigned totalSize;
+  if (m_fGenerateTinyHeader) {
+    // Make sure we can fit in a tiny header
+    if (codeSize >= 64) return E_FAIL;
+
+    headerSize = sizeof(IMAGE_COR_ILMETHOD_TINY);
+    totalSize = headerSize + codeSize;
+  } else {
+    headerSize = sizeof(IMAGE_COR_ILMETHOD_FAT);
+    totalSize = headerSize + ((codeSize + 3) & ~3) +
+                (m_nEH ? (sizeof(IMAGE_COR_ILMETHOD_SECT_FAT) +
+                          sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) * m_nEH)
+                       : 0);
+  }
+
+  LPBYTE pBody = AllocateILMemory(totalSize);
+  IfNullRet(pBody);
+
+  if (m_fGenerateTinyHeader) {
+    // Here's the tiny header
+    *pBody = (BYTE)(CorILMethod_TinyFormat | (codeSize << 2));
+  } else {
+    // Use FAT header
+    IMAGE_COR_ILMETHOD_FAT* pHeader = (IMAGE_COR_ILMETHOD_FAT*)pBody;
+    pHeader->Flags =
+        m_flags | (m_nEH ? CorILMethod_MoreSects : 0) | CorILMethod_FatFormat;
+    pHeader->Size = sizeof(IMAGE_COR_ILMETHOD_FAT) / sizeof(DWORD);
+    pHeader->MaxStack = m_maxStack;
+    pHeader->CodeSize = codeSize;
+    pHeader->LocalVarSigTok = m_tkLocalVarSig;
+  }
+
+  BYTE* pIL = pBody + headerSize;
+  unsigned switchBase = 0;
 
-  // Go over all instructions and produce code for them
-  for (ILInstr* pInstr = m_IL.m_pNext; pInstr != &m_IL;
-       pInstr = pInstr->m_pNext) {
-    assert(offset < maxSize);
-    pInstr->m_offset = offset;
+  // Go over all instructions and produce code for them, offsets are final
+  for (unsigned i = 0; i < GetCodeEnd(); i++) {
+    const ILInstr* pInstr = &m_code[i];
+    unsigned offset = pInstr->m_offset;
 
     unsigned opcode = pInstr->m_opcode;
     if (opcode < CEE_COUNT) {
       // CEE_PREFIX1 refers not to instruction prefixes (like tail.), but to
       // the lead byte of multi-byte opcodes. For now, the only lead byte
       // supported is CEE_PREFIX1 = 0xFE.
-      if (opcode >= 0x100) m_pOutputBuffer[offset++] = CEE_PREFIX1;
+      if (opcode >= 0x100) pIL[offset++] = CEE_PREFIX1;
 
       // This appears to depend on an implicit conversion from
       // unsigned opcode down to BYTE, to deliberately lose data and have
       // opcode >= 0x100 wrap around to 0.
-      m_pOutputBuffer[offset++] = (opcode & 0xFF);
+      pIL[offset++] = (opcode & 0xFF);
     }
 
     assert(pInstr->m_opcode < _countof(s_OpCodeFlags));
@@ -414,159 +929,58 @@ again:
         *(UNALIGNED INT64*)&(pIL[offset]) = pInstr->m_Arg64;
         break;
       case 1 | OPCODEFLAGS_BranchTarget:
-        fBranch = true;
+        *(UNALIGNED INT8*)&(pIL[offset]) =
+            GetOffset(pInstr->m_target) - GetOffset(i + 1);
         break;
       case 4 | OPCODEFLAGS_BranchTarget:
-        fBranch = true;
+        if (opcode == CEE_SWITCH_ARG) {
+          // Switch args are relative to the end of the whole switch
+          *(UNALIGNED INT32*)&(pIL[offset]) =
+              GetOffset(pInstr->m_target) - switchBase;
+        } else {
+          *(UNALIGNED INT32*)&(pIL[offset]) =
+              GetOffset(pInstr->m_target) - GetOffset(i + 1);
+        }
         break;
       case 0 | OPCODEFLAGS_Switch:
         *(UNALIGNED INT32*)&(pIL[offset]) = pInstr->m_Arg32;
-        offset += sizeof(INT32);
+        switchBase =
+            pInstr->m_offset + 1 + sizeof(INT32) * (pInstr->m_Arg32 + 1);
         break;
       default:
         assert(false);
         break;
     }
-    offset += (flags & OPCODEFLAGS_SizeMask);
   }
-  m_IL.m_offset = offset;
-
-  if (fBranch) {
-    bool fTryAgain = false;
-    unsigned switchBase = 0;
-
-    // Go over all control flow instructions and resolve the targets
-    for (ILInstr* pInstr = m_IL.m_pNext; pInstr != &m_IL;
-         pInstr = pInstr->m_pNext) {
-      unsigned opcode = pInstr->m_opcode;
-
-      if (pInstr->m_opcode == CEE_SWITCH) {
-        switchBase =
-            pInstr->m_offset + 1 + sizeof(INT32) * (pInstr->m_Arg32 + 1);
-        continue;
-      }
-      if (opcode == CEE_SWITCH_ARG) {
-        // Switch args are special
-        *(UNALIGNED INT32*)&(pIL[pInstr->m_offset]) =
-            pInstr->m_pTarget->m_offset - switchBase;
-        continue;
-      }
-
-      BYTE flags = s_OpCodeFlags[pInstr->m_opcode];
-
-      if (flags & OPCODEFLAGS_BranchTarget) {
-        int delta = pInstr->m_pTarget->m_offset - pInstr->m_pNext->m_offset;
-
-        switch (flags) {
-          case 1 | OPCODEFLAGS_BranchTarget:
-            // Check if delta is too big to fit into an INT8.
-            //
-            // (see #pragma at top of file)
-            if ((INT8)delta != delta) {
-              if (opcode == CEE_LEAVE_S) {
-                pInstr->m_opcode = CEE_LEAVE;
-              } else {
-                assert(opcode >= CEE_BR_S && opcode <= CEE_BLT_UN_S);
-                pInstr->m_opcode = opcode - CEE_BR_S + CEE_BR;
-                assert(pInstr->m_opcode >= CEE_BR &&
-                       pInstr->m_opcode <= CEE_BLT_UN);
-              }
-              fTryAgain = true;
-              continue;
-            }
-            *(UNALIGNED INT8*)&(pIL[pInstr->m_pNext->m_offset - sizeof(INT8)]) =
-                delta;
-            break;
-          case 4 | OPCODEFLAGS_BranchTarget:
-            *(UNALIGNED INT32*)&(
-                pIL[pInstr->m_pNext->m_offset - sizeof(INT32)]) = delta;
-            break;
-          default:
-            assert(false);
-            break;
-        }
-      }
-    }
 
-    // Do the whole thing again if we changed the size of some branch targets
-    if (fTryAgain) goto again;
-  }
-
-  unsigned codeSize = offset;
-  unsigned totalSize;
-  LPBYTE pBody = NULL;
-  if (m_fGenerateTinyHeader) {
-    // Make sure we can fit in a tiny header
-    if (codeSize >= 64) return E_FAIL;
-
-    totalSize = sizeof(IMAGE_COR_ILMETHOD_TINY) + codeSize;
-    pBody = AllocateILMemory(totalSize);
-    IfNullRet(pBody);
-
-    BYTE* pCurrent = pBody;
-
-    // Here's the tiny header
-    *pCurrent = (BYTE)(CorILMethod_TinyFormat | (codeSize << 2));
-    pCurrent += sizeof(IMAGE_COR_ILMETHOD_TINY);
-
-    // And the body
-    CopyMemory(pCurrent, m_pOutputBuffer, codeSize);
-  } else {
-    // Use FAT header
-
-    unsigned alignedCodeSize = (offset + 3) & ~3;
-
-    totalSize = sizeof(IMAGE_COR_ILMETHOD_FAT) + alignedCodeSize +
-                (m_nEH ? (sizeof(IMAGE_COR_ILMETHOD_SECT_FAT) +
-                          sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) * m_nEH)
-                       : 0);
-
-    pBody = AllocateILMemory(totalSize);
-    IfNullRet(pBody);
-
-    BYTE* pCurrent = pBody;
-
-    IMAGE_COR_ILMETHOD_FAT* pHeader = (IMAGE_COR_ILMETHOD_FAT*)pCurrent;
-    pHeader->Flags =
-        m_flags | (m_nEH ? CorILMethod_MoreSects : 0) | CorILMethod_FatFormat;
-    pHeader->Size = sizeof(IMAGE_COR_ILMETHOD_FAT) / sizeof(DWORD);
-    pHeader->MaxStack = m_maxStack;
-    pHeader->CodeSize = offset;
-    pHeader->LocalVarSigTok = m_tkLocalVarSig;
-
-    pCurrent = (BYTE*)(pHeader + 1);
-
-    CopyMemory(pCurrent, m_pOutputBuffer, codeSize);
-    pCurrent += alignedCodeSize;
-
-    if (m_nEH != 0) {
-      IMAGE_COR_ILMETHOD_SECT_FAT* pEH = (IMAGE_COR_ILMETHOD_SECT_FAT*)pCurrent;
-      pEH->Kind = CorILMethod_Sect_EHTable | CorILMethod_Sect_FatFormat;
-      pEH->DataSize =
-          (unsigned)(sizeof(IMAGE_COR_ILMETHOD_SECT_FAT) +
-                     sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) * m_nEH);
-
-      pCurrent = (BYTE*)(pEH + 1);
-
-      for (unsigned iEH = 0; iEH < m_nEH; iEH++) {
-        EHClause* pSrc = &(m_pEH[iEH]);
-        IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT* pDst =
-            (IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT*)pCurrent;
-
-        pDst->Flags = pSrc->m_Flags;
-        pDst->TryOffset = pSrc->m_pTryBegin->m_offset;
-        pDst->TryLength =
-            pSrc->m_pTryEnd->m_offset - pSrc->m_pTryBegin->m_offset;
-        pDst->HandlerOffset = pSrc->m_pHandlerBegin->m_offset;
-        pDst->HandlerLength = pSrc->m_pHandlerEnd->m_pNext->m_offset -
-                              pSrc->m_pHandlerBegin->m_offset;
-        if ((pSrc->m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER) == 0)
-          pDst->ClassToken = pSrc->m_ClassToken;
-        else
-          pDst->FilterOffset = pSrc->m_pFilter->m_offset;
-
-        pCurrent = (BYTE*)(pDst + 1);
-      }
+  if (!m_fGenerateTinyHeader && m_nEH != 0) {
+    // The EH section follows the code, aligned to 4 bytes
+    BYTE* pCurrent = pIL + ((codeSize + 3) & ~3);
+    IMAGE_COR_ILMETHOD_SECT_FAT* pEH = (IMAGE_COR_ILMETHOD_SECT_FAT*)pCurrent;
+    pEH->Kind = CorILMethod_Sect_EHTable | CorILMethod_Sect_FatFormat;
+    pEH->DataSize =
+        (unsigned)(sizeof(IMAGE_COR_ILMETHOD_SECT_FAT) +
+                   sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) * m_nEH);
+
+    pCurrent = (BYTE*)(pEH + 1);
+
+    for (unsigned iEH = 0; iEH < m_nEH; iEH++) {
+      EHClause* pSrc = &(m_pEH[iEH]);
+      IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT* pDst =
+          (IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT*)pCurrent;
+
+      pDst->Flags = pSrc->m_Flags;
+      pDst->TryOffset = GetOffset(pSrc->m_tryBegin);
+      pDst->TryLength = GetOffset(pSrc->m_tryEnd) - GetOffset(pSrc->m_tryBegin);
+      pDst->HandlerOffset = GetOffset(pSrc->m_handlerBegin);
+      pDst->HandlerLength = GetOffset(pSrc->m_handlerEnd + 1) -
+                            GetOffset(pSrc->m_handlerBegin);
+      if ((pSrc->m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER) == 0)
+        pDst->ClassToken = pSrc->m_ClassToken;
+      else
+        pDst->FilterOffset = GetOffset(pSrc->m_filter);
+
+      pCurrent = (BYTE*)(pDst + 1);
     }
   }
 
@@ -599,7 +1013,8 @@ LPBYTE ILRewriter::AllocateILMemory(unsigned size) {
   // Else, this is "classic-style" instrumentation on first JIT, and
   // need to use the CLR's IL allocator
 
-  if (FAILED(m_pICorProfilerInfo->GetILFunctionBodyAllocator(
+  if (m_pIMethodMalloc == nullptr &&
+      FAILED(m_pICorProfilerInfo->GetILFunctionBodyAllocator(
           m_moduleId, &m_pIMethodMalloc)))
     return nullptr;
 
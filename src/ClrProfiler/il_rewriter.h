@@ -6,6 +6,7 @@
 // license information.
 #include <corhlpr.h>
 #include <corprof.h>
+#include <vector>
 
 typedef enum {
 #define OPDEF(c, s, pop, push, args, type, l, s1, s2, ctrl) c,
@@ -17,14 +18,11 @@ typedef enum {
 } OPCODE;
 
 struct ILInstr {
-  ILInstr* m_pNext;
-  ILInstr* m_pPrev;
-
   unsigned m_opcode;
   unsigned m_offset;
 
   union {
-    ILInstr* m_pTarget;
+    unsigned m_target;  // index of the branch target
     INT8 m_Arg8;
     INT16 m_Arg16;
     INT32 m_Arg32;
@@ -34,13 +32,13 @@ struct ILInstr {
 
 struct EHClause {
   CorExceptionFlag m_Flags;
-  ILInstr* m_pTryBegin;
-  ILInstr* m_pTryEnd;
-  ILInstr* m_pHandlerBegin;  // First instruction inside the handler
-  ILInstr* m_pHandlerEnd;    // Last instruction inside the handler
+  unsigned m_tryBegin;
+  unsigned m_tryEnd;
+  unsigned m_handlerBegin;  // First instruction inside the handler
+  unsigned m_handlerEnd;    // Last instruction inside the handler
   union {
     DWORD m_ClassToken;  // use for type-based exception handlers
-    ILInstr* m_pFilter;  // use for filter-based exception handlers
+    unsigned m_filter;   // use for filter-based exception handlers
                          // (COR_ILEXCEPTION_CLAUSE_FILTER is set)
   };
 };
@@ -57,29 +55,45 @@ class ILRewriter {
   unsigned m_flags;
   bool m_fGenerateTinyHeader;
 
-  ILInstr m_IL;  // Double linked list of all il instructions
+  // The code in order. Branch targets, EH clauses and m_rets refer to an
+  // instruction by its index here, the size stands for the end of the code.
+  std::vector<ILInstr> m_code;
 
+  // Instructions inserted since the last Commit, in insertion order, and the
+  // code index each one goes in front of. They are referred to as
+  // kLoggedInstr | their position in the log until Commit merges them.
+  std::vector<ILInstr> m_log;
+  std::vector<unsigned> m_logWhere;
 
   // Helper table for importing.  Sparse array that maps BYTE offset of
-  // beginning of an instruction to that instruction's ILInstr*.  BYTE offsets
+  // beginning of an instruction to that instruction's index.  BYTE offsets
   // that don't correspond to the beginning of an instruction are mapped to
-  // NULL.
-  ILInstr** m_pOffsetToInstr;
+  // kNoInstr.
+  std::vector<unsigned> m_offsetToInstr;
   unsigned m_CodeSize;
 
-  unsigned m_nInstrs;
+  // Offset of the end of the code, set by LayoutCode
+  unsigned m_endOffset;
 
-  BYTE* m_pOutputBuffer;
+  // The ret instructions of the imported body
+  std::vector<unsigned> m_rets;
 
   IMethodMalloc* m_pIMethodMalloc;
 
  public:
+  static const unsigned kLoggedInstr = 0x80000000;
+  static const unsigned kNoInstr = 0xFFFFFFFF;
+
   ILRewriter(ICorProfilerInfo* pICorProfilerInfo,
              ICorProfilerFunctionControl* pICorProfilerFunctionControl,
              ModuleID moduleID, mdToken tkMethod);
 
   ~ILRewriter();
 
+  // Allocator of the module, fetched once per module by the caller. Without
+  // one, Export asks the runtime for it.
+  void SetILFunctionBodyAllocator(IMethodMalloc* pIMethodMalloc);
+
   mdToken m_tkLocalVarSig;
   ULONG cNewLocals = 3;
 
@@ -94,21 +108,62 @@ class ILRewriter {
 
   HRESULT Import();
 
+  // Imports a body the caller already has, header included.
+  HRESULT Import(LPCBYTE pMethodBytes);
+
+  // Start an empty body for a method that has none, e.g. one defined by the
+  // profiler.
+  void InitializeTiny();
+
   HRESULT ImportIL(LPCBYTE pIL);
 
   HRESULT ImportEH(const COR_ILMETHOD_SECT_EH* pILEH, unsigned nEH);
 
-  ILInstr* NewILInstr();
+  // The ret instructions of the imported body, in code order.
+  const std::vector<unsigned>& GetReturns() const { return m_rets; }
+
+  // Index of the instruction starting at offset, kNoInstr if none does.
+  unsigned GetInstrFromOffset(unsigned offset) const;
 
-  ILInstr* GetInstrFromOffset(unsigned offset);
+  // Logs a new instruction, operand zeroed, in front of the code instruction
+  // where, or at the end of the code when where is GetCodeEnd(). Returns the
+  // logged index, which stays valid until the next Commit.
+  unsigned InsertBefore(unsigned where, unsigned opcode);
 
-  void InsertBefore(ILInstr* pWhere, ILInstr* pWhat);
+  // The code or logged instruction at index. The pointer is only valid until
+  // the next insert or Commit.
+  ILInstr* GetInstr(unsigned index);
 
-  void InsertAfter(ILInstr* pWhere, ILInstr* pWhat);
+  // Index past the last code instruction, inserting before it appends.
+  unsigned GetCodeEnd() const { return (unsigned)m_code.size(); }
 
-  void AdjustState(ILInstr* pNewInstr);
+  // Merges the log into the code in one pass and renumbers every branch
+  // target, EH clause and ret to the merged code. The passes below commit
+  // first.
+  void Commit();
 
-  ILInstr* GetILList();
+  void AdjustState(unsigned opcode);
+
+  // Size of the code as it was imported.
+  unsigned GetImportedCodeSize() const { return m_CodeSize; }
+
+  // Size the code encodes to right now.
+  unsigned GetCodeSize();
+
+  /////////////////////////////////////////////////////////////////////////////////////////////////
+  //
+  // O P T I M I Z E
+  //
+  ////////////////////////////////////////////////////////////////////////////////////////////////
+
+  // Peephole pass to run before Export: picks the short and macro forms of
+  // constants, arguments and locals, and drops the ldnull/stloc pairs at the
+  // start of the method when CorILMethod_InitLocals already zeroes locals.
+  void Peephole();
+
+  void ShortenInstr(ILInstr* pInstr);
+
+  void RemoveDeadInitializers();
 
   /////////////////////////////////////////////////////////////////////////////////////////////////
   //
@@ -118,6 +173,25 @@ class ILRewriter {
 
   HRESULT Export();
 
+  // Sets m_maxStack from a stack depth dataflow over the code,
+  // following branches and EH handler entries. Fails when an instruction is
+  // reached with different depths, the stack underflows or control falls
+  // off the end of the method.
+  HRESULT ComputeMaxStack();
+
+  HRESULT ComputeMaxStack(IMetaDataImport2* pImport);
+
+  // Switches every branch and leave to its short form.
+  void ShortenBranches();
+
+  // Assigns final offsets, widening the short branches whose target is out
+  // of range until none is. Returns the code size.
+  unsigned LayoutCode();
+
+  // Offset LayoutCode gave the code instruction at index, or the code size
+  // for GetCodeEnd().
+  unsigned GetOffset(unsigned index) const;
+
   HRESULT SetILFunctionBody(unsigned size, LPBYTE pBody);
 
   LPBYTE AllocateILMemory(unsigned size);
@@ -3,35 +3,27 @@
 
 ILRewriter* ILRewriterWrapper::GetILRewriter() const { return m_ILRewriter; }
 
-void ILRewriterWrapper::SetILPosition(ILInstr* pILInstr) {
-  m_ILInstr = pILInstr;
+void ILRewriterWrapper::SetILPosition(unsigned index) {
+  m_ILPosition = index;
 }
 
 void ILRewriterWrapper::Pop() const {
-  ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-  pNewInstr->m_opcode = CEE_POP;
-  m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+  m_ILRewriter->InsertBefore(m_ILPosition, CEE_POP);
 }
 
 void ILRewriterWrapper::LoadNull() const {
-  ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-  pNewInstr->m_opcode = CEE_LDNULL;
-  m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+  m_ILRewriter->InsertBefore(m_ILPosition, CEE_LDNULL);
 }
 
 void ILRewriterWrapper::LoadStr(mdToken token) const
 {
-    ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-    pNewInstr->m_opcode = CEE_LDSTR;
-    pNewInstr->m_Arg32 = token;
-    m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+    const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, CEE_LDSTR);
+    m_ILRewriter->GetInstr(newInstr)->m_Arg32 = token;
 }
 
 void ILRewriterWrapper::LoadInt64(const INT64 value) const {
-  ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-  pNewInstr->m_opcode = CEE_LDC_I8;
-  pNewInstr->m_Arg64 = value;
-  m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+  const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, CEE_LDC_I8);
+  m_ILRewriter->GetInstr(newInstr)->m_Arg64 = value;
 }
 
 void ILRewriterWrapper::LoadInt32(const INT32 value) const {
@@ -40,21 +32,17 @@ void ILRewriterWrapper::LoadInt32(const INT32 value) const {
       CEE_LDC_I4_5, CEE_LDC_I4_6, CEE_LDC_I4_7, CEE_LDC_I4_8,
   };
 
-  ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-
   if (value >= 0 && value <= 8) {
-    pNewInstr->m_opcode = opcodes[value];
+    m_ILRewriter->InsertBefore(m_ILPosition, opcodes[value]);
   }else if(value == -1) {
-      pNewInstr->m_opcode = CEE_LDC_I4_M1;
+      m_ILRewriter->InsertBefore(m_ILPosition, CEE_LDC_I4_M1);
   } else if (-128 <= value && value <= 127) {
-    pNewInstr->m_opcode = CEE_LDC_I4_S;
-    pNewInstr->m_Arg8 = static_cast<INT8>(value);
+    const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, CEE_LDC_I4_S);
+    m_ILRewriter->GetInstr(newInstr)->m_Arg8 = static_cast<INT8>(value);
   } else {
-    pNewInstr->m_opcode = CEE_LDC_I4;
-    pNewInstr->m_Arg32 = value;
+    const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, CEE_LDC_I4);
+    m_ILRewriter->GetInstr(newInstr)->m_Arg32 = value;
   }
-
-  m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
 }
 
 void ILRewriterWrapper::LoadArgument(const UINT16 index) const {
@@ -65,24 +53,20 @@ void ILRewriterWrapper::LoadArgument(const UINT16 index) const {
       CEE_LDARG_3,
   };
 
-  ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-
   if (index >= 0 && index <= 3) {
-    pNewInstr->m_opcode = opcodes[index];
+    m_ILRewriter->InsertBefore(m_ILPosition, opcodes[index]);
   } else if (index <= 255) {
-    pNewInstr->m_opcode = CEE_LDARG_S;
-    pNewInstr->m_Arg8 = static_cast<UINT8>(index);
+    const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, CEE_LDARG_S);
+    m_ILRewriter->GetInstr(newInstr)->m_Arg8 = static_cast<UINT8>(index);
   } else {
-    pNewInstr->m_opcode = CEE_LDARG;
-    pNewInstr->m_Arg16 = index;
+    const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, CEE_LDARG);
+    m_ILRewriter->GetInstr(newInstr)->m_Arg16 = index;
   }
-
-  m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
 }
 
 
 //https://github.com/dotnet/coreclr/blob/master/src/vm/stubgen.cpp EmitLDIND_T
-void ILRewriterWrapper::LoadIND(unsigned elementType) const
+unsigned GetLoadIndirectOpcode(unsigned elementType)
 {
     unsigned op_code = 0;
     switch (elementType)
@@ -117,20 +101,40 @@ void ILRewriterWrapper::LoadIND(unsigned elementType) const
     default:
         break;
     }
+    return op_code;
+}
 
+void ILRewriterWrapper::LoadIND(unsigned elementType) const
+{
+    const unsigned op_code = GetLoadIndirectOpcode(elementType);
     if (op_code > 0) {
-        ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-        pNewInstr->m_opcode = op_code;
-        m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+        m_ILRewriter->InsertBefore(m_ILPosition, op_code);
     }
 }
 
 void ILRewriterWrapper::LoadToken(mdToken token) const
 {
-    ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-    pNewInstr->m_opcode = CEE_LDTOKEN;
-    pNewInstr->m_Arg32 = token;
-    m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+    const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, CEE_LDTOKEN);
+    m_ILRewriter->GetInstr(newInstr)->m_Arg32 = token;
+}
+
+void ILRewriterWrapper::LoadStaticField(mdToken field) const
+{
+    const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, CEE_LDSFLD);
+    m_ILRewriter->GetInstr(newInstr)->m_Arg32 = field;
+}
+
+void ILRewriterWrapper::StoreStaticField(mdToken field) const
+{
+    const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, CEE_STSFLD);
+    m_ILRewriter->GetInstr(newInstr)->m_Arg32 = field;
+}
+
+unsigned ILRewriterWrapper::BranchTrue(unsigned target) const
+{
+    const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, CEE_BRTRUE_S);
+    m_ILRewriter->GetInstr(newInstr)->m_target = target;
+    return newInstr;
 }
 
 void ILRewriterWrapper::StLocal(unsigned index) const
@@ -142,19 +146,17 @@ void ILRewriterWrapper::StLocal(unsigned index) const
            CEE_STLOC_3,
     };
 
-    ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
     if (index <= 3) {
-        pNewInstr->m_opcode = opcodes[index];
+        m_ILRewriter->InsertBefore(m_ILPosition, opcodes[index]);
     }
     else if (index <= 255) {
-        pNewInstr->m_opcode = CEE_STLOC_S;
-        pNewInstr->m_Arg8 = static_cast<UINT8>(index);
+        const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, CEE_STLOC_S);
+        m_ILRewriter->GetInstr(newInstr)->m_Arg8 = static_cast<UINT8>(index);
     }
     else {
-        pNewInstr->m_opcode = CEE_STLOC;
-        pNewInstr->m_Arg16 = index;
+        const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, CEE_STLOC);
+        m_ILRewriter->GetInstr(newInstr)->m_Arg16 = index;
     }
-    m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
 }
 
 void ILRewriterWrapper::LoadLocal(unsigned index) const
@@ -166,40 +168,32 @@ void ILRewriterWrapper::LoadLocal(unsigned index) const
             CEE_LDLOC_3,
     };
 
-    ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
     if (index <= 3) {
-        pNewInstr->m_opcode = opcodes[index];
+        m_ILRewriter->InsertBefore(m_ILPosition, opcodes[index]);
     }
     else if (index <= 255) {
-        pNewInstr->m_opcode = CEE_LDLOC_S;
-        pNewInstr->m_Arg8 = static_cast<UINT8>(index);
+        const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, CEE_LDLOC_S);
+        m_ILRewriter->GetInstr(newInstr)->m_Arg8 = static_cast<UINT8>(index);
     }
     else {
-        pNewInstr->m_opcode = CEE_LDLOC;
-        pNewInstr->m_Arg16 = index;
+        const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, CEE_LDLOC);
+        m_ILRewriter->GetInstr(newInstr)->m_Arg16 = index;
     }
-    m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
 }
 
 void ILRewriterWrapper::Cast(const mdTypeRef type_ref) const {
-  ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-  pNewInstr->m_opcode = CEE_CASTCLASS;
-  pNewInstr->m_Arg32 = type_ref;
-  m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+  const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, CEE_CASTCLASS);
+  m_ILRewriter->GetInstr(newInstr)->m_Arg32 = type_ref;
 }
 
 void ILRewriterWrapper::Box(const mdTypeRef type_ref) const {
-  ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-  pNewInstr->m_opcode = CEE_BOX;
-  pNewInstr->m_Arg32 = type_ref;
-  m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+  const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, CEE_BOX);
+  m_ILRewriter->GetInstr(newInstr)->m_Arg32 = type_ref;
 }
 
 void ILRewriterWrapper::UnboxAny(const mdTypeRef type_ref) const {
-  ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-  pNewInstr->m_opcode = CEE_UNBOX_ANY;
-  pNewInstr->m_Arg32 = type_ref;
-  m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+  const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, CEE_UNBOX_ANY);
+  m_ILRewriter->GetInstr(newInstr)->m_Arg32 = type_ref;
 }
 
 void ILRewriterWrapper::CreateArray(const mdTypeRef type_ref,
@@ -207,24 +201,18 @@ void ILRewriterWrapper::CreateArray(const mdTypeRef type_ref,
   mdTypeRef typeRef = mdTypeRefNil;
   LoadInt32(size);
 
-  ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-  pNewInstr->m_opcode = CEE_NEWARR;
-  pNewInstr->m_Arg32 = type_ref;
-  m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+  const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, CEE_NEWARR);
+  m_ILRewriter->GetInstr(newInstr)->m_Arg32 = type_ref;
 }
 
 void ILRewriterWrapper::CallMember(const mdMemberRef& member_ref,
                                    const bool is_virtual) const {
-  ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-  pNewInstr->m_opcode = is_virtual ? CEE_CALLVIRT : CEE_CALL;
-  pNewInstr->m_Arg32 = member_ref;
-  m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+  const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, is_virtual ? CEE_CALLVIRT : CEE_CALL);
+  m_ILRewriter->GetInstr(newInstr)->m_Arg32 = member_ref;
 }
 
 void ILRewriterWrapper::Duplicate() const {
-  ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-  pNewInstr->m_opcode = CEE_DUP;
-  m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+  m_ILRewriter->InsertBefore(m_ILPosition, CEE_DUP);
 }
 
 void ILRewriterWrapper::BeginLoadValueIntoArray(const INT32 arrayIndex) const {
@@ -237,38 +225,26 @@ void ILRewriterWrapper::BeginLoadValueIntoArray(const INT32 arrayIndex) const {
 
 void ILRewriterWrapper::EndLoadValueIntoArray() const {
   // stelem.ref (store value into array at the specified index)
-  ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-  pNewInstr->m_opcode = CEE_STELEM_REF;
-  m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+  m_ILRewriter->InsertBefore(m_ILPosition, CEE_STELEM_REF);
 }
 
 void ILRewriterWrapper::Return() const {
-    ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-    pNewInstr->m_opcode = CEE_RET;
-    m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+    m_ILRewriter->InsertBefore(m_ILPosition, CEE_RET);
 }
 
-ILInstr* ILRewriterWrapper::Rethrow() const
+unsigned ILRewriterWrapper::Rethrow() const
 {
-    ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-    pNewInstr->m_opcode = CEE_RETHROW;
-    m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
-    return pNewInstr;
+    return m_ILRewriter->InsertBefore(m_ILPosition, CEE_RETHROW);
 }
 
-ILInstr* ILRewriterWrapper::EndFinally() const
+unsigned ILRewriterWrapper::EndFinally() const
 {
-    ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-    pNewInstr->m_opcode = CEE_ENDFINALLY;
-    m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
-    return pNewInstr;
+    return m_ILRewriter->InsertBefore(m_ILPosition, CEE_ENDFINALLY);
 }
 
-ILInstr* ILRewriterWrapper::CallMember0(const mdMemberRef& member_ref, bool is_virtual) const
+unsigned ILRewriterWrapper::CallMember0(const mdMemberRef& member_ref, bool is_virtual) const
 {
-    ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
-    pNewInstr->m_opcode = is_virtual ? CEE_CALLVIRT : CEE_CALL;
-    pNewInstr->m_Arg32 = member_ref;
-    m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
-    return pNewInstr;
+    const unsigned newInstr = m_ILRewriter->InsertBefore(m_ILPosition, is_virtual ? CEE_CALLVIRT : CEE_CALL);
+    m_ILRewriter->GetInstr(newInstr)->m_Arg32 = member_ref;
+    return newInstr;
 }
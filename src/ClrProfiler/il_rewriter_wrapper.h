@@ -3,17 +3,21 @@
 
 #include "il_rewriter.h"
 
+// ldind opcode for a by-ref argument of the given element type, 0 if none
+unsigned GetLoadIndirectOpcode(unsigned elementType);
+
 class ILRewriterWrapper {
  private:
   ILRewriter* const m_ILRewriter;
-  ILInstr* m_ILInstr;
+  // index the emitted code goes in front of
+  unsigned m_ILPosition;
 
  public:
   ILRewriterWrapper(ILRewriter* const il_rewriter)
-      : m_ILRewriter(il_rewriter), m_ILInstr(nullptr) {}
+      : m_ILRewriter(il_rewriter), m_ILPosition(0) {}
 
   ILRewriter* GetILRewriter() const;
-  void SetILPosition(ILInstr* pILInstr);
+  void SetILPosition(unsigned index);
   void Pop() const;
   void LoadNull() const;
   void LoadStr(mdToken token) const;
@@ -22,6 +26,9 @@ class ILRewriterWrapper {
   void LoadArgument(UINT16 index) const;
   void LoadIND(unsigned elementType) const;
   void LoadToken(mdToken token) const;
+  void LoadStaticField(mdToken field) const;
+  void StoreStaticField(mdToken field) const;
+  unsigned BranchTrue(unsigned target) const;
   void StLocal(unsigned index) const;
   void LoadLocal(unsigned index) const;
   void Cast(mdTypeRef type_ref) const;
@@ -33,9 +40,9 @@ class ILRewriterWrapper {
   void BeginLoadValueIntoArray(INT32 arrayIndex) const;
   void EndLoadValueIntoArray() const;
   void Return() const;
-  ILInstr* Rethrow() const;
-  ILInstr* EndFinally() const;
-  ILInstr* CallMember0(const mdMemberRef& member_ref, bool is_virtual) const;
+  unsigned Rethrow() const;
+  unsigned EndFinally() const;
+  unsigned CallMember0(const mdMemberRef& member_ref, bool is_virtual) const;
 };
 
 #endif  // CLR_PROFILER_IL_REWRITER_WRAPPER_H_
@@ -0,0 +1,599 @@
+#include "il_template.h"
+#include <cstddef>
+#include "il_rewriter_wrapper.h"
+
+namespace trace
+{
+    class TemplateEmitter
+    {
+    private:
+        std::vector<TemplateInstr>& instrs;
+    public:
+        TemplateEmitter(std::vector<TemplateInstr>& instrs) : instrs(instrs) {}
+
+        unsigned Emit(unsigned opcode, TemplateOperand kind = TemplateOperand::None, INT32 value = 0)
+        {
+            instrs.push_back(TemplateInstr{ opcode, kind, value });
+            return (unsigned)(instrs.size() - 1);
+        }
+
+        unsigned Token(unsigned opcode, int slot)
+        {
+            return Emit(opcode, TemplateOperand::Token, slot);
+        }
+
+        unsigned LoadLocal(TemplateLocal local)
+        {
+            return Emit(CEE_LDLOC, TemplateOperand::Local, local);
+        }
+
+        unsigned StLocal(TemplateLocal local)
+        {
+            return Emit(CEE_STLOC, TemplateOperand::Local, local);
+        }
+
+        unsigned LoadInt32(INT32 value)
+        {
+            if (value >= 0 && value <= 8) {
+                return Emit(CEE_LDC_I4_0 + value);
+            }
+            if (value == -1) {
+                return Emit(CEE_LDC_I4_M1);
+            }
+            if (-128 <= value && value <= 127) {
+                return Emit(CEE_LDC_I4_S, TemplateOperand::Literal, value);
+            }
+            return Emit(CEE_LDC_I4, TemplateOperand::Literal, value);
+        }
+
+        unsigned LoadArgument(UINT16 index)
+        {
+            if (index <= 3) {
+                return Emit(CEE_LDARG_0 + index);
+            }
+            if (index <= 255) {
+                return Emit(CEE_LDARG_S, TemplateOperand::Literal, index);
+            }
+            return Emit(CEE_LDARG, TemplateOperand::Literal, index);
+        }
+
+        unsigned LoadCounterAddress(size_t counterOffset)
+        {
+            const auto first = Emit(CEE_LDC_I8, TemplateOperand::CounterAddress, (INT32)counterOffset);
+            Emit(CEE_CONV_U);
+            return first;
+        }
+
+        // *counter += 1, not interlocked, a lost update only skews a count a little
+        unsigned Increment(size_t counterOffset)
+        {
+            const auto first = LoadCounterAddress(counterOffset);
+            Emit(CEE_DUP);
+            Emit(CEE_LDIND_I8);
+            Emit(CEE_LDC_I4_1);
+            Emit(CEE_CONV_I8);
+            Emit(CEE_ADD);
+            Emit(CEE_STIND_I8);
+            return first;
+        }
+
+        void SetBranchTarget(unsigned branch, unsigned target)
+        {
+            instrs[branch].value = (INT32)target;
+        }
+
+        unsigned Size() const
+        {
+            return (unsigned)instrs.size();
+        }
+    };
+
+    std::string MethodShape::Key() const
+    {
+        std::string key;
+        key.reserve(15 + arguments.size() * 3);
+        key.push_back((char)probeKind);
+        key.append((const char*)&sampleEvery, sizeof(sampleEvery));
+        key.append((const char*)&maxPerSecond, sizeof(maxPerSecond));
+        key.push_back((char)exceptionCapture);
+        key.push_back((char)countHits);
+        key.push_back((char)controlled);
+        key.push_back((char)retTypeFlags);
+        key.push_back((char)captureReturn);
+        key.push_back((char)arguments.size());
+        for (const auto& argument : arguments) {
+            key.push_back((char)argument.typeFlags);
+            key.push_back((char)argument.elementType);
+            key.push_back((char)argument.captured);
+        }
+        return key;
+    }
+
+    bool MethodShape::CapturesNoArgument() const
+    {
+        for (const auto& argument : arguments) {
+            if (argument.captured) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // the method's only ret, the rewritten rets leave here with their value in
+    // LocalRet, which has the method's return type
+    static void EmitTypedReturn(const MethodShape& shape, ILTemplate& ilTemplate, TemplateEmitter& epilogue)
+    {
+        ilTemplate.leaveTarget = epilogue.Size();
+        if (!(shape.retTypeFlags & TypeFlagVoid)) {
+            epilogue.LoadLocal(LocalRet);
+            TemplateEmitter retStore(ilTemplate.retStore);
+            retStore.StLocal(LocalRet);
+        }
+        epilogue.Emit(CEE_RET);
+    }
+
+    static TemplateLocalType RetLocalType(const MethodShape& shape)
+    {
+        return (shape.retTypeFlags & TypeFlagVoid) ? LocalTypeObject : LocalTypeReturn;
+    }
+
+    // bumps the hit counter on entry, the body is left as it is
+    static void BuildCounterTemplate(const MethodShape& shape, ILTemplate& ilTemplate)
+    {
+        TemplateEmitter prologue(ilTemplate.prologue);
+        prologue.Increment(offsetof(ProbeCounters, hits));
+    }
+
+    // counts the exceptions leaving the method, nothing runs on entry
+    static void BuildExceptionTemplate(const MethodShape& shape, ILTemplate& ilTemplate)
+    {
+        ilTemplate.locals = { RetLocalType(shape) };
+
+        TemplateEmitter prologue(ilTemplate.prologue);
+        if (shape.countHits) {
+            prologue.Increment(offsetof(ProbeCounters, hits));
+        }
+        const auto tryBegin = prologue.Emit(CEE_NOP);
+
+        TemplateEmitter epilogue(ilTemplate.epilogue);
+        TemplateClause exClause{};
+        exClause.tryBegin = tryBegin;
+        exClause.classTokenSlot = -1;
+        if (shape.exceptionCapture == ExceptionCapture::Filter) {
+            exClause.flags = COR_ILEXCEPTION_CLAUSE_FILTER;
+            exClause.filter = epilogue.Emit(CEE_POP);
+            epilogue.Increment(offsetof(ProbeCounters, exceptions));
+            epilogue.LoadInt32(0);
+            epilogue.Emit(CEE_ENDFILTER);
+            exClause.handlerBegin = epilogue.Emit(CEE_POP);
+            exClause.tryEnd = exClause.filter;
+        }
+        else {
+            exClause.flags = COR_ILEXCEPTION_CLAUSE_NONE;
+            exClause.handlerBegin = epilogue.Increment(offsetof(ProbeCounters, exceptions));
+            epilogue.Emit(CEE_POP);
+            exClause.tryEnd = exClause.handlerBegin;
+            exClause.classTokenSlot = SlotExceptionType;
+        }
+        exClause.handlerEnd = epilogue.Emit(CEE_RETHROW);
+        ilTemplate.clauses.push_back(exClause);
+
+        EmitTypedReturn(shape, ilTemplate, epilogue);
+    }
+
+    // every call into the probe's log2 latency histogram, both ends calli
+    // native functions so nothing managed runs besides the method
+    static void BuildTimingTemplate(const MethodShape& shape, ILTemplate& ilTemplate)
+    {
+        ilTemplate.locals = { RetLocalType(shape), LocalTypeInt64 };
+
+        TemplateEmitter prologue(ilTemplate.prologue);
+        if (shape.countHits) {
+            prologue.Increment(offsetof(ProbeCounters, hits));
+        }
+        prologue.Emit(CEE_LDC_I8, TemplateOperand::NativeFunction, NativeTimingEnter);
+        prologue.Emit(CEE_CONV_I);
+        prologue.Token(CEE_CALLI, SlotTimingEnter);
+        prologue.StLocal(LocalStart);
+        // the finally reads LocalStart, so the try only starts once it is stored
+        const auto tryBegin = prologue.Emit(CEE_NOP);
+
+        TemplateEmitter epilogue(ilTemplate.epilogue);
+        const auto finallyBegin = epilogue.Token(CEE_LDC_I4, SlotProbeId);
+        epilogue.LoadLocal(LocalStart);
+        epilogue.Emit(CEE_LDC_I8, TemplateOperand::NativeFunction, NativeTimingExit);
+        epilogue.Emit(CEE_CONV_I);
+        epilogue.Token(CEE_CALLI, SlotTimingExit);
+        const auto endFinally = epilogue.Emit(CEE_ENDFINALLY);
+
+        TemplateClause finallyClause{};
+        finallyClause.flags = COR_ILEXCEPTION_CLAUSE_FINALLY;
+        finallyClause.tryBegin = tryBegin;
+        finallyClause.tryEnd = finallyBegin;
+        finallyClause.handlerBegin = finallyBegin;
+        finallyClause.handlerEnd = endFinally;
+        finallyClause.classTokenSlot = -1;
+        ilTemplate.clauses.push_back(finallyClause);
+
+        EmitTypedReturn(shape, ilTemplate, epilogue);
+    }
+
+    // every call but the sampleEvery-th branches to skip, a power of two
+    // sampleEvery masks the hit count instead of dividing it
+    static void EmitSampleGate(const MethodShape& shape, TemplateEmitter& prologue, std::vector<unsigned>& skip)
+    {
+        prologue.LoadCounterAddress(offsetof(ProbeCounters, hits));
+        prologue.Emit(CEE_LDIND_I8);
+        if ((shape.sampleEvery & (shape.sampleEvery - 1)) == 0) {
+            prologue.Emit(CEE_LDC_I4, TemplateOperand::Literal, (INT32)(shape.sampleEvery - 1));
+            prologue.Emit(CEE_CONV_U8);
+            prologue.Emit(CEE_AND);
+        }
+        else {
+            prologue.Emit(CEE_LDC_I4, TemplateOperand::Literal, (INT32)shape.sampleEvery);
+            prologue.Emit(CEE_CONV_U8);
+            prologue.Emit(CEE_REM_UN);
+        }
+        skip.push_back(prologue.Emit(CEE_BRTRUE_S, TemplateOperand::Branch));
+    }
+
+    // a fixed one second window on Environment.TickCount, the calls after the
+    // first maxPerSecond of a window branch to skip. The unsigned difference
+    // survives TickCount wrapping, the window is not interlocked so a race
+    // can start a few spans more
+    static void EmitRateLimitGate(const MethodShape& shape, TemplateEmitter& prologue, std::vector<unsigned>& skip)
+    {
+        prologue.Token(CEE_CALL, SlotTickCount);
+        prologue.LoadCounterAddress(offsetof(ProbeCounters, windowStart));
+        prologue.Emit(CEE_LDIND_I4);
+        prologue.Emit(CEE_SUB);
+        prologue.LoadInt32(1000);
+        const auto sameWindow = prologue.Emit(CEE_BLT_UN_S, TemplateOperand::Branch);
+        prologue.LoadCounterAddress(offsetof(ProbeCounters, windowStart));
+        prologue.Token(CEE_CALL, SlotTickCount);
+        prologue.Emit(CEE_STIND_I4);
+        prologue.LoadCounterAddress(offsetof(ProbeCounters, windowSpans));
+        prologue.LoadInt32(0);
+        prologue.Emit(CEE_STIND_I4);
+        prologue.SetBranchTarget(sameWindow, prologue.LoadCounterAddress(offsetof(ProbeCounters, windowSpans)));
+        prologue.Emit(CEE_LDIND_U4);
+        prologue.Emit(CEE_LDC_I4, TemplateOperand::Literal, (INT32)shape.maxPerSecond);
+        skip.push_back(prologue.Emit(CEE_BGE_UN_S, TemplateOperand::Branch));
+        prologue.LoadCounterAddress(offsetof(ProbeCounters, windowSpans));
+        prologue.Emit(CEE_DUP);
+        prologue.Emit(CEE_LDIND_U4);
+        prologue.LoadInt32(1);
+        prologue.Emit(CEE_ADD);
+        prologue.Emit(CEE_STIND_I4);
+    }
+
+    // calls branch to skip while the kill switch or the probe's bit is set,
+    // both are read on every call so a flip applies from the next one
+    static void EmitControlGate(TemplateEmitter& prologue, std::vector<unsigned>& skip)
+    {
+        prologue.Emit(CEE_LDC_I8, TemplateOperand::ControlAddress, ControlKillSwitch);
+        prologue.Emit(CEE_CONV_U);
+        prologue.Emit(CEE_LDIND_U1);
+        skip.push_back(prologue.Emit(CEE_BRTRUE_S, TemplateOperand::Branch));
+        prologue.Emit(CEE_LDC_I8, TemplateOperand::ControlAddress, ControlProbeByte);
+        prologue.Emit(CEE_CONV_U);
+        prologue.Emit(CEE_LDIND_U1);
+        prologue.Emit(CEE_LDC_I4, TemplateOperand::ControlMask);
+        prologue.Emit(CEE_AND);
+        skip.push_back(prologue.Emit(CEE_BRTRUE_S, TemplateOperand::Branch));
+    }
+
+    std::shared_ptr<const ILTemplate> BuildILTemplate(const MethodShape& shape)
+    {
+        auto ilTemplate = std::make_shared<ILTemplate>();
+        switch (shape.probeKind) {
+        case ProbeKind::Counter:
+            BuildCounterTemplate(shape, *ilTemplate);
+            return ilTemplate;
+        case ProbeKind::Exception:
+            BuildExceptionTemplate(shape, *ilTemplate);
+            return ilTemplate;
+        case ProbeKind::Timing:
+            BuildTimingTemplate(shape, *ilTemplate);
+            return ilTemplate;
+        default:
+            break;
+        }
+
+        const bool isVoidMethod = (shape.retTypeFlags & TypeFlagVoid) > 0;
+        const bool retIsBoxedType = (shape.retTypeFlags & TypeFlagBoxedType) > 0;
+        // LocalRet is typed as the return value and only assigned by the rets
+        const bool retIsTyped = !isVoidMethod && !shape.captureReturn;
+        const bool sampled = shape.probeKind == ProbeKind::SampledSpan;
+        ilTemplate->locals = { retIsTyped ? LocalTypeReturn : LocalTypeObject, LocalTypeException, LocalTypeObject };
+
+        TemplateEmitter prologue(ilTemplate->prologue);
+        // ILRewriter::Peephole drops these when the method has InitLocals
+        prologue.Emit(CEE_LDNULL);
+        prologue.StLocal(LocalMethodTrace);
+        prologue.Emit(CEE_LDNULL);
+        prologue.StLocal(LocalEx);
+        if (!retIsTyped) {
+            prologue.Emit(CEE_LDNULL);
+            prologue.StLocal(LocalRet);
+        }
+        if (shape.countHits || sampled) {
+            prologue.Increment(offsetof(ProbeCounters, hits));
+        }
+        // sampled out calls skip BeforeMethod and the argument array, methodTrace
+        // stays null and the finally skips EndMethod
+        const auto tryBegin = prologue.Size();
+        std::vector<unsigned> skipBefore;
+        if (shape.controlled) {
+            EmitControlGate(prologue, skipBefore);
+        }
+        if (sampled && shape.sampleEvery > 1) {
+            EmitSampleGate(shape, prologue, skipBefore);
+        }
+        if (sampled && shape.maxPerSecond > 0) {
+            EmitRateLimitGate(shape, prologue, skipBefore);
+        }
+        prologue.LoadArgument(0);
+        const auto argNum = (INT32)shape.arguments.size();
+        if (shape.CapturesNoArgument()) {
+            prologue.Emit(CEE_LDNULL);
+        }
+        else {
+            prologue.LoadInt32(argNum);
+            prologue.Token(CEE_NEWARR, SlotObjectType);
+        }
+        for (INT32 i = 0; i < argNum; i++) {
+            const auto& argument = shape.arguments[i];
+            if (!argument.captured) {
+                continue;
+            }
+            prologue.Emit(CEE_DUP);
+            prologue.LoadInt32(i);
+            prologue.LoadArgument((UINT16)(i + 1));
+            if (argument.typeFlags & TypeFlagByRef) {
+                const auto opcode = GetLoadIndirectOpcode(argument.elementType);
+                if (opcode != 0) {
+                    prologue.Emit(opcode);
+                }
+            }
+            if (argument.typeFlags & TypeFlagBoxedType) {
+                prologue.Token(CEE_BOX, SlotArgumentTypeBase + i);
+            }
+            prologue.Emit(CEE_STELEM_REF);
+        }
+        prologue.Token(CEE_LDC_I4, SlotProbeId);
+        prologue.Token(CEE_CALL, SlotBeforeMethod);
+        prologue.StLocal(LocalMethodTrace);
+        for (const auto skip : skipBefore) {
+            ilTemplate->prologue[skip].value = prologue.Size();
+        }
+
+        TemplateEmitter epilogue(ilTemplate->epilogue);
+        TemplateClause exClause{};
+        exClause.tryBegin = tryBegin;
+        exClause.classTokenSlot = -1;
+        if (shape.exceptionCapture == ExceptionCapture::Filter) {
+            // record the exception and decline it, the search moves on
+            // without this frame ever catching
+            exClause.flags = COR_ILEXCEPTION_CLAUSE_FILTER;
+            exClause.filter = epilogue.Token(CEE_ISINST, SlotExceptionType);
+            epilogue.StLocal(LocalEx);
+            epilogue.LoadInt32(0);
+            epilogue.Emit(CEE_ENDFILTER);
+            exClause.handlerBegin = epilogue.Emit(CEE_POP);
+            exClause.tryEnd = exClause.filter;
+        }
+        else {
+            exClause.flags = COR_ILEXCEPTION_CLAUSE_NONE;
+            exClause.handlerBegin = epilogue.StLocal(LocalEx);
+            exClause.tryEnd = exClause.handlerBegin;
+            exClause.classTokenSlot = SlotExceptionType;
+        }
+        exClause.handlerEnd = epilogue.Emit(CEE_RETHROW);
+        ilTemplate->clauses.push_back(exClause);
+
+        const auto finallyBegin = epilogue.LoadLocal(LocalMethodTrace);
+        const auto skipEnd = epilogue.Emit(CEE_BRFALSE_S, TemplateOperand::Branch);
+        epilogue.LoadLocal(LocalMethodTrace);
+        if (retIsTyped) {
+            epilogue.Emit(CEE_LDNULL);
+        }
+        else {
+            epilogue.LoadLocal(LocalRet);
+        }
+        epilogue.LoadLocal(LocalEx);
+        epilogue.Token(CEE_CALL, SlotEndMethod);
+        const auto endFinally = epilogue.Emit(CEE_ENDFINALLY);
+        ilTemplate->epilogue[skipEnd].value = endFinally;
+        ilTemplate->leaveTarget = epilogue.Size();
+        if (!isVoidMethod) {
+            epilogue.LoadLocal(LocalRet);
+            if (!retIsTyped) {
+                epilogue.Token(retIsBoxedType ? CEE_UNBOX_ANY : CEE_CASTCLASS, SlotReturnType);
+            }
+        }
+        epilogue.Emit(CEE_RET);
+
+        if (!isVoidMethod) {
+            TemplateEmitter retStore(ilTemplate->retStore);
+            if (retIsBoxedType && !retIsTyped) {
+                retStore.Token(CEE_BOX, SlotReturnType);
+            }
+            retStore.StLocal(LocalRet);
+        }
+
+        TemplateClause finallyClause{};
+        finallyClause.flags = COR_ILEXCEPTION_CLAUSE_FINALLY;
+        finallyClause.tryBegin = tryBegin;
+        finallyClause.tryEnd = finallyBegin;
+        finallyClause.handlerBegin = finallyBegin;
+        finallyClause.handlerEnd = endFinally;
+        finallyClause.classTokenSlot = -1;
+        ilTemplate->clauses.push_back(finallyClause);
+
+        return ilTemplate;
+    }
+
+    std::shared_ptr<const ILTemplate> ILTemplateCache::Get(const MethodShape& shape)
+    {
+        const auto key = shape.Key();
+        {
+            std::lock_guard<std::mutex> guard(templateLock);
+            const auto it = templates.find(key);
+            if (it != templates.end()) {
+                return it->second;
+            }
+        }
+
+        auto ilTemplate = BuildILTemplate(shape);
+        {
+            std::lock_guard<std::mutex> guard(templateLock);
+            templates.emplace(key, ilTemplate);
+        }
+        return ilTemplate;
+    }
+
+    static void SetLocalOpcode(ILInstr* pInstr, unsigned index)
+    {
+        const bool isLoad = pInstr->m_opcode == CEE_LDLOC;
+        if (index <= 3) {
+            pInstr->m_opcode = (isLoad ? CEE_LDLOC_0 : CEE_STLOC_0) + index;
+        }
+        else if (index <= 255) {
+            pInstr->m_opcode = isLoad ? CEE_LDLOC_S : CEE_STLOC_S;
+            pInstr->m_Arg8 = static_cast<INT8>(index);
+        }
+        else {
+            pInstr->m_Arg16 = static_cast<INT16>(index);
+        }
+    }
+
+    // the ldc.i8 of an address becomes an ldc.i4 in a 32 bit process
+    static void SetAddressOperand(ILInstr* pInstr, size_t address)
+    {
+        if (sizeof(void*) == 8) {
+            pInstr->m_Arg64 = (INT64)address;
+        }
+        else {
+            pInstr->m_opcode = CEE_LDC_I4;
+            pInstr->m_Arg32 = (INT32)address;
+        }
+    }
+
+    static unsigned NewTemplateInstr(ILRewriter& rewriter,
+        unsigned where,
+        const TemplateInstr& instr,
+        const std::vector<mdToken>& tokens,
+        unsigned localBase,
+        const ProbeAddresses& addresses)
+    {
+        const unsigned index = rewriter.InsertBefore(where, instr.opcode);
+        ILInstr* pInstr = rewriter.GetInstr(index);
+        switch (instr.kind) {
+        case TemplateOperand::Literal:
+            pInstr->m_Arg32 = instr.value;
+            break;
+        case TemplateOperand::Token:
+            pInstr->m_Arg32 = tokens[instr.value];
+            break;
+        case TemplateOperand::Local:
+            SetLocalOpcode(pInstr, localBase + instr.value);
+            break;
+        case TemplateOperand::CounterAddress:
+            SetAddressOperand(pInstr, (size_t)addresses.pCounters + instr.value);
+            break;
+        case TemplateOperand::ControlAddress:
+            SetAddressOperand(pInstr, (size_t)(instr.value == ControlKillSwitch ? addresses.pKillSwitch : addresses.pProbeByte));
+            break;
+        case TemplateOperand::ControlMask:
+            pInstr->m_Arg32 = addresses.probeMask;
+            break;
+        case TemplateOperand::NativeFunction:
+            SetAddressOperand(pInstr, instr.value == NativeTimingEnter
+                ? reinterpret_cast<size_t>(&TimingProbeEnter)
+                : reinterpret_cast<size_t>(&TimingProbeExit));
+            break;
+        default:
+            break;
+        }
+        return index;
+    }
+
+    static void StampSection(ILRewriter& rewriter,
+        const std::vector<TemplateInstr>& section,
+        unsigned where,
+        const std::vector<mdToken>& tokens,
+        unsigned localBase,
+        const ProbeAddresses& addresses,
+        std::vector<unsigned>& stamped)
+    {
+        stamped.resize(section.size());
+        for (size_t i = 0; i < section.size(); i++) {
+            stamped[i] = NewTemplateInstr(rewriter, where, section[i], tokens, localBase, addresses);
+        }
+        for (size_t i = 0; i < section.size(); i++) {
+            if (section[i].kind == TemplateOperand::Branch) {
+                const auto target = (size_t)section[i].value;
+                rewriter.GetInstr(stamped[i])->m_target = target < section.size() ? stamped[target] : where;
+            }
+        }
+    }
+
+    HRESULT StampILTemplate(ILRewriter& rewriter,
+        const ILTemplate& ilTemplate,
+        const std::vector<mdToken>& tokens,
+        unsigned localBase,
+        const ProbeAddresses& addresses)
+    {
+        // the sections are logged against the original code and merged in
+        // one pass by the rewriter's next Commit
+        const unsigned firstOriginalInstr = 0;
+        const unsigned codeEnd = rewriter.GetCodeEnd();
+
+        std::vector<unsigned> prologue;
+        StampSection(rewriter, ilTemplate.prologue, firstOriginalInstr, tokens, localBase, addresses, prologue);
+
+        std::vector<unsigned> epilogue;
+        StampSection(rewriter, ilTemplate.epilogue, codeEnd, tokens, localBase, addresses, epilogue);
+
+        if (!epilogue.empty()) {
+            const unsigned leaveTarget = epilogue[ilTemplate.leaveTarget];
+            std::vector<unsigned> retStore;
+            for (unsigned ret : rewriter.GetReturns()) {
+                StampSection(rewriter, ilTemplate.retStore, ret, tokens, localBase, addresses, retStore);
+                ILInstr* pInstr = rewriter.GetInstr(ret);
+                pInstr->m_opcode = CEE_LEAVE_S;
+                pInstr->m_target = leaveTarget;
+            }
+        }
+
+        const auto nClauses = (unsigned)ilTemplate.clauses.size();
+        auto m_pEHNew = new EHClause[rewriter.m_nEH + nClauses];
+        for (unsigned i = 0; i < rewriter.m_nEH; i++) {
+            m_pEHNew[i] = rewriter.m_pEH[i];
+        }
+
+        for (unsigned i = 0; i < nClauses; i++) {
+            const auto& clause = ilTemplate.clauses[i];
+            EHClause ehClause{};
+            ehClause.m_Flags = clause.flags;
+            ehClause.m_tryBegin = prologue[clause.tryBegin];
+            ehClause.m_tryEnd = epilogue[clause.tryEnd];
+            ehClause.m_handlerBegin = epilogue[clause.handlerBegin];
+            ehClause.m_handlerEnd = epilogue[clause.handlerEnd];
+            if (clause.flags & COR_ILEXCEPTION_CLAUSE_FILTER) {
+                ehClause.m_filter = epilogue[clause.filter];
+            }
+            else if (clause.classTokenSlot >= 0) {
+                ehClause.m_ClassToken = tokens[clause.classTokenSlot];
+            }
+            m_pEHNew[rewriter.m_nEH + i] = ehClause;
+        }
+
+        delete[] rewriter.m_pEH;
+        rewriter.m_nEH += nClauses;
+        rewriter.m_pEH = m_pEHNew;
+
+        return S_OK;
+    }
+}
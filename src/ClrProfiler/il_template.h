@@ -0,0 +1,181 @@
+#ifndef CLR_PROFILER_IL_TEMPLATE_H_
+#define CLR_PROFILER_IL_TEMPLATE_H_
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "il_rewriter.h"
+#include "clr_helpers.h"
+#include "config_loader.h"
+#include "probe_table.h"
+
+namespace trace {
+
+    // token slots patched into a template when it is stamped into a method,
+    // SlotProbeId holds the probe id literal, argument box tokens follow SlotArgumentTypeBase
+    enum TemplateTokenSlot
+    {
+        SlotObjectType,
+        SlotBeforeMethod,
+        SlotEndMethod,
+        SlotExceptionType,
+        SlotReturnType,
+        SlotProbeId,
+        // calli signatures of TimingProbeEnter and TimingProbeExit, timing probes
+        SlotTimingEnter,
+        SlotTimingExit,
+        // Environment.TickCount, rate limited sampled probes
+        SlotTickCount,
+        SlotArgumentTypeBase
+    };
+
+    // locals appended by ModifyLocalSig, relative to the first new local
+    enum TemplateLocal
+    {
+        LocalRet = 0,
+        LocalEx = 1,
+        LocalMethodTrace = 2,
+        // timing templates have no exception or trace local, their start
+        // timestamp takes the slot after LocalRet
+        LocalStart = LocalEx
+    };
+
+    // type of an appended local, LocalTypeReturn is the method's return type
+    enum TemplateLocalType
+    {
+        LocalTypeObject,
+        LocalTypeException,
+        LocalTypeReturn,
+        LocalTypeInt64
+    };
+
+    enum class TemplateOperand : BYTE
+    {
+        None,
+        Literal,
+        Token,
+        Local,
+        // a prologue branch to one past its last instruction goes to the
+        // first original instruction
+        Branch,
+        // address of a field of the probe's ProbeCounters, value is its offset
+        CounterAddress,
+        // address of a control segment byte, value is a ControlByte
+        ControlAddress,
+        // literal, the probe's bit in its control segment byte
+        ControlMask,
+        // address of a native function the injected code callis, value is a NativeFunction
+        NativeFunction
+    };
+
+    enum NativeFunction
+    {
+        NativeTimingEnter,
+        NativeTimingExit
+    };
+
+    enum ControlByte
+    {
+        ControlKillSwitch,
+        ControlProbeByte
+    };
+
+    struct TemplateInstr
+    {
+        unsigned opcode;
+        TemplateOperand kind;
+        INT32 value;
+    };
+
+    // try ranges start in the prologue, everything else is an epilogue index
+    struct TemplateClause
+    {
+        CorExceptionFlag flags;
+        unsigned tryBegin;
+        unsigned tryEnd;
+        unsigned handlerBegin;
+        unsigned handlerEnd;
+        unsigned filter;
+        int classTokenSlot;
+    };
+
+    struct ILTemplate
+    {
+        // inserted before the first original instruction
+        std::vector<TemplateInstr> prologue;
+        // appended after the original body, ends with the method's only ret
+        std::vector<TemplateInstr> epilogue;
+        // inserted before every original ret, which becomes a leave
+        std::vector<TemplateInstr> retStore;
+        // epilogue index the rewritten rets leave to, the rets stay when the
+        // epilogue is empty
+        unsigned leaveTarget = 0;
+        std::vector<TemplateClause> clauses;
+        // locals to append, none leaves the local sig alone
+        std::vector<TemplateLocalType> locals;
+    };
+
+    struct ArgumentShape
+    {
+        int typeFlags;
+        unsigned elementType;
+        // copied into the argument array, its slot stays null otherwise
+        bool captured;
+    };
+
+    // everything the injected code depends on besides the tokens
+    struct MethodShape
+    {
+        std::vector<ArgumentShape> arguments;
+        int retTypeFlags = 0;
+        ExceptionCapture exceptionCapture = ExceptionCapture::Filter;
+        ProbeKind probeKind = ProbeKind::Span;
+        // SampledSpan calls BeforeMethod once in sampleEvery calls, and at most
+        // maxPerSecond times a second when it is not 0
+        unsigned sampleEvery = 1;
+        unsigned maxPerSecond = 0;
+        // bump the probe's hit counter on entry, for the overhead governor
+        bool countHits = false;
+        // span probes skip BeforeMethod while the control segment mutes them
+        bool controlled = false;
+        // EndMethod gets the boxed return value, otherwise null and LocalRet
+        // has the method's own return type so nothing is boxed
+        bool captureReturn = true;
+
+        // no argument is captured, BeforeMethod gets a null array
+        bool CapturesNoArgument() const;
+
+        std::string Key() const;
+    };
+
+    class ILTemplateCache
+    {
+    private:
+        std::mutex templateLock;
+        std::unordered_map<std::string, std::shared_ptr<const ILTemplate>> templates{};
+    public:
+        std::shared_ptr<const ILTemplate> Get(const MethodShape& shape);
+    };
+
+    std::shared_ptr<const ILTemplate> BuildILTemplate(const MethodShape& shape);
+
+    // native memory of the probe the stamped code reads and writes
+    struct ProbeAddresses
+    {
+        ProbeCounters* pCounters;
+        // control segment bytes, only read by controlled shapes
+        volatile BYTE* pKillSwitch;
+        volatile BYTE* pProbeByte;
+        BYTE probeMask;
+    };
+
+    HRESULT StampILTemplate(ILRewriter& rewriter,
+        const ILTemplate& ilTemplate,
+        const std::vector<mdToken>& tokens,
+        unsigned localBase,
+        const ProbeAddresses& addresses);
+}
+
+#endif  // CLR_PROFILER_IL_TEMPLATE_H_
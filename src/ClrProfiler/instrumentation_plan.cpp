@@ -0,0 +1,217 @@
+#include "instrumentation_plan.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace trace
+{
+    // file layout, little endian: PlanHeader, moduleCount PlanEntry sorted by
+    // mvid bytes, then methodCount mdMethodDef the entries point into
+    const DWORD PlanMagic = 0x50544350;  // CPTP
+    const DWORD PlanVersion = 1;
+
+    struct PlanHeader
+    {
+        DWORD magic;
+        DWORD version;
+        UINT64 rulesHash;
+        DWORD moduleCount;
+        DWORD methodCount;
+    };
+
+    struct PlanEntry
+    {
+        GUID mvid;
+        DWORD firstMethod;
+        DWORD methodCount;
+    };
+
+    static bool MvidLess(const GUID& a, const GUID& b)
+    {
+        return memcmp(&a, &b, sizeof(GUID)) < 0;
+    }
+
+    // FNV-1a
+    static void HashAppend(UINT64& hash, const WSTRING& str)
+    {
+        for (const auto c : str) {
+            hash = (hash ^ (UINT64)(WORD)c) * 0x100000001b3ULL;
+        }
+        hash = (hash ^ 0xFFFF) * 0x100000001b3ULL;
+    }
+
+    UINT64 HashTraceRules(const std::vector<TraceAssembly>& traceAssemblies)
+    {
+        UINT64 hash = 0xcbf29ce484222325ULL;
+        for (const auto& assembly : traceAssemblies) {
+            HashAppend(hash, assembly.assemblyName);
+            HashAppend(hash, assembly.className);
+            for (const auto& method : assembly.methods) {
+                HashAppend(hash, method.methodName);
+                HashAppend(hash, method.paramsName);
+            }
+        }
+        return hash;
+    }
+
+    void ResolveCandidateMethods(const MetadataReader& reader,
+        const TraceMatcher& traceMatcher,
+        const WSTRING& assemblyName,
+        const std::function<void(mdMethodDef, const WSTRING&, LPCSTR, const std::vector<TraceRule>&)>& onMatch)
+    {
+        std::vector<TraceRule> rules;
+        for (ULONG rid = 1; rid <= reader.GetRowCount(TableTypeDef); rid++) {
+            const auto typeDef = TokenFromRid(rid, mdtTypeDef);
+            LPCSTR name;
+            LPCSTR nameSpace;
+            mdMethodDef first;
+            mdMethodDef end;
+            if (!reader.GetTypeDefProps(typeDef, &name, &nameSpace, nullptr) ||
+                !reader.GetTypeDefMethods(typeDef, &first, &end) || first == end) {
+                continue;
+            }
+
+            // same name as GetTypeDefProps, nested types have no namespace
+            const auto typeName = ToWSTRING(*nameSpace ? std::string(nameSpace) + "." + name : std::string(name));
+            if (!traceMatcher.MatchClass(assemblyName, typeName)) {
+                continue;
+            }
+            for (auto methodDef = first; methodDef < end; methodDef++) {
+                LPCSTR methodName;
+                if (!reader.GetMethodProps(methodDef, &methodName, nullptr, nullptr)) {
+                    continue;
+                }
+                if (traceMatcher.Match(assemblyName, typeName, ToWSTRING(methodName), &rules)) {
+                    onMatch(methodDef, typeName, methodName, rules);
+                }
+            }
+        }
+    }
+
+    bool WriteInstrumentationPlan(const WSTRING& path, UINT64 rulesHash, std::vector<PlanModule> modules)
+    {
+        std::sort(modules.begin(), modules.end(),
+            [](const PlanModule& a, const PlanModule& b) { return MvidLess(a.mvid, b.mvid); });
+
+        PlanHeader header{ PlanMagic, PlanVersion, rulesHash, (DWORD)modules.size(), 0 };
+        std::vector<PlanEntry> entries;
+        std::vector<mdMethodDef> methods;
+        for (const auto& module : modules) {
+            entries.push_back(PlanEntry{ module.mvid, (DWORD)methods.size(), (DWORD)module.methods.size() });
+            methods.insert(methods.end(), module.methods.begin(), module.methods.end());
+        }
+        header.methodCount = (DWORD)methods.size();
+
+        std::ofstream stream(ToString(path), std::ios::binary | std::ios::trunc);
+        stream.write((const char*)&header, sizeof(header));
+        stream.write((const char*)entries.data(), entries.size() * sizeof(PlanEntry));
+        stream.write((const char*)methods.data(), methods.size() * sizeof(mdMethodDef));
+        return stream.good();
+    }
+
+    bool InstrumentationPlan::Open(const WSTRING& path, UINT64 rulesHash)
+    {
+        Close();
+#ifdef _WIN32
+        const auto file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER fileSize;
+        const auto mapping = GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0
+            ? CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr)
+            : nullptr;
+        CloseHandle(file);
+        if (mapping == nullptr) {
+            return false;
+        }
+        const auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+        if (view == nullptr) {
+            return false;
+        }
+        data = (LPCBYTE)view;
+        size = (size_t)fileSize.QuadPart;
+#else
+        const auto fd = open(ToString(path).c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        void* view = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            view = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (view == MAP_FAILED) {
+            return false;
+        }
+        data = (LPCBYTE)view;
+        size = (size_t)st.st_size;
+#endif
+
+        PlanHeader header;
+        if (size < sizeof(header)) {
+            Close();
+            return false;
+        }
+        memcpy(&header, data, sizeof(header));
+        const auto expectedSize = sizeof(PlanHeader) + (UINT64)header.moduleCount * sizeof(PlanEntry) +
+            (UINT64)header.methodCount * sizeof(mdMethodDef);
+        if (header.magic != PlanMagic || header.version != PlanVersion ||
+            header.rulesHash != rulesHash || expectedSize != size) {
+            Close();
+            return false;
+        }
+        const auto entries = (const PlanEntry*)(data + sizeof(PlanHeader));
+        for (DWORD i = 0; i < header.moduleCount; i++) {
+            if ((UINT64)entries[i].firstMethod + entries[i].methodCount > header.methodCount) {
+                Close();
+                return false;
+            }
+        }
+        moduleCount = header.moduleCount;
+        return true;
+    }
+
+    void InstrumentationPlan::Close()
+    {
+        if (data == nullptr) {
+            return;
+        }
+#ifdef _WIN32
+        UnmapViewOfFile(data);
+#else
+        munmap((void*)data, size);
+#endif
+        data = nullptr;
+        size = 0;
+        moduleCount = 0;
+    }
+
+    bool InstrumentationPlan::TryGetMethods(const GUID& mvid, const mdMethodDef** methods, ULONG* count) const
+    {
+        if (data == nullptr) {
+            return false;
+        }
+        const auto entries = (const PlanEntry*)(data + sizeof(PlanHeader));
+        const auto entriesEnd = entries + moduleCount;
+        const auto it = std::lower_bound(entries, entriesEnd, mvid,
+            [](const PlanEntry& entry, const GUID& value) { return MvidLess(entry.mvid, value); });
+        if (it == entriesEnd || memcmp(&it->mvid, &mvid, sizeof(GUID)) != 0) {
+            return false;
+        }
+        const auto firstMethod = (const mdMethodDef*)(entriesEnd);
+        *methods = firstMethod + it->firstMethod;
+        *count = it->methodCount;
+        return true;
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef CLR_PROFILER_INSTRUMENTATION_PLAN_H_
+#define CLR_PROFILER_INSTRUMENTATION_PLAN_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "cor.h"
+#include "string.h"  // NOLINT
+#include "config_loader.h"
+#include "metadata_reader.h"
+#include "trace_matcher.h"
+
+namespace trace {
+
+    // file name of the plan in the profiler home
+    const WSTRING InstrumentationPlanFileName = "trace.plan"_W;
+
+    // hash of the rules a plan was compiled from, a plan of other rules is ignored
+    UINT64 HashTraceRules(const std::vector<TraceAssembly>& traceAssemblies);
+
+    // calls onMatch for every method of the image whose names match a rule,
+    // paramsName is left to the JIT time check
+    void ResolveCandidateMethods(const MetadataReader& reader,
+        const TraceMatcher& traceMatcher,
+        const WSTRING& assemblyName,
+        const std::function<void(mdMethodDef, const WSTRING&, LPCSTR, const std::vector<TraceRule>&)>& onMatch);
+
+    struct PlanModule
+    {
+        GUID mvid;
+        std::vector<mdMethodDef> methods;
+    };
+
+    bool WriteInstrumentationPlan(const WSTRING& path, UINT64 rulesHash, std::vector<PlanModule> modules);
+
+    // candidate methods per module build, compiled offline by ClrProfilerPlan
+    // and mapped read only at startup, a module found here is not scanned
+    class InstrumentationPlan
+    {
+    private:
+        LPCBYTE data = nullptr;
+        size_t size = 0;
+        ULONG moduleCount = 0;
+
+        void Close();
+    public:
+        InstrumentationPlan() = default;
+        InstrumentationPlan(const InstrumentationPlan&) = delete;
+        InstrumentationPlan& operator=(const InstrumentationPlan&) = delete;
+        ~InstrumentationPlan() { Close(); }
+
+        // false when there is no plan or it was compiled from other rules
+        bool Open(const WSTRING& path, UINT64 rulesHash);
+        bool IsOpen() const { return data != nullptr; }
+
+        bool TryGetMethods(const GUID& mvid, const mdMethodDef** methods, ULONG* count) const;
+    };
+}
+
+#endif  // CLR_PROFILER_INSTRUMENTATION_PLAN_H_
@@ -42,7 +42,9 @@ namespace trace {
             const auto log_name = log_path + PathSeparator + "trace"_W + ToWSTRING(std::to_string(GetPID())) + ".log"_W;
             m_fileout = spdlog::rotating_logger_mt("Logger", ToString(log_name), 1024 * 1024 * 10, 3);
 
-            m_fileout->set_level(spdlog::level::info);
+            // "debug" also logs what happens per jitted method
+            const auto level = GetEnvironmentValue(GetClrProfilerLogLevel());
+            m_fileout->set_level(level == "debug"_W ? spdlog::level::debug : spdlog::level::info);
 
             m_fileout->set_pattern("[%Y-%m-%d %T.%e] [%l] [thread %t] %v");
 
@@ -58,6 +60,11 @@ namespace trace {
         std::shared_ptr<spdlog::logger> m_fileout;
     };
 
+#define Debug( ... )                               \
+    {                                                 \
+        CLogger::Instance()->m_fileout->debug(__VA_ARGS__);  \
+    }
+
 #define Info( ... )                               \
     {                                                 \
         CLogger::Instance()->m_fileout->info(__VA_ARGS__);  \
@@ -0,0 +1,461 @@
+#include "metadata_reader.h"
+#include <cstring>
+
+namespace trace
+{
+    // column kinds of the schema below, values under ColCoded are simple
+    // indexes into that table
+    const BYTE ColCoded = 0x40;
+    const BYTE ColFixed2 = 0x80;
+    const BYTE ColFixed4 = 0x81;
+    const BYTE ColString = 0x82;
+    const BYTE ColGuid = 0x83;
+    const BYTE ColBlob = 0x84;
+    const BYTE ColEnd = 0xFF;
+
+    // ECMA-335 II.24.2.6 coded indexes, ColCoded + kind
+    enum CodedIndex
+    {
+        TypeDefOrRef,
+        HasConstant,
+        HasCustomAttribute,
+        HasFieldMarshal,
+        HasDeclSecurity,
+        MemberRefParent,
+        HasSemantics,
+        MethodDefOrRef,
+        MemberForwarded,
+        Implementation,
+        CustomAttributeType,
+        ResolutionScope,
+        TypeOrMethodDef,
+        CodedIndexCount
+    };
+
+    // tag bits and the tables a coded index refers to, 0xFF is an unused tag
+    const struct
+    {
+        BYTE tagBits;
+        BYTE tableCount;
+        BYTE tables[22];
+    } CodedIndexes[CodedIndexCount] = {
+        { 2, 3, { 0x02, 0x01, 0x1B } },
+        { 2, 3, { 0x04, 0x08, 0x17 } },
+        { 5, 22, { 0x06, 0x04, 0x01, 0x02, 0x08, 0x09, 0x0A, 0x00, 0x0E, 0x17, 0x14,
+            0x11, 0x1A, 0x1B, 0x20, 0x23, 0x26, 0x27, 0x28, 0x2A, 0x2C, 0x2B } },
+        { 1, 2, { 0x04, 0x08 } },
+        { 2, 3, { 0x02, 0x06, 0x20 } },
+        { 3, 5, { 0x02, 0x01, 0x1A, 0x06, 0x1B } },
+        { 1, 2, { 0x14, 0x17 } },
+        { 1, 2, { 0x06, 0x0A } },
+        { 1, 2, { 0x04, 0x06 } },
+        { 2, 3, { 0x26, 0x23, 0x27 } },
+        { 3, 5, { 0xFF, 0xFF, 0x06, 0x0A, 0xFF } },
+        { 2, 4, { 0x00, 0x1A, 0x23, 0x01 } },
+        { 1, 2, { 0x02, 0x06 } },
+    };
+
+    #define CI(kind) (ColCoded + (kind))
+
+    // ECMA-335 II.22 columns of every table, needed to size the rows of the
+    // tables in front of the ones we read
+    const BYTE TableSchema[TableCount][10] = {
+        /* Module */ { ColFixed2, ColString, ColGuid, ColGuid, ColGuid, ColEnd },
+        /* TypeRef */ { CI(ResolutionScope), ColString, ColString, ColEnd },
+        /* TypeDef */ { ColFixed4, ColString, ColString, CI(TypeDefOrRef), 0x04, 0x06, ColEnd },
+        /* FieldPtr */ { 0x04, ColEnd },
+        /* Field */ { ColFixed2, ColString, ColBlob, ColEnd },
+        /* MethodPtr */ { 0x06, ColEnd },
+        /* MethodDef */ { ColFixed4, ColFixed2, ColFixed2, ColString, ColBlob, 0x08, ColEnd },
+        /* ParamPtr */ { 0x08, ColEnd },
+        /* Param */ { ColFixed2, ColFixed2, ColString, ColEnd },
+        /* InterfaceImpl */ { 0x02, CI(TypeDefOrRef), ColEnd },
+        /* MemberRef */ { CI(MemberRefParent), ColString, ColBlob, ColEnd },
+        /* Constant */ { ColFixed2, CI(HasConstant), ColBlob, ColEnd },
+        /* CustomAttribute */ { CI(HasCustomAttribute), CI(CustomAttributeType), ColBlob, ColEnd },
+        /* FieldMarshal */ { CI(HasFieldMarshal), ColBlob, ColEnd },
+        /* DeclSecurity */ { ColFixed2, CI(HasDeclSecurity), ColBlob, ColEnd },
+        /* ClassLayout */ { ColFixed2, ColFixed4, 0x02, ColEnd },
+        /* FieldLayout */ { ColFixed4, 0x04, ColEnd },
+        /* StandAloneSig */ { ColBlob, ColEnd },
+        /* EventMap */ { 0x02, 0x14, ColEnd },
+        /* EventPtr */ { 0x14, ColEnd },
+        /* Event */ { ColFixed2, ColString, CI(TypeDefOrRef), ColEnd },
+        /* PropertyMap */ { 0x02, 0x17, ColEnd },
+        /* PropertyPtr */ { 0x17, ColEnd },
+        /* Property */ { ColFixed2, ColString, ColBlob, ColEnd },
+        /* MethodSemantics */ { ColFixed2, 0x06, CI(HasSemantics), ColEnd },
+        /* MethodImpl */ { 0x02, CI(MethodDefOrRef), CI(MethodDefOrRef), ColEnd },
+        /* ModuleRef */ { ColString, ColEnd },
+        /* TypeSpec */ { ColBlob, ColEnd },
+        /* ImplMap */ { ColFixed2, CI(MemberForwarded), ColString, 0x1A, ColEnd },
+        /* FieldRVA */ { ColFixed4, 0x04, ColEnd },
+        /* ENCLog */ { ColFixed4, ColFixed4, ColEnd },
+        /* ENCMap */ { ColFixed4, ColEnd },
+        /* Assembly */ { ColFixed4, ColFixed2, ColFixed2, ColFixed2, ColFixed2, ColFixed4, ColBlob, ColString, ColString, ColEnd },
+        /* AssemblyProcessor */ { ColFixed4, ColEnd },
+        /* AssemblyOS */ { ColFixed4, ColFixed4, ColFixed4, ColEnd },
+        /* AssemblyRef */ { ColFixed2, ColFixed2, ColFixed2, ColFixed2, ColFixed4, ColBlob, ColString, ColString, ColBlob, ColEnd },
+        /* AssemblyRefProcessor */ { ColFixed4, 0x23, ColEnd },
+        /* AssemblyRefOS */ { ColFixed4, ColFixed4, ColFixed4, 0x23, ColEnd },
+        /* File */ { ColFixed4, ColString, ColBlob, ColEnd },
+        /* ExportedType */ { ColFixed4, ColFixed4, ColString, ColString, CI(Implementation), ColEnd },
+        /* ManifestResource */ { ColFixed4, ColFixed4, ColString, CI(Implementation), ColEnd },
+        /* NestedClass */ { 0x02, 0x02, ColEnd },
+        /* GenericParam */ { ColFixed2, ColFixed2, CI(TypeOrMethodDef), ColString, ColEnd },
+        /* MethodSpec */ { CI(MethodDefOrRef), ColBlob, ColEnd },
+        /* GenericParamConstraint */ { 0x2A, CI(TypeDefOrRef), ColEnd },
+    };
+
+    #undef CI
+
+    // columns read below
+    const int ModuleMvid = 2;
+    const int AssemblyName = 7;
+    const int TypeRefResolutionScope = 0;
+    const int TypeRefName = 1;
+    const int TypeRefNamespace = 2;
+    const int TypeDefFlags = 0;
+    const int TypeDefName = 1;
+    const int TypeDefNamespace = 2;
+    const int TypeDefMethodList = 5;
+    const int MethodDefName = 3;
+    const int MethodDefSignature = 4;
+    const int AssemblyRefPublicKeyOrToken = 5;
+    const int AssemblyRefName = 6;
+
+    // heap size flags of the #~ header
+    const BYTE HeapStringsLarge = 0x01;
+    const BYTE HeapGuidLarge = 0x02;
+    const BYTE HeapBlobLarge = 0x04;
+    const BYTE HeapExtraData = 0x40;
+
+    const DWORD MetadataSignature = 0x424A5342;  // BSJB
+
+    template <typename T>
+    static T ReadAt(LPCBYTE p)
+    {
+        T value;
+        memcpy(&value, p, sizeof(T));
+        return value;
+    }
+
+    // stream names are NUL terminated, nameLength excludes the NUL
+    static bool IsStreamName(const char* name, size_t nameLength, const char* expected)
+    {
+        return nameLength == strlen(expected) && memcmp(name, expected, nameLength) == 0;
+    }
+
+    bool MetadataReader::Open(LPCBYTE pMetadata, ULONG cbMetadata)
+    {
+        strings = nullptr;
+        blobs = nullptr;
+        guids = nullptr;
+        if (pMetadata == nullptr || cbMetadata < 16 || VAL32(ReadAt<DWORD>(pMetadata)) != MetadataSignature) {
+            return false;
+        }
+
+        // metadata root, II.24.2.1
+        const LPCBYTE end = pMetadata + cbMetadata;
+        const auto versionLength = VAL32(ReadAt<DWORD>(pMetadata + 12));
+        if (versionLength > cbMetadata - 16 || ((versionLength + 3) & ~3) + 4 > cbMetadata - 16) {
+            return false;
+        }
+        LPCBYTE p = pMetadata + 16 + ((versionLength + 3) & ~3);
+        const auto streamCount = VAL16(ReadAt<WORD>(p + 2));
+        p += 4;
+
+        LPCBYTE tableStream = nullptr;
+        ULONG tableStreamSize = 0;
+        LPCBYTE stringHeap = nullptr;
+        for (WORD i = 0; i < streamCount; i++) {
+            if (p + 8 > end) {
+                return false;
+            }
+            const auto offset = VAL32(ReadAt<DWORD>(p));
+            const auto size = VAL32(ReadAt<DWORD>(p + 4));
+            const auto name = (const char*)(p + 8);
+            const auto nameLength = strnlen(name, end - (LPCBYTE)name);
+            if (nameLength == (size_t)(end - (LPCBYTE)name)) {
+                // no NUL before the end of the metadata
+                return false;
+            }
+            if (offset > cbMetadata || size > cbMetadata - offset) {
+                return false;
+            }
+            if (IsStreamName(name, nameLength, "#~")) {
+                tableStream = pMetadata + offset;
+                tableStreamSize = size;
+            }
+            else if (IsStreamName(name, nameLength, "#Strings")) {
+                stringHeap = pMetadata + offset;
+                stringsSize = size;
+            }
+            else if (IsStreamName(name, nameLength, "#Blob")) {
+                blobs = pMetadata + offset;
+                blobsSize = size;
+            }
+            else if (IsStreamName(name, nameLength, "#GUID")) {
+                guids = pMetadata + offset;
+                guidsSize = size;
+            }
+            else if (IsStreamName(name, nameLength, "#-")) {
+                return false;
+            }
+            const auto headerSize = 8 + ((nameLength + 1 + 3) & ~3);
+            if (headerSize > (size_t)(end - p)) {
+                return false;
+            }
+            p += headerSize;
+        }
+        if (tableStream == nullptr || stringHeap == nullptr || tableStreamSize < 24) {
+            return false;
+        }
+
+        // #~ stream, II.24.2.6
+        const auto heapSizes = tableStream[6];
+        const auto valid = VAL64(ReadAt<UINT64>(tableStream + 8));
+        if ((valid >> TableCount) != 0) {
+            return false;
+        }
+        p = tableStream + 24;
+        const LPCBYTE tableEnd = tableStream + tableStreamSize;
+        for (int t = 0; t < TableCount; t++) {
+            tables[t] = Table{};
+            if (valid & ((UINT64)1 << t)) {
+                if (p + 4 > tableEnd) {
+                    return false;
+                }
+                tables[t].rowCount = VAL32(ReadAt<DWORD>(p));
+                p += 4;
+            }
+        }
+        if (heapSizes & HeapExtraData) {
+            if (p + 4 > tableEnd) {
+                return false;
+            }
+            p += 4;
+        }
+
+        // the Ptr tables only show up with uncompressed metadata, rows are
+        // read without that indirection
+        if (tables[0x03].rowCount || tables[0x05].rowCount || tables[0x07].rowCount) {
+            return false;
+        }
+
+        for (int t = 0; t < TableCount; t++) {
+            auto& table = tables[t];
+            ULONG rowSize = 0;
+            for (int c = 0; c < MaxColumns && TableSchema[t][c] != ColEnd; c++) {
+                const auto column = TableSchema[t][c];
+                BYTE size;
+                if (column == ColFixed2) {
+                    size = 2;
+                }
+                else if (column == ColFixed4) {
+                    size = 4;
+                }
+                else if (column == ColString) {
+                    size = heapSizes & HeapStringsLarge ? 4 : 2;
+                }
+                else if (column == ColGuid) {
+                    size = heapSizes & HeapGuidLarge ? 4 : 2;
+                }
+                else if (column == ColBlob) {
+                    size = heapSizes & HeapBlobLarge ? 4 : 2;
+                }
+                else if (column >= ColCoded) {
+                    const auto& coded = CodedIndexes[column - ColCoded];
+                    ULONG maxRows = 0;
+                    for (BYTE i = 0; i < coded.tableCount; i++) {
+                        if (coded.tables[i] != 0xFF && tables[coded.tables[i]].rowCount > maxRows) {
+                            maxRows = tables[coded.tables[i]].rowCount;
+                        }
+                    }
+                    size = maxRows < (1u << (16 - coded.tagBits)) ? 2 : 4;
+                }
+                else {
+                    size = tables[column].rowCount < 0x10000 ? 2 : 4;
+                }
+                table.columnOffsets[c] = (BYTE)rowSize;
+                table.columnSizes[c] = size;
+                rowSize += size;
+            }
+            table.rowSize = rowSize;
+            table.rows = p;
+            if ((ULONG64)rowSize * table.rowCount > (ULONG64)(tableEnd - p)) {
+                return false;
+            }
+            p += rowSize * table.rowCount;
+        }
+
+        strings = stringHeap;
+        return true;
+    }
+
+    ULONG MetadataReader::GetRowCount(MetadataTable table) const
+    {
+        return IsOpen() ? tables[table].rowCount : 0;
+    }
+
+    bool MetadataReader::HasRow(int table, ULONG rid) const
+    {
+        return IsOpen() && rid != 0 && rid <= tables[table].rowCount;
+    }
+
+    ULONG MetadataReader::ReadColumn(int table, ULONG rid, int column) const
+    {
+        const auto& t = tables[table];
+        const auto p = t.rows + (rid - 1) * t.rowSize + t.columnOffsets[column];
+        return t.columnSizes[column] == 2 ? VAL16(ReadAt<WORD>(p)) : VAL32(ReadAt<DWORD>(p));
+    }
+
+    // "" unless the string ends inside #Strings
+    LPCSTR MetadataReader::GetString(ULONG offset) const
+    {
+        if (offset >= stringsSize || memchr(strings + offset, 0, stringsSize - offset) == nullptr) {
+            return "";
+        }
+        return (LPCSTR)(strings + offset);
+    }
+
+    bool MetadataReader::GetBlob(ULONG offset, PCCOR_SIGNATURE* pBlob, ULONG* cbBlob) const
+    {
+        if (blobs == nullptr || offset >= blobsSize) {
+            return false;
+        }
+        // II.24.2.4 compressed length, decoded here so it stays inside #Blob
+        const auto p = blobs + offset;
+        const auto available = blobsSize - offset;
+        ULONG length;
+        ULONG cbLength;
+        if ((p[0] & 0x80) == 0) {
+            length = p[0];
+            cbLength = 1;
+        }
+        else if ((p[0] & 0xC0) == 0x80 && available >= 2) {
+            length = ((p[0] & 0x3F) << 8) | p[1];
+            cbLength = 2;
+        }
+        else if ((p[0] & 0xE0) == 0xC0 && available >= 4) {
+            length = ((p[0] & 0x1F) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+            cbLength = 4;
+        }
+        else {
+            return false;
+        }
+        if (length > available - cbLength) {
+            return false;
+        }
+        *pBlob = p + cbLength;
+        *cbBlob = length;
+        return true;
+    }
+
+    bool MetadataReader::GetModuleMvid(GUID* mvid) const
+    {
+        if (!HasRow(TableModule, 1)) {
+            return false;
+        }
+        // #GUID indexes are 1 based
+        const auto index = ReadColumn(TableModule, 1, ModuleMvid);
+        if (guids == nullptr || index == 0 || index * sizeof(GUID) > guidsSize) {
+            return false;
+        }
+        memcpy(mvid, guids + (index - 1) * sizeof(GUID), sizeof(GUID));
+        return true;
+    }
+
+    bool MetadataReader::GetAssemblyName(LPCSTR* name) const
+    {
+        if (!HasRow(TableAssembly, 1)) {
+            return false;
+        }
+        *name = GetString(ReadColumn(TableAssembly, 1, AssemblyName));
+        return true;
+    }
+
+    bool MetadataReader::GetTypeDefProps(mdTypeDef typeDef, LPCSTR* name, LPCSTR* nameSpace, DWORD* flags) const
+    {
+        const auto rid = RidFromToken(typeDef);
+        if (TypeFromToken(typeDef) != mdtTypeDef || !HasRow(TableTypeDef, rid)) {
+            return false;
+        }
+        *name = GetString(ReadColumn(TableTypeDef, rid, TypeDefName));
+        *nameSpace = GetString(ReadColumn(TableTypeDef, rid, TypeDefNamespace));
+        if (flags != nullptr) {
+            *flags = ReadColumn(TableTypeDef, rid, TypeDefFlags);
+        }
+        return true;
+    }
+
+    bool MetadataReader::GetTypeDefMethods(mdTypeDef typeDef, mdMethodDef* first, mdMethodDef* end) const
+    {
+        const auto rid = RidFromToken(typeDef);
+        if (TypeFromToken(typeDef) != mdtTypeDef || !HasRow(TableTypeDef, rid)) {
+            return false;
+        }
+        // a type owns the methods up to the method list of the next type
+        const auto methodCount = tables[TableMethodDef].rowCount;
+        auto firstRid = ReadColumn(TableTypeDef, rid, TypeDefMethodList);
+        auto endRid = rid < tables[TableTypeDef].rowCount
+            ? ReadColumn(TableTypeDef, rid + 1, TypeDefMethodList)
+            : methodCount + 1;
+        if (endRid > methodCount + 1) {
+            endRid = methodCount + 1;
+        }
+        if (firstRid > endRid) {
+            firstRid = endRid;
+        }
+        *first = TokenFromRid(firstRid, mdtMethodDef);
+        *end = TokenFromRid(endRid, mdtMethodDef);
+        return true;
+    }
+
+    bool MetadataReader::GetMethodProps(mdMethodDef methodDef, LPCSTR* name, PCCOR_SIGNATURE* signature, ULONG* cbSignature) const
+    {
+        const auto rid = RidFromToken(methodDef);
+        if (TypeFromToken(methodDef) != mdtMethodDef || !HasRow(TableMethodDef, rid)) {
+            return false;
+        }
+        *name = GetString(ReadColumn(TableMethodDef, rid, MethodDefName));
+        if (signature != nullptr) {
+            return GetBlob(ReadColumn(TableMethodDef, rid, MethodDefSignature), signature, cbSignature);
+        }
+        return true;
+    }
+
+    bool MetadataReader::GetTypeRefProps(mdTypeRef typeRef, mdToken* resolutionScope, LPCSTR* name, LPCSTR* nameSpace) const
+    {
+        const auto rid = RidFromToken(typeRef);
+        if (TypeFromToken(typeRef) != mdtTypeRef || !HasRow(TableTypeRef, rid)) {
+            return false;
+        }
+        if (resolutionScope != nullptr) {
+            static const mdToken scopeTypes[] = { mdtModule, mdtModuleRef, mdtAssemblyRef, mdtTypeRef };
+            const auto scope = ReadColumn(TableTypeRef, rid, TypeRefResolutionScope);
+            *resolutionScope = (scope >> 2) == 0 ? mdTokenNil : TokenFromRid(scope >> 2, scopeTypes[scope & 3]);
+        }
+        *name = GetString(ReadColumn(TableTypeRef, rid, TypeRefName));
+        *nameSpace = GetString(ReadColumn(TableTypeRef, rid, TypeRefNamespace));
+        return true;
+    }
+
+    bool MetadataReader::GetAssemblyRefProps(mdAssemblyRef assemblyRef, LPCSTR* name,
+        const void** publicKeyOrToken, ULONG* cbPublicKeyOrToken) const
+    {
+        const auto rid = RidFromToken(assemblyRef);
+        if (TypeFromToken(assemblyRef) != mdtAssemblyRef || !HasRow(TableAssemblyRef, rid)) {
+            return false;
+        }
+        *name = GetString(ReadColumn(TableAssemblyRef, rid, AssemblyRefName));
+        if (publicKeyOrToken != nullptr) {
+            PCCOR_SIGNATURE blob;
+            if (!GetBlob(ReadColumn(TableAssemblyRef, rid, AssemblyRefPublicKeyOrToken), &blob, cbPublicKeyOrToken)) {
+                return false;
+            }
+            *publicKeyOrToken = blob;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef CLR_PROFILER_METADATA_READER_H_
+#define CLR_PROFILER_METADATA_READER_H_
+
+#include "cor.h"
+
+namespace trace {
+
+    // ECMA-335 II.22 table ids, in the order the tables are stored
+    enum MetadataTable
+    {
+        TableModule = 0x00,
+        TableTypeRef = 0x01,
+        TableTypeDef = 0x02,
+        TableMethodDef = 0x06,
+        TableAssembly = 0x20,
+        TableAssemblyRef = 0x23,
+        TableCount = 0x2D
+    };
+
+    // reads the TypeDef, MethodDef, TypeRef and AssemblyRef tables straight from
+    // the metadata of a loaded image. Names and signatures point into the
+    // #Strings (utf8) and #Blob heaps of the image, nothing is copied.
+    // Only the tokens of the image are known, rows the profiler defines later
+    // through IMetaDataEmit are past GetRowCount and need IMetaDataImport.
+    class MetadataReader
+    {
+    private:
+        static const int MaxColumns = 9;
+
+        struct Table
+        {
+            LPCBYTE rows;
+            ULONG rowCount;
+            ULONG rowSize;
+            BYTE columnOffsets[MaxColumns];
+            BYTE columnSizes[MaxColumns];
+        };
+
+        LPCBYTE strings = nullptr;
+        ULONG stringsSize = 0;
+        LPCBYTE blobs = nullptr;
+        ULONG blobsSize = 0;
+        LPCBYTE guids = nullptr;
+        ULONG guidsSize = 0;
+        Table tables[TableCount]{};
+
+        ULONG ReadColumn(int table, ULONG rid, int column) const;
+        LPCSTR GetString(ULONG offset) const;
+        bool GetBlob(ULONG offset, PCCOR_SIGNATURE* pBlob, ULONG* cbBlob) const;
+        bool HasRow(int table, ULONG rid) const;
+    public:
+        // pMetadata is the metadata root (BSJB), false when it can't be read,
+        // e.g. the uncompressed #- tables of edit and continue
+        bool Open(LPCBYTE pMetadata, ULONG cbMetadata);
+        bool IsOpen() const { return strings != nullptr; }
+
+        ULONG GetRowCount(MetadataTable table) const;
+
+        // the module version id, identifies one build of the module
+        bool GetModuleMvid(GUID* mvid) const;
+        // false for a module that is not the manifest module of an assembly
+        bool GetAssemblyName(LPCSTR* name) const;
+
+        bool GetTypeDefProps(mdTypeDef typeDef, LPCSTR* name, LPCSTR* nameSpace, DWORD* flags) const;
+        // the methods of the type are [*first, *end)
+        bool GetTypeDefMethods(mdTypeDef typeDef, mdMethodDef* first, mdMethodDef* end) const;
+        bool GetMethodProps(mdMethodDef methodDef, LPCSTR* name, PCCOR_SIGNATURE* signature, ULONG* cbSignature) const;
+        bool GetTypeRefProps(mdTypeRef typeRef, mdToken* resolutionScope, LPCSTR* name, LPCSTR* nameSpace) const;
+        bool GetAssemblyRefProps(mdAssemblyRef assemblyRef, LPCSTR* name,
+            const void** publicKeyOrToken, ULONG* cbPublicKeyOrToken) const;
+    };
+}
+
+#endif  // CLR_PROFILER_METADATA_READER_H_
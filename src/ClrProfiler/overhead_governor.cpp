@@ -0,0 +1,148 @@
+#include "overhead_governor.h"
+#include "logging.h"
+#include <algorithm>
+#include <chrono>
+
+namespace trace
+{
+    void OverheadGovernor::Start(ICorProfilerInfo8* pCorProfilerInfo, const GovernorConfig& governorConfig)
+    {
+        corProfilerInfo = pCorProfilerInfo;
+        config = governorConfig;
+        worker = std::thread(&OverheadGovernor::Run, this);
+    }
+
+    void OverheadGovernor::Stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(governorLock);
+            stopping = true;
+        }
+        stopSignal.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    void OverheadGovernor::Track(UINT32 probeId, ModuleID moduleId, mdMethodDef methodDef,
+        UINT64* pHitCounter, LPCBYTE pIL, ULONG ilSize)
+    {
+        std::lock_guard<std::mutex> guard(governorLock);
+        if (probes.count(probeId) > 0) {
+            return;
+        }
+        TrackedProbe probe{ moduleId, methodDef, pHitCounter, *pHitCounter,
+            std::vector<BYTE>(pIL, pIL + ilSize), false };
+        probes.emplace(probeId, std::move(probe));
+    }
+
+    void OverheadGovernor::ModuleUnloaded(ModuleID moduleId)
+    {
+        std::lock_guard<std::mutex> guard(governorLock);
+        for (auto it = probes.begin(); it != probes.end();) {
+            if (it->second.moduleId == moduleId) {
+                reverted.erase(std::make_pair(moduleId, it->second.methodDef));
+                it = probes.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+
+    bool OverheadGovernor::TryGetRevertedIL(ModuleID moduleId, mdMethodDef methodDef, std::vector<BYTE>* il)
+    {
+        std::lock_guard<std::mutex> guard(governorLock);
+        const auto it = reverted.find(std::make_pair(moduleId, methodDef));
+        if (it == reverted.end()) {
+            return false;
+        }
+        *il = probes[it->second].originalIL;
+        return true;
+    }
+
+    void OverheadGovernor::Run()
+    {
+        auto last = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(governorLock);
+        while (!stopping) {
+            stopSignal.wait_for(lock, std::chrono::milliseconds(config.intervalMs));
+            if (stopping) {
+                break;
+            }
+            const auto now = std::chrono::steady_clock::now();
+            const auto seconds = std::chrono::duration<double>(now - last).count();
+            last = now;
+            lock.unlock();
+            Evaluate(seconds);
+            lock.lock();
+        }
+    }
+
+    void OverheadGovernor::Evaluate(double seconds)
+    {
+        if (seconds <= 0) {
+            return;
+        }
+
+        struct ProbeRate
+        {
+            UINT32 probeId;
+            UINT64 calls;
+        };
+        std::vector<ProbeRate> rates;
+        std::vector<ModuleID> moduleIds;
+        std::vector<mdMethodDef> methodDefs;
+        {
+            std::lock_guard<std::mutex> guard(governorLock);
+            double overheadNs = 0;
+            for (auto& item : probes) {
+                auto& probe = item.second;
+                if (probe.reverted) {
+                    continue;
+                }
+                const UINT64 hits = *probe.hits;
+                const auto calls = hits - probe.lastHits;
+                probe.lastHits = hits;
+                overheadNs += (double)calls * config.probeCostNs;
+                rates.push_back(ProbeRate{ item.first, calls });
+            }
+
+            // hottest first, they are given up first when over budget
+            std::sort(rates.begin(), rates.end(),
+                [](const ProbeRate& a, const ProbeRate& b) { return a.calls > b.calls; });
+
+            const auto cpuCount = std::max(1u, std::thread::hardware_concurrency());
+            const auto budgetNs = seconds * 1e9 * cpuCount * config.cpuBudgetPercent / 100;
+            for (const auto& rate : rates) {
+                const auto callsPerSecond = rate.calls / seconds;
+                const bool overRate = config.maxCallsPerSecond > 0 && callsPerSecond > config.maxCallsPerSecond;
+                const bool overBudget = overheadNs > budgetNs;
+                if (!overRate && !overBudget) {
+                    continue;
+                }
+
+                auto& probe = probes[rate.probeId];
+                probe.reverted = true;
+                reverted.emplace(std::make_pair(probe.moduleId, probe.methodDef), rate.probeId);
+                moduleIds.push_back(probe.moduleId);
+                methodDefs.push_back(probe.methodDef);
+                overheadNs -= (double)rate.calls * config.probeCostNs;
+
+                Warn("Governor Revert ProbeId:{} CallsPerSecond:{} EstimatedOverhead:{}% Reason:{}",
+                    rate.probeId, (UINT64)callsPerSecond,
+                    rate.calls * config.probeCostNs * 100 / (seconds * 1e9 * cpuCount),
+                    overRate ? "maxCallsPerSecond" : "cpuBudgetPercent");
+            }
+        }
+
+        if (moduleIds.empty()) {
+            return;
+        }
+
+        const auto hr = corProfilerInfo->RequestReJIT((ULONG)moduleIds.size(), moduleIds.data(), methodDefs.data());
+        if (FAILED(hr)) {
+            Warn("Governor RequestReJIT Failed HRESULT:{}", hr);
+        }
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef CLR_PROFILER_OVERHEAD_GOVERNOR_H_
+#define CLR_PROFILER_OVERHEAD_GOVERNOR_H_
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "cor.h"
+#include "corprof.h"
+#include "config_loader.h"
+
+namespace trace {
+
+    // samples the probe hit counters on a background thread and reverts
+    // methods whose probes are too hot back to their original IL via ReJIT
+    class OverheadGovernor
+    {
+    private:
+        struct TrackedProbe
+        {
+            ModuleID moduleId;
+            mdMethodDef methodDef;
+            const volatile UINT64* hits;
+            UINT64 lastHits;
+            std::vector<BYTE> originalIL;
+            bool reverted;
+        };
+
+        ICorProfilerInfo8* corProfilerInfo = nullptr;
+        GovernorConfig config{};
+
+        std::mutex governorLock;
+        std::condition_variable stopSignal;
+        bool stopping = false;
+        std::thread worker;
+
+        std::unordered_map<UINT32, TrackedProbe> probes{};
+        // reverted methods, looked up by GetReJITParameters
+        std::map<std::pair<ModuleID, mdMethodDef>, UINT32> reverted{};
+
+        void Run();
+        void Evaluate(double seconds);
+    public:
+        void Start(ICorProfilerInfo8* pCorProfilerInfo, const GovernorConfig& governorConfig);
+        void Stop();
+
+        // pIL is the method body before the rewrite, header included
+        void Track(UINT32 probeId, ModuleID moduleId, mdMethodDef methodDef,
+            UINT64* pHitCounter, LPCBYTE pIL, ULONG ilSize);
+        void ModuleUnloaded(ModuleID moduleId);
+
+        // the original body of a method the governor reverted
+        bool TryGetRevertedIL(ModuleID moduleId, mdMethodDef methodDef, std::vector<BYTE>* il);
+    };
+}
+
+#endif  // CLR_PROFILER_OVERHEAD_GOVERNOR_H_
@@ -0,0 +1,142 @@
+// ClrProfilerPlan, resolves the trace.json rules against assemblies on disk
+// and writes the candidate methods of every matching module build to
+// trace.plan, which the profiler maps at startup instead of scanning.
+//
+// usage: ClrProfilerPlan <profiler home> <assembly dir> [plan file]
+//
+// Exits with 1 when a rule matches no method in any of the assemblies.
+
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <iterator>
+#include <set>
+#include "clr_helpers.h"
+#include "config_loader.h"
+#include "instrumentation_plan.h"
+#include "metadata_reader.h"
+#include "trace_matcher.h"
+
+using namespace trace;
+
+static std::string FormatMvid(const GUID& mvid)
+{
+    char buf[40];
+    snprintf(buf, sizeof(buf), "%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+        mvid.Data1, mvid.Data2, mvid.Data3, mvid.Data4[0], mvid.Data4[1], mvid.Data4[2],
+        mvid.Data4[3], mvid.Data4[4], mvid.Data4[5], mvid.Data4[6], mvid.Data4[7]);
+    return buf;
+}
+
+static bool IsAssemblyFile(const std::string& name)
+{
+    const auto pos = name.find_last_of('.');
+    if (pos == std::string::npos) {
+        return false;
+    }
+    const auto ext = name.substr(pos);
+    return ext == ".dll" || ext == ".exe";
+}
+
+// enough of a PE image to look for its CLI header
+static bool IsPeImage(const std::vector<BYTE>& image)
+{
+    if (image.size() < sizeof(IMAGE_DOS_HEADER) || image[0] != 'M' || image[1] != 'Z') {
+        return false;
+    }
+    const auto lfanew = (size_t)VAL32(((const IMAGE_DOS_HEADER*)image.data())->e_lfanew);
+    return lfanew + sizeof(IMAGE_NT_HEADERS64) <= image.size() &&
+        memcmp(image.data() + lfanew, "PE\0\0", 4) == 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <profiler home> <assembly dir> [plan file]\n", argv[0]);
+        return 2;
+    }
+    const auto home = ToWSTRING(argv[1]);
+    const std::string assemblyDir = argv[2];
+    const auto planPath = argc > 3 ? ToWSTRING(argv[3]) : home + PathSeparator + InstrumentationPlanFileName;
+
+    const auto traceConfig = LoadTraceConfig(home);
+    if (traceConfig.traceAssemblies.empty()) {
+        fprintf(stderr, "no instrumentation rules in %s\n", argv[1]);
+        return 2;
+    }
+    TraceMatcher traceMatcher;
+    traceMatcher.Compile(traceConfig.traceAssemblies);
+
+    const auto dir = opendir(assemblyDir.c_str());
+    if (dir == nullptr) {
+        fprintf(stderr, "can't open %s\n", argv[2]);
+        return 2;
+    }
+    std::vector<std::string> files;
+    while (const auto entry = readdir(dir)) {
+        if (IsAssemblyFile(entry->d_name)) {
+            files.push_back(assemblyDir + "/" + entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    std::set<std::pair<size_t, size_t>> usedRules;
+    std::vector<PlanModule> modules;
+    for (const auto& file : files) {
+        std::ifstream stream(file, std::ios::binary);
+        const std::vector<BYTE> image((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+        if (!IsPeImage(image)) {
+            continue;
+        }
+
+        // the file is not mapped, RVAs are translated through the section table
+        const ModuleInfo moduleInfo(1, ToWSTRING(file), AssemblyInfo{}, COR_PRF_MODULE_FLAT_LAYOUT, image.data());
+        ULONG metadataSize = 0;
+        const auto pMetadata = moduleInfo.GetMetadata(&metadataSize);
+        MetadataReader reader;
+        LPCSTR name;
+        GUID mvid;
+        if (pMetadata == nullptr || pMetadata + metadataSize > image.data() + image.size() ||
+            !reader.Open(pMetadata, metadataSize) || !reader.GetAssemblyName(&name) || !reader.GetModuleMvid(&mvid)) {
+            continue;
+        }
+
+        const auto assemblyName = ToWSTRING(name);
+        if (!traceMatcher.MatchAssembly(assemblyName)) {
+            continue;
+        }
+
+        printf("Assembly:%s Mvid:%s File:%s\n", name, FormatMvid(mvid).c_str(), file.c_str());
+        PlanModule module{ mvid, {} };
+        ResolveCandidateMethods(reader, traceMatcher, assemblyName,
+            [&](mdMethodDef methodDef, const WSTRING& typeName, LPCSTR methodName, const std::vector<TraceRule>& rules) {
+                module.methods.push_back(methodDef);
+                for (const auto& rule : rules) {
+                    usedRules.insert(std::make_pair(rule.assemblyIndex, rule.methodIndex));
+                    printf("  0x%08x %s::%s rule %zu.%zu\n", methodDef, ToString(typeName).c_str(), methodName,
+                        rule.assemblyIndex, rule.methodIndex);
+                }
+            });
+        modules.push_back(std::move(module));
+    }
+
+    auto deadRules = 0;
+    for (size_t i = 0; i < traceConfig.traceAssemblies.size(); i++) {
+        const auto& assembly = traceConfig.traceAssemblies[i];
+        for (size_t j = 0; j < assembly.methods.size(); j++) {
+            if (usedRules.count(std::make_pair(i, j)) == 0) {
+                printf("Dead rule %zu.%zu: %s %s %s\n", i, j, ToString(assembly.assemblyName).c_str(),
+                    ToString(assembly.className).c_str(), ToString(assembly.methods[j].methodName).c_str());
+                deadRules++;
+            }
+        }
+    }
+
+    if (!WriteInstrumentationPlan(planPath, HashTraceRules(traceConfig.traceAssemblies), modules)) {
+        fprintf(stderr, "can't write %s\n", ToString(planPath).c_str());
+        return 2;
+    }
+    printf("Plan:%s Modules:%zu DeadRules:%d\n", ToString(planPath).c_str(), modules.size(), deadRules);
+    return deadRules > 0 ? 1 : 0;
+}
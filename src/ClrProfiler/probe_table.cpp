@@ -0,0 +1,90 @@
+#include "probe_table.h"
+#include <chrono>
+#include "logging.h"
+#include "thread_latency.h"
+
+namespace trace
+{
+    INT64 TimingProbeEnter()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    int TimingProbeBucket(INT64 start)
+    {
+        auto elapsed = (UINT64)(TimingProbeEnter() - start);
+        auto bucket = 0;
+        while (elapsed >>= 1) {
+            bucket++;
+        }
+        return bucket;
+    }
+
+    void TimingProbeExit(UINT32 probeId, INT64 start)
+    {
+        RecordThreadLatency(probeId, start);
+    }
+
+    UINT32 ProbeTable::GetOrAdd(ModuleID moduleId, mdMethodDef methodDef, const GUID& moduleVersionId,
+        const WSTRING& assemblyName, const WSTRING& methodName)
+    {
+        std::lock_guard<std::mutex> guard(probeLock);
+        const auto key = std::make_pair(moduleId, methodDef);
+        const auto it = probeIds.find(key);
+        if (it != probeIds.end()) {
+            return it->second;
+        }
+
+        const auto probeId = (UINT32)probes.size();
+        probes.push_back(ProbeRecord{ methodDef, moduleVersionId, assemblyName, methodName, {} });
+        probeIds.emplace(key, probeId);
+        return probeId;
+    }
+
+    bool ProbeTable::TryGet(UINT32 probeId, ProbeInfo* info)
+    {
+        std::lock_guard<std::mutex> guard(probeLock);
+        if (info == nullptr || probeId >= probes.size()) {
+            return false;
+        }
+
+        const auto& probe = probes[probeId];
+        info->methodDef = probe.methodDef;
+        info->moduleVersionId = probe.moduleVersionId;
+        info->assemblyName = probe.assemblyName.c_str();
+        return true;
+    }
+
+    ProbeCounters* ProbeTable::GetCounters(UINT32 probeId)
+    {
+        std::lock_guard<std::mutex> guard(probeLock);
+        if (probeId >= probes.size()) {
+            return nullptr;
+        }
+        return &probes[probeId].counters;
+    }
+
+    void ProbeTable::LogCounters()
+    {
+        std::lock_guard<std::mutex> guard(probeLock);
+        for (size_t i = 0; i < probes.size(); i++) {
+            const auto& probe = probes[i];
+            const auto& counters = probe.counters;
+            UINT64 calls = 0;
+            std::string latency;
+            for (int bucket = 0; bucket < LatencyBucketCount; bucket++) {
+                if (counters.latency[bucket] > 0) {
+                    calls += counters.latency[bucket];
+                    latency += " 2^" + std::to_string(bucket) + ":" + std::to_string(counters.latency[bucket]);
+                }
+            }
+            if (counters.hits == 0 && counters.exceptions == 0 && calls == 0) {
+                continue;
+            }
+            Info("Probe:{} Assembly:{} Method:{} Hits:{} Exceptions:{} TimedCalls:{} LatencyNs:{}",
+                i, ToString(probe.assemblyName), ToString(probe.methodName),
+                counters.hits, counters.exceptions, calls, latency);
+        }
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef CLR_PROFILER_PROBE_TABLE_H_
+#define CLR_PROFILER_PROBE_TABLE_H_
+
+#include <deque>
+#include <map>
+#include <mutex>
+#include "cor.h"
+#include "corprof.h"
+#include "string.h"  // NOLINT
+#include "util.h"
+
+namespace trace {
+
+    const int LatencyBucketCount = 64;
+
+    // written by the injected code without interlocks, a lost update only
+    // skews a count a little. Stays valid for the process lifetime
+    struct ProbeCounters
+    {
+        // every call when the governor is on, and for counter and sampled probes
+        UINT64 hits;
+        // exceptions leaving the method, exception probes
+        UINT64 exceptions;
+        // rate limited sampled probes, the Environment.TickCount the current
+        // one second window started at and the spans started in it
+        INT32 windowStart;
+        UINT32 windowSpans;
+        // calls of timing probes by elapsed nanoseconds, bucket i counts
+        // [2^i, 2^(i+1)), bucket 0 also counts 0. Threads time into their
+        // own histograms, MergeThreadLatency adds them here
+        UINT64 latency[LatencyBucketCount];
+    };
+
+    // called by timing probes through an unmanaged calli, the call never
+    // enters the managed agent and allocates nothing
+    extern "C" INT64 TimingProbeEnter();
+    // adds the nanoseconds since start to the thread's latency of the probe
+    extern "C" void TimingProbeExit(UINT32 probeId, INT64 start);
+    // latency bucket of the nanoseconds since start
+    int TimingProbeBucket(INT64 start);
+
+    // what the managed agent needs to resolve a probe id back to its method,
+    // layout is shared with ClrProfiler.Trace ProbeTable
+    struct ProbeInfo
+    {
+        mdMethodDef methodDef;
+        GUID moduleVersionId;
+        const WCHAR* assemblyName;
+    };
+
+    // dense ids for every instrumented (module, method) pair, the injected code
+    // passes the id and the agent indexes its probe array with it
+    class ProbeTable : public Singleton<ProbeTable>
+    {
+        friend class Singleton<ProbeTable>;
+    private:
+        struct ProbeRecord
+        {
+            mdMethodDef methodDef;
+            GUID moduleVersionId;
+            WSTRING assemblyName;
+            WSTRING methodName;
+            ProbeCounters counters;
+        };
+
+        std::mutex probeLock;
+        // deque keeps records in place as it grows, assemblyName is handed out
+        std::deque<ProbeRecord> probes{};
+        std::map<std::pair<ModuleID, mdMethodDef>, UINT32> probeIds{};
+
+        ProbeTable() = default;
+    public:
+        UINT32 GetOrAdd(ModuleID moduleId, mdMethodDef methodDef, const GUID& moduleVersionId,
+            const WSTRING& assemblyName, const WSTRING& methodName);
+        bool TryGet(UINT32 probeId, ProbeInfo* info);
+        ProbeCounters* GetCounters(UINT32 probeId);
+        // logs the native counters of every probe that has any
+        void LogCounters();
+    };
+}
+
+#endif  // CLR_PROFILER_PROBE_TABLE_H_
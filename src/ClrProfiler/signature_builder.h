@@ -0,0 +1,79 @@
+#ifndef CLR_PROFILER_SIGNATURE_BUILDER_H_
+#define CLR_PROFILER_SIGNATURE_BUILDER_H_
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "cor.h"
+#include "corhlpr.h"
+
+namespace trace {
+
+    // builds a metadata signature blob, blobs up to InlineSize bytes stay in
+    // the builder itself and larger ones spill to the heap, both are freed
+    // with the builder
+    class SignatureBuilder
+    {
+    public:
+        static const ULONG InlineSize = 64;
+
+        SignatureBuilder() = default;
+        SignatureBuilder(const SignatureBuilder&) = delete;
+        SignatureBuilder& operator=(const SignatureBuilder&) = delete;
+
+        void Append(COR_SIGNATURE value)
+        {
+            Reserve(size + 1)[size++] = value;
+        }
+
+        void Append(PCCOR_SIGNATURE pData, ULONG cbData)
+        {
+            if (cbData == 0) {
+                return;
+            }
+            memcpy(Reserve(size + cbData) + size, pData, cbData);
+            size += cbData;
+        }
+
+        void AppendData(ULONG data)
+        {
+            size += CorSigCompressData(data, Reserve(size + MaxCompressedSize) + size);
+        }
+
+        void AppendToken(mdToken token)
+        {
+            size += CorSigCompressToken(token, Reserve(size + MaxCompressedSize) + size);
+        }
+
+        PCCOR_SIGNATURE Head() const
+        {
+            return spill.empty() ? inlineBuffer : spill.data();
+        }
+
+        ULONG Size() const { return size; }
+
+    private:
+        // compressed data and tokens take at most 4 bytes
+        static const ULONG MaxCompressedSize = 4;
+
+        COR_SIGNATURE inlineBuffer[InlineSize];
+        std::vector<COR_SIGNATURE> spill{};
+        ULONG size = 0;
+
+        COR_SIGNATURE* Reserve(ULONG capacity)
+        {
+            if (spill.empty()) {
+                if (capacity <= InlineSize) {
+                    return inlineBuffer;
+                }
+                spill.assign(inlineBuffer, inlineBuffer + size);
+            }
+            if (spill.size() < capacity) {
+                spill.resize(std::max<size_t>(capacity, spill.size() * 2));
+            }
+            return spill.data();
+        }
+    };
+}
+
+#endif  // CLR_PROFILER_SIGNATURE_BUILDER_H_
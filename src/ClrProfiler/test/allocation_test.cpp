@@ -0,0 +1,131 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "../il_template.h"
+#include "../signature_builder.h"
+#include "body_capture.h"
+#include "test.h"
+
+using namespace trace;
+
+namespace
+{
+    std::atomic<long> liveAllocations{ 0 };
+    std::atomic<long> totalAllocations{ 0 };
+
+    void* Allocate(size_t size)
+    {
+        const auto p = malloc(size == 0 ? 1 : size);
+        if (p == nullptr) {
+            throw std::bad_alloc();
+        }
+        liveAllocations++;
+        totalAllocations++;
+        return p;
+    }
+
+    void Free(void* p)
+    {
+        if (p != nullptr) {
+            liveAllocations--;
+            free(p);
+        }
+    }
+}
+
+void* operator new(size_t size) { return Allocate(size); }
+void* operator new[](size_t size) { return Allocate(size); }
+void operator delete(void* p) noexcept { Free(p); }
+void operator delete[](void* p) noexcept { Free(p); }
+
+namespace
+{
+    // the local var sig ModifyLocalSig builds for a method with many locals of
+    // its own, well past the inline capacity of the builder
+    void BuildLocalSig()
+    {
+        SignatureBuilder originalLocals;
+        for (ULONG i = 0; i < SignatureBuilder::InlineSize; i++) {
+            originalLocals.Append(ELEMENT_TYPE_CLASS);
+            originalLocals.AppendToken(TokenFromRid(i + 1, mdtTypeRef));
+        }
+
+        SignatureBuilder newLocals;
+        newLocals.Append(ELEMENT_TYPE_OBJECT);
+        newLocals.Append(ELEMENT_TYPE_CLASS);
+        newLocals.AppendToken(TokenFromRid(1, mdtTypeRef));
+        newLocals.Append(ELEMENT_TYPE_I8);
+
+        SignatureBuilder newSig;
+        newSig.Append(IMAGE_CEE_CS_CALLCONV_LOCAL_SIG);
+        newSig.AppendData(SignatureBuilder::InlineSize + 3);
+        newSig.Append(originalLocals.Head(), originalLocals.Size());
+        newSig.Append(newLocals.Head(), newLocals.Size());
+        EXPECT(newSig.Size() > SignatureBuilder::InlineSize);
+        EXPECT(newSig.Head()[0] == IMAGE_CEE_CS_CALLCONV_LOCAL_SIG);
+    }
+
+    MethodShape Shape(ProbeKind probeKind, ExceptionCapture exceptionCapture)
+    {
+        MethodShape shape;
+        shape.retTypeFlags = TypeFlagBoxedType;
+        shape.probeKind = probeKind;
+        shape.exceptionCapture = exceptionCapture;
+        shape.sampleEvery = probeKind == ProbeKind::SampledSpan ? 8 : 1;
+        shape.maxPerSecond = probeKind == ProbeKind::SampledSpan ? 100 : 0;
+        shape.controlled = probeKind >= ProbeKind::SampledSpan;
+        shape.arguments.push_back(ArgumentShape{ TypeFlagBoxedType, ELEMENT_TYPE_I4, true });
+        shape.arguments.push_back(ArgumentShape{ 0, ELEMENT_TYPE_OBJECT, true });
+        return shape;
+    }
+
+    // what RewriteMethod does to a body, minus the metadata
+    void StampAndExport(const ILTemplate& ilTemplate, size_t argumentCount, ProbeCounters* pCounters)
+    {
+        trace_test::BodyCapture capture;
+        ILRewriter rewriter(nullptr, &capture, 0, 0x06000001);
+        rewriter.InitializeTiny();
+
+        std::vector<mdToken> tokens(SlotArgumentTypeBase + argumentCount, TokenFromRid(1, mdtTypeRef));
+        BYTE control[2] = { 0, 0 };
+        const ProbeAddresses addresses{ pCounters, control, control + 1, 1 };
+        EXPECT(SUCCEEDED(StampILTemplate(rewriter, ilTemplate, tokens, 0, addresses)));
+        rewriter.Peephole();
+        EXPECT(SUCCEEDED(rewriter.Export()));
+        EXPECT(!capture.body.empty());
+    }
+
+    // the allocations of one run have all been freed once it returns
+    template <typename Run>
+    void ExpectNoLeak(Run run)
+    {
+        // the first run may fill caches
+        run();
+        const auto live = liveAllocations.load();
+        const auto total = totalAllocations.load();
+        for (auto i = 0; i < 100; i++) {
+            run();
+        }
+        EXPECT(totalAllocations.load() > total);
+        EXPECT(liveAllocations.load() == live);
+    }
+}
+
+int main()
+{
+    ExpectNoLeak(BuildLocalSig);
+
+    ProbeCounters counters{};
+    const ProbeKind kinds[] = { ProbeKind::Counter, ProbeKind::Exception, ProbeKind::Timing,
+        ProbeKind::SampledSpan, ProbeKind::Span };
+    for (const auto kind : kinds) {
+        for (const auto capture : { ExceptionCapture::Filter, ExceptionCapture::Rethrow }) {
+            const auto shape = Shape(kind, capture);
+            ExpectNoLeak([&]() {
+                const auto ilTemplate = BuildILTemplate(shape);
+                StampAndExport(*ilTemplate, shape.arguments.size(), &counters);
+            });
+        }
+    }
+    return TEST_RESULT();
+}
@@ -0,0 +1,35 @@
+#ifndef CLR_PROFILER_TEST_BODY_CAPTURE_H_
+#define CLR_PROFILER_TEST_BODY_CAPTURE_H_
+
+#include <vector>
+#include "corprof.h"
+
+namespace trace_test {
+
+    // receives the body ILRewriter::Export produces, Export takes the rejit
+    // path so the rewriter runs without a profiler info
+    class BodyCapture : public ICorProfilerFunctionControl
+    {
+    public:
+        std::vector<BYTE> body;
+
+        HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObject) override
+        {
+            return E_NOINTERFACE;
+        }
+        ULONG STDMETHODCALLTYPE AddRef() override { return 1; }
+        ULONG STDMETHODCALLTYPE Release() override { return 1; }
+        HRESULT STDMETHODCALLTYPE SetCodegenFlags(DWORD flags) override { return S_OK; }
+        HRESULT STDMETHODCALLTYPE SetILFunctionBody(ULONG cbNewILMethodHeader, LPCBYTE pbNewILMethodHeader) override
+        {
+            body.assign(pbNewILMethodHeader, pbNewILMethodHeader + cbNewILMethodHeader);
+            return S_OK;
+        }
+        HRESULT STDMETHODCALLTYPE SetILInstrumentedCodeMap(ULONG cILMapEntries, COR_IL_MAP rgILMapEntries[]) override
+        {
+            return S_OK;
+        }
+    };
+}
+
+#endif  // CLR_PROFILER_TEST_BODY_CAPTURE_H_
@@ -0,0 +1,81 @@
+#include "../control_segment.h"
+#include "../util.h"
+#include "test.h"
+
+using namespace trace;
+
+namespace
+{
+    // what ClrProfilerCtl does to the segment the profiler created
+    void TestRoundTrip()
+    {
+        ControlSegment created;
+        EXPECT(created.Create(20));
+        EXPECT(created.GetProbeCapacity() == 20);
+        EXPECT(*created.GetKillSwitch() == 0);
+        EXPECT(created.GetProbeByte(19) != nullptr);
+        EXPECT(created.GetProbeByte(20) == nullptr);
+
+        ControlSegment opened;
+        EXPECT(opened.Open(GetPID()));
+        EXPECT(opened.GetProbeCapacity() == 20);
+
+        // a bit set by the controller mutes the probe for the injected code
+        *opened.GetProbeByte(13) |= ControlSegment::GetProbeMask(13);
+        EXPECT((*created.GetProbeByte(13) & ControlSegment::GetProbeMask(13)) != 0);
+        EXPECT((*created.GetProbeByte(12) & ControlSegment::GetProbeMask(12)) == 0);
+        EXPECT(created.GetProbeByte(13) == created.GetProbeByte(8));
+
+        *opened.GetProbeByte(13) &= (BYTE)~ControlSegment::GetProbeMask(13);
+        EXPECT(*created.GetProbeByte(13) == 0);
+
+        *opened.GetKillSwitch() = 1;
+        EXPECT(*created.GetKillSwitch() == 1);
+
+        opened.Close();
+        EXPECT(!opened.IsOpen());
+        EXPECT(created.IsOpen());
+    }
+
+    void TestOpenWithoutSegment()
+    {
+        ControlSegment opened;
+        EXPECT(!opened.Open(GetPID()));
+        EXPECT(!opened.IsOpen());
+    }
+
+    // unlinked on shutdown, the addresses stay valid for the code that embeds them
+    void TestCreatedStaysMapped()
+    {
+        volatile BYTE* pKillSwitch = nullptr;
+        volatile BYTE* pProbeByte = nullptr;
+        {
+            ControlSegment created;
+            EXPECT(created.Create(8));
+            pKillSwitch = created.GetKillSwitch();
+            pProbeByte = created.GetProbeByte(3);
+            created.Unlink();
+
+            ControlSegment opened;
+            EXPECT(!opened.Open(GetPID()));
+        }
+        *pKillSwitch = 1;
+        *pProbeByte |= ControlSegment::GetProbeMask(3);
+        EXPECT(*pKillSwitch == 1);
+        EXPECT(*pProbeByte == ControlSegment::GetProbeMask(3));
+
+        // the name is free for a new segment
+        ControlSegment created;
+        EXPECT(created.Create(8));
+        EXPECT(*created.GetKillSwitch() == 0);
+        EXPECT(*pKillSwitch == 1);
+    }
+}
+
+int main()
+{
+    TestRoundTrip();
+    TestOpenWithoutSegment();
+    TestCreatedStaysMapped();
+    return TEST_RESULT();
+}
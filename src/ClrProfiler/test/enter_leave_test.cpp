@@ -0,0 +1,131 @@
+#include <thread>
+#include <vector>
+#include "../enter_leave.h"
+#include "../thread_latency.h"
+#include "test.h"
+
+using namespace trace;
+
+namespace
+{
+    UINT64 TimedCalls(UINT32 probeId)
+    {
+        UINT64 calls = 0;
+        for (const auto count : ProbeTable::Instance()->GetCounters(probeId)->latency) {
+            calls += count;
+        }
+        return calls;
+    }
+
+    FunctionIDOrClientID ClientId(UINT32 probeId)
+    {
+        FunctionIDOrClientID id;
+        id.clientID = probeId;
+        return id;
+    }
+
+    void TestThreadsMergeOnExit()
+    {
+        const auto probeId = ProbeTable::Instance()->GetOrAdd(1, 0x06000001, GUID{}, "App"_W, "A.Exit"_W);
+        const auto id = ClientId(probeId);
+        std::vector<std::thread> threads;
+        for (auto t = 0; t < 4; t++) {
+            threads.emplace_back([id]() {
+                for (auto i = 0; i < 1000; i++) {
+                    EnterLeaveEnterHook(id, 0);
+                    EnterLeaveLeaveHook(id, 0);
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        EXPECT(TimedCalls(probeId) == 4000);
+    }
+
+    void TestMergeOfLiveThread()
+    {
+        const auto probeId = ProbeTable::Instance()->GetOrAdd(1, 0x06000002, GUID{}, "App"_W, "A.Live"_W);
+        const auto id = ClientId(probeId);
+        for (auto i = 0; i < 10; i++) {
+            EnterLeaveEnterHook(id, 0);
+            EnterLeaveLeaveHook(id, 0);
+        }
+        EXPECT(TimedCalls(probeId) == 0);
+        MergeThreadLatency();
+        EXPECT(TimedCalls(probeId) == 10);
+        // only what was timed since the last merge is added
+        EnterLeaveEnterHook(id, 0);
+        EnterLeaveTailcallHook(id, 0);
+        MergeThreadLatency();
+        MergeThreadLatency();
+        EXPECT(TimedCalls(probeId) == 11);
+    }
+
+    // timing probes and hooks fill the same per thread histograms
+    void TestTimingProbes()
+    {
+        const auto probeId = ProbeTable::Instance()->GetOrAdd(1, 0x06000006, GUID{}, "App"_W, "A.Timed"_W);
+        std::vector<std::thread> threads;
+        for (auto t = 0; t < 4; t++) {
+            threads.emplace_back([probeId]() {
+                for (auto i = 0; i < 1000; i++) {
+                    TimingProbeExit(probeId, TimingProbeEnter());
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        EXPECT(TimedCalls(probeId) == 4000);
+
+        TimingProbeExit(probeId, TimingProbeEnter());
+        EnterLeaveEnterHook(ClientId(probeId), 0);
+        EnterLeaveLeaveHook(ClientId(probeId), 0);
+        EXPECT(TimedCalls(probeId) == 4000);
+        MergeThreadLatency();
+        EXPECT(TimedCalls(probeId) == 4002);
+    }
+
+    void TestUnwindKeepsFramesPaired()
+    {
+        const auto outerId = ProbeTable::Instance()->GetOrAdd(1, 0x06000003, GUID{}, "App"_W, "A.Outer"_W);
+        const auto innerId = ProbeTable::Instance()->GetOrAdd(1, 0x06000004, GUID{}, "App"_W, "A.Inner"_W);
+        // inner throws, outer catches and returns
+        EnterLeaveEnterHook(ClientId(outerId), 0);
+        EnterLeaveEnterHook(ClientId(innerId), 0);
+        EnterLeaveUnwind();
+        EnterLeaveLeaveHook(ClientId(outerId), 0);
+        // a leave without its enter is ignored
+        EnterLeaveLeaveHook(ClientId(outerId), 0);
+        MergeThreadLatency();
+        EXPECT(TimedCalls(outerId) == 1);
+        EXPECT(TimedCalls(innerId) == 0);
+    }
+
+    void TestDeepStack()
+    {
+        const auto probeId = ProbeTable::Instance()->GetOrAdd(1, 0x06000005, GUID{}, "App"_W, "A.Deep"_W);
+        const auto id = ClientId(probeId);
+        const auto depth = EnterLeaveStackDepth + 10;
+        for (unsigned i = 0; i < depth; i++) {
+            EnterLeaveEnterHook(id, 0);
+        }
+        for (unsigned i = 0; i < depth; i++) {
+            EnterLeaveLeaveHook(id, 0);
+        }
+        MergeThreadLatency();
+        // frames past the stack depth are not timed
+        EXPECT(TimedCalls(probeId) == EnterLeaveStackDepth);
+    }
+}
+
+int main()
+{
+    TestThreadsMergeOnExit();
+    TestMergeOfLiveThread();
+    TestTimingProbes();
+    TestUnwindKeepsFramesPaired();
+    TestDeepStack();
+    return TEST_RESULT();
+}
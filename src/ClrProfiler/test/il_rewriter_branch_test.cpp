@@ -0,0 +1,290 @@
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "../il_rewriter.h"
+#include "body_capture.h"
+#include "test.h"
+
+using trace_test::BodyCapture;
+
+namespace
+{
+    // logged indices, the bodies are built by appending to an empty one, so
+    // the k-th logged instruction is code instruction k once committed
+    struct Branch
+    {
+        unsigned instr;
+        unsigned target;
+    };
+
+    unsigned Append(ILRewriter& rewriter, unsigned opcode)
+    {
+        return rewriter.InsertBefore(rewriter.GetCodeEnd(), opcode);
+    }
+
+    unsigned CodeIndex(unsigned logged)
+    {
+        return logged & ~ILRewriter::kLoggedInstr;
+    }
+
+    bool IsShort(unsigned opcode)
+    {
+        return opcode == CEE_BR_S || opcode == CEE_BRTRUE_S || opcode == CEE_LEAVE_S;
+    }
+
+    // the instructions the generated bodies use, decoded from the exported
+    // code, branch targets as code offsets
+    struct DecodedInstr
+    {
+        unsigned offset;
+        unsigned opcode;
+        unsigned target;
+    };
+
+    bool Decode(const std::vector<BYTE>& body, std::vector<DecodedInstr>* instrs)
+    {
+        const auto header = (const IMAGE_COR_ILMETHOD_FAT*)body.data();
+        if (body.size() < sizeof(IMAGE_COR_ILMETHOD_FAT) ||
+            (header->Flags & CorILMethod_FormatMask) != CorILMethod_FatFormat) {
+            return false;
+        }
+        const auto pCode = body.data() + sizeof(IMAGE_COR_ILMETHOD_FAT);
+        const unsigned codeSize = header->CodeSize;
+        if (sizeof(IMAGE_COR_ILMETHOD_FAT) + codeSize > body.size()) {
+            return false;
+        }
+
+        unsigned offset = 0;
+        while (offset < codeSize) {
+            DecodedInstr instr{ offset, pCode[offset], 0 };
+            offset++;
+            switch (instr.opcode) {
+            case CEE_NOP:
+            case CEE_LDC_I4_1:
+            case CEE_RET:
+                break;
+            case CEE_BR_S:
+            case CEE_BRTRUE_S:
+            case CEE_LEAVE_S:
+                instr.target = offset + 1 + (INT8)pCode[offset];
+                offset += 1;
+                break;
+            case CEE_BR:
+            case CEE_BRTRUE:
+            case CEE_LEAVE:
+            {
+                INT32 delta;
+                memcpy(&delta, pCode + offset, sizeof(delta));
+                instr.target = offset + 4 + delta;
+                offset += 4;
+                break;
+            }
+            default:
+                return false;
+            }
+            instrs->push_back(instr);
+        }
+        return offset == codeSize;
+    }
+
+    class BranchTest
+    {
+    public:
+        BodyCapture capture;
+        ILRewriter rewriter;
+        std::vector<Branch> branches;
+
+        BranchTest() : rewriter(nullptr, &capture, 0, 0x06000001)
+        {
+            rewriter.InitializeTiny();
+        }
+
+        unsigned Nops(unsigned count)
+        {
+            const auto first = Append(rewriter, CEE_NOP);
+            for (unsigned i = 1; i < count; i++) {
+                Append(rewriter, CEE_NOP);
+            }
+            return first;
+        }
+
+        // branches are emitted long, Export picks the form
+        unsigned Jump(unsigned opcode, unsigned target)
+        {
+            if (opcode == CEE_BRTRUE) {
+                Append(rewriter, CEE_LDC_I4_1);
+            }
+            const auto instr = Append(rewriter, opcode);
+            rewriter.GetInstr(instr)->m_target = target;
+            branches.push_back(Branch{ instr, target });
+            return instr;
+        }
+
+        // sets the target of a branch emitted before its target was
+        void SetTarget(unsigned instr, unsigned target)
+        {
+            rewriter.GetInstr(instr)->m_target = target;
+            for (auto& branch : branches) {
+                if (branch.instr == instr) {
+                    branch.target = target;
+                }
+            }
+        }
+
+        unsigned Opcode(unsigned logged)
+        {
+            return rewriter.GetInstr(CodeIndex(logged))->m_opcode;
+        }
+
+        std::vector<BYTE> Export()
+        {
+            EXPECT(SUCCEEDED(rewriter.Export()));
+            return capture.body;
+        }
+
+        // exports the body, decodes it back and checks every instruction
+        // landed where the layout put it, every branch reaches its target and
+        // a branch is short exactly when the short form reaches
+        void Check()
+        {
+            std::vector<DecodedInstr> decoded;
+            const auto body = Export();
+            EXPECT(Decode(body, &decoded));
+
+            EXPECT(rewriter.GetCodeEnd() == decoded.size());
+            if (rewriter.GetCodeEnd() != decoded.size()) {
+                return;
+            }
+            for (unsigned i = 0; i < rewriter.GetCodeEnd(); i++) {
+                const auto pInstr = rewriter.GetInstr(i);
+                EXPECT(decoded[i].offset == pInstr->m_offset);
+                EXPECT(decoded[i].opcode == pInstr->m_opcode);
+            }
+
+            for (const auto& branch : branches) {
+                const auto index = CodeIndex(branch.instr);
+                const auto pInstr = rewriter.GetInstr(index);
+                EXPECT(pInstr->m_target == CodeIndex(branch.target));
+                EXPECT(decoded[index].target == rewriter.GetOffset(pInstr->m_target));
+
+                const auto next = (int)rewriter.GetOffset(index + 1);
+                const auto target = (int)rewriter.GetOffset(pInstr->m_target);
+                // the delta the short form has, a long one would shorten the
+                // code before a forward target along with itself
+                auto shortDelta = target - next;
+                if (!IsShort(pInstr->m_opcode) && target <= (int)pInstr->m_offset) {
+                    shortDelta += 3;
+                }
+                EXPECT(IsShort(pInstr->m_opcode) == ((INT8)shortDelta == shortDelta));
+            }
+        }
+
+        unsigned CodeSize()
+        {
+            return rewriter.GetOffset(rewriter.GetCodeEnd());
+        }
+    };
+
+    void TestForwardBoundary()
+    {
+        BranchTest reaches;
+        const auto shortBranch = reaches.Jump(CEE_BR, 0);
+        reaches.Nops(127);
+        reaches.SetTarget(shortBranch, reaches.Nops(1));
+        Append(reaches.rewriter, CEE_RET);
+        reaches.Check();
+        EXPECT(reaches.Opcode(shortBranch) == CEE_BR_S);
+
+        BranchTest tooFar;
+        const auto longBranch = tooFar.Jump(CEE_LEAVE, 0);
+        tooFar.Nops(128);
+        tooFar.SetTarget(longBranch, tooFar.Nops(1));
+        Append(tooFar.rewriter, CEE_RET);
+        tooFar.Check();
+        EXPECT(tooFar.Opcode(longBranch) == CEE_LEAVE);
+    }
+
+    void TestBackwardBoundary()
+    {
+        // the delta is taken from the end of the branch, so a short one reaches
+        // back 128 bytes: itself, the ldc.i4.1 and 125 nops
+        BranchTest reaches;
+        const auto shortTarget = reaches.Nops(125);
+        const auto shortBranch = reaches.Jump(CEE_BRTRUE, shortTarget);
+        Append(reaches.rewriter, CEE_RET);
+        reaches.Check();
+        EXPECT(reaches.Opcode(shortBranch) == CEE_BRTRUE_S);
+
+        BranchTest tooFar;
+        const auto longTarget = tooFar.Nops(126);
+        const auto longBranch = tooFar.Jump(CEE_BRTRUE, longTarget);
+        Append(tooFar.rewriter, CEE_RET);
+        tooFar.Check();
+        EXPECT(tooFar.Opcode(longBranch) == CEE_BRTRUE);
+    }
+
+    // a branch widened for its own target pushes another one out of range,
+    // which only a second layout pass sees
+    void TestWideningCascades()
+    {
+        BranchTest test;
+        const auto first = test.Jump(CEE_BR, 0);
+        const auto second = test.Jump(CEE_BR, 0);
+        test.Nops(124);
+        test.SetTarget(first, test.Nops(1));
+        test.Nops(200);
+        test.SetTarget(second, Append(test.rewriter, CEE_RET));
+        test.Check();
+        // 2 + 124 bytes would reach, 5 + 124 don't
+        EXPECT(test.Opcode(second) == CEE_BR);
+        EXPECT(test.Opcode(first) == CEE_BR);
+    }
+
+    // blocks of nops ending in br, brtrue or leave to a random block, up to
+    // the largest body the tests generate
+    void TestGeneratedBodies(unsigned blockCount, unsigned maxPadding, unsigned seed)
+    {
+        std::mt19937 random(seed);
+        BranchTest test;
+        std::vector<unsigned> blocks;
+        std::vector<unsigned> exits;
+        for (unsigned b = 0; b < blockCount; b++) {
+            blocks.push_back(test.Nops(1 + random() % (maxPadding + 1)));
+            static const unsigned opcodes[] = { CEE_BR, CEE_BRTRUE, CEE_LEAVE };
+            exits.push_back(opcodes[random() % 3]);
+            test.Jump(exits.back(), 0);
+        }
+        blocks.push_back(Append(test.rewriter, CEE_RET));
+        // half of the branches go to a neighbouring block, most of those stay short
+        for (size_t b = 0; b < test.branches.size(); b++) {
+            auto& branch = test.branches[b];
+            const auto near = (int)b + (int)(random() % 5) - 1;
+            const auto target = random() % 2 == 0 ? std::min(std::max(near, 0), (int)blockCount) : (int)(random() % blocks.size());
+            branch.target = blocks[target];
+            test.rewriter.GetInstr(branch.instr)->m_target = branch.target;
+        }
+        test.Check();
+        EXPECT(test.CodeSize() <= 64 * 1024);
+
+        unsigned shortCount = 0;
+        for (const auto& branch : test.branches) {
+            shortCount += IsShort(test.Opcode(branch.instr)) ? 1 : 0;
+        }
+        EXPECT(shortCount > 0);
+        EXPECT(maxPadding < 64 || shortCount < test.branches.size());
+    }
+}
+
+int main()
+{
+    TestForwardBoundary();
+    TestBackwardBoundary();
+    TestWideningCascades();
+    TestGeneratedBodies(16, 8, 1);
+    TestGeneratedBodies(64, 64, 2);
+    TestGeneratedBodies(256, 200, 3);
+    TestGeneratedBodies(1024, 100, 4);
+    TestGeneratedBodies(500, 240, 5);
+    return TEST_RESULT();
+}
@@ -0,0 +1,141 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "../instrumentation_plan.h"
+#include "test.h"
+
+using namespace trace;
+
+namespace
+{
+    const WSTRING PlanPath = "instrumentation_plan_test.plan"_W;
+
+    GUID Mvid(BYTE value)
+    {
+        GUID mvid;
+        memset(&mvid, value, sizeof(mvid));
+        return mvid;
+    }
+
+    std::vector<TraceAssembly> Rules(const WSTRING& methodName)
+    {
+        TraceAssembly assembly;
+        assembly.assemblyName = "App"_W;
+        assembly.className = "App.Service"_W;
+        assembly.methods.push_back(TraceMethod(methodName, ""_W));
+        return { assembly };
+    }
+
+    // what ClrProfilerPlan writes for two modules of App
+    UINT64 WritePlan()
+    {
+        const auto rulesHash = HashTraceRules(Rules("Run"_W));
+        std::vector<PlanModule> modules;
+        modules.push_back(PlanModule{ Mvid(0x50), { TokenFromRid(3, mdtMethodDef), TokenFromRid(7, mdtMethodDef) } });
+        modules.push_back(PlanModule{ Mvid(0x20), { TokenFromRid(1, mdtMethodDef) } });
+        modules.push_back(PlanModule{ Mvid(0x30), {} });
+        EXPECT(WriteInstrumentationPlan(PlanPath, rulesHash, modules));
+        return rulesHash;
+    }
+
+    std::vector<char> ReadPlan()
+    {
+        std::ifstream stream(ToString(PlanPath), std::ios::binary);
+        return std::vector<char>((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+    }
+
+    void OverwritePlan(const std::vector<char>& bytes, size_t size)
+    {
+        std::ofstream stream(ToString(PlanPath), std::ios::binary | std::ios::trunc);
+        stream.write(bytes.data(), size);
+    }
+
+    // the profiler scans a module the plan does not answer for
+    bool FallsBackToScan(const InstrumentationPlan& plan, const GUID& mvid)
+    {
+        const mdMethodDef* methods = nullptr;
+        ULONG count = 0;
+        return !plan.TryGetMethods(mvid, &methods, &count);
+    }
+
+    void TestRoundTrip()
+    {
+        const auto rulesHash = WritePlan();
+        InstrumentationPlan plan;
+        EXPECT(plan.Open(PlanPath, rulesHash));
+        EXPECT(plan.IsOpen());
+
+        const mdMethodDef* methods = nullptr;
+        ULONG count = 0;
+        EXPECT(plan.TryGetMethods(Mvid(0x50), &methods, &count));
+        EXPECT(count == 2 && methods[0] == TokenFromRid(3, mdtMethodDef) && methods[1] == TokenFromRid(7, mdtMethodDef));
+        EXPECT(plan.TryGetMethods(Mvid(0x20), &methods, &count));
+        EXPECT(count == 1 && methods[0] == TokenFromRid(1, mdtMethodDef));
+
+        // a module without candidates is planned too, it is not scanned
+        EXPECT(plan.TryGetMethods(Mvid(0x30), &methods, &count));
+        EXPECT(count == 0);
+    }
+
+    void TestStaleRules()
+    {
+        WritePlan();
+        InstrumentationPlan plan;
+        EXPECT(!plan.Open(PlanPath, HashTraceRules(Rules("Stop"_W))));
+        EXPECT(!plan.IsOpen());
+        EXPECT(FallsBackToScan(plan, Mvid(0x50)));
+    }
+
+    void TestTruncatedPlan()
+    {
+        const auto rulesHash = WritePlan();
+        const auto bytes = ReadPlan();
+        EXPECT(!bytes.empty());
+        for (size_t size = 0; size < bytes.size(); size++) {
+            OverwritePlan(bytes, size);
+            InstrumentationPlan plan;
+            EXPECT(!plan.Open(PlanPath, rulesHash));
+            EXPECT(FallsBackToScan(plan, Mvid(0x50)));
+        }
+
+        // an entry pointing past the methods
+        auto corrupt = bytes;
+        corrupt[24 + 16] = 0x7F;
+        OverwritePlan(corrupt, corrupt.size());
+        InstrumentationPlan plan;
+        EXPECT(!plan.Open(PlanPath, rulesHash));
+    }
+
+    void TestUnknownMvid()
+    {
+        const auto rulesHash = WritePlan();
+        InstrumentationPlan plan;
+        EXPECT(plan.Open(PlanPath, rulesHash));
+        // before, between and after the sorted entries
+        EXPECT(FallsBackToScan(plan, Mvid(0x10)));
+        EXPECT(FallsBackToScan(plan, Mvid(0x40)));
+        EXPECT(FallsBackToScan(plan, Mvid(0x60)));
+        EXPECT(!FallsBackToScan(plan, Mvid(0x50)));
+    }
+
+    void TestMissingPlan()
+    {
+        remove(ToString(PlanPath).c_str());
+        InstrumentationPlan plan;
+        EXPECT(!plan.Open(PlanPath, HashTraceRules(Rules("Run"_W))));
+        EXPECT(FallsBackToScan(plan, Mvid(0x50)));
+    }
+}
+
+int main()
+{
+    TestRoundTrip();
+    TestStaleRules();
+    TestTruncatedPlan();
+    TestUnknownMvid();
+    TestMissingPlan();
+    return TEST_RESULT();
+}
@@ -0,0 +1,466 @@
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+#include "../metadata_reader.h"
+#include "test.h"
+
+using namespace trace;
+
+namespace
+{
+    void Put16(std::vector<BYTE>& out, WORD value)
+    {
+        out.push_back((BYTE)value);
+        out.push_back((BYTE)(value >> 8));
+    }
+
+    void Put32(std::vector<BYTE>& out, DWORD value)
+    {
+        Put16(out, (WORD)value);
+        Put16(out, (WORD)(value >> 16));
+    }
+
+    void Put64(std::vector<BYTE>& out, UINT64 value)
+    {
+        Put32(out, (DWORD)value);
+        Put32(out, (DWORD)(value >> 32));
+    }
+
+    void Align4(std::vector<BYTE>& out)
+    {
+        while (out.size() % 4 != 0) {
+            out.push_back(0);
+        }
+    }
+
+    WORD AddString(std::vector<BYTE>& heap, const char* value)
+    {
+        const auto offset = (WORD)heap.size();
+        heap.insert(heap.end(), value, value + strlen(value) + 1);
+        return offset;
+    }
+
+    WORD AddBlob(std::vector<BYTE>& heap, const std::vector<BYTE>& value)
+    {
+        const auto offset = (WORD)heap.size();
+        heap.push_back((BYTE)value.size());
+        heap.insert(heap.end(), value.begin(), value.end());
+        return offset;
+    }
+
+    const BYTE Mvid[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+    const std::vector<BYTE> RunSignature = { 0x20, 0x01, 0x01, 0x08 };
+    const std::vector<BYTE> PublicKeyToken = { 0xB0, 0x3F, 0x5F, 0x7F, 0x11, 0xD5, 0x0A, 0x3A };
+
+    // the metadata root a compiler emits for
+    //   assembly Sample { class Sample.Worker { void Run(int); void Stop(); } }
+    // with a TypeRef to System.Object in mscorlib, small heaps and tables
+    struct Image
+    {
+        std::vector<BYTE> metadata;
+        size_t blobsOffset;
+        size_t blobsEnd;
+        // the Signature column of Stop
+        size_t stopSignature;
+    };
+
+    Image BuildImage()
+    {
+        std::vector<BYTE> strings(1, 0);
+        const auto moduleName = AddString(strings, "Sample.dll");
+        const auto sampleName = AddString(strings, "Sample");
+        const auto globalName = AddString(strings, "<Module>");
+        const auto workerName = AddString(strings, "Worker");
+        const auto runName = AddString(strings, "Run");
+        const auto stopName = AddString(strings, "Stop");
+        const auto objectName = AddString(strings, "Object");
+        const auto systemName = AddString(strings, "System");
+        const auto mscorlibName = AddString(strings, "mscorlib");
+        Align4(strings);
+
+        std::vector<BYTE> blobs(1, 0);
+        const auto runSig = AddBlob(blobs, RunSignature);
+        const auto stopSig = AddBlob(blobs, { 0x20, 0x00, 0x01 });
+        const auto token = AddBlob(blobs, PublicKeyToken);
+        Align4(blobs);
+
+        std::vector<BYTE> guids(Mvid, Mvid + sizeof(Mvid));
+
+        std::vector<BYTE> tables;
+        Put32(tables, 0);
+        tables.push_back(2);
+        tables.push_back(0);
+        tables.push_back(0);  // heap sizes, all small
+        tables.push_back(1);
+        const UINT64 valid = (1ull << TableModule) | (1ull << TableTypeRef) | (1ull << TableTypeDef) |
+            (1ull << TableMethodDef) | (1ull << TableAssembly) | (1ull << TableAssemblyRef);
+        Put64(tables, valid);
+        Put64(tables, 0);
+        for (const auto rows : { 1, 1, 2, 2, 1, 1 }) {
+            Put32(tables, rows);
+        }
+        // Module: Generation, Name, Mvid, EncId, EncBaseId
+        Put16(tables, 0);
+        Put16(tables, moduleName);
+        Put16(tables, 1);
+        Put16(tables, 0);
+        Put16(tables, 0);
+        // TypeRef: ResolutionScope (AssemblyRef 1), Name, Namespace
+        Put16(tables, (1 << 2) | 2);
+        Put16(tables, objectName);
+        Put16(tables, systemName);
+        // TypeDef: Flags, Name, Namespace, Extends, FieldList, MethodList
+        Put32(tables, 0);
+        Put16(tables, globalName);
+        Put16(tables, 0);
+        Put16(tables, 0);
+        Put16(tables, 1);
+        Put16(tables, 1);
+        Put32(tables, 0x00100001);
+        Put16(tables, workerName);
+        Put16(tables, sampleName);
+        Put16(tables, (1 << 2) | 1);
+        Put16(tables, 1);
+        Put16(tables, 1);
+        // MethodDef: RVA, ImplFlags, Flags, Name, Signature, ParamList
+        size_t stopSignature = 0;
+        for (const auto& method : { std::make_pair(runName, runSig), std::make_pair(stopName, stopSig) }) {
+            Put32(tables, 0x2050);
+            Put16(tables, 0);
+            Put16(tables, 0x0086);
+            Put16(tables, method.first);
+            stopSignature = tables.size();
+            Put16(tables, method.second);
+            Put16(tables, 1);
+        }
+        // Assembly: HashAlgId, version, Flags, PublicKey, Name, Culture
+        Put32(tables, 0x8004);
+        for (int i = 0; i < 4; i++) {
+            Put16(tables, 1);
+        }
+        Put32(tables, 0);
+        Put16(tables, 0);
+        Put16(tables, sampleName);
+        Put16(tables, 0);
+        // AssemblyRef: version, Flags, PublicKeyOrToken, Name, Culture, HashValue
+        for (int i = 0; i < 4; i++) {
+            Put16(tables, 4);
+        }
+        Put32(tables, 0);
+        Put16(tables, token);
+        Put16(tables, mscorlibName);
+        Put16(tables, 0);
+        Put16(tables, 0);
+        Align4(tables);
+
+        const char version[] = "v4.0.30319\0";
+        const std::pair<const char*, const std::vector<BYTE>*> streams[] = {
+            { "#~", &tables }, { "#Strings", &strings }, { "#Blob", &blobs }, { "#GUID", &guids },
+        };
+
+        std::vector<BYTE> header;
+        Put32(header, 0x424A5342);
+        Put16(header, 1);
+        Put16(header, 1);
+        Put32(header, 0);
+        Put32(header, sizeof(version));
+        header.insert(header.end(), version, version + sizeof(version));
+        Put16(header, 0);
+        Put16(header, 4);
+        size_t headerSize = header.size();
+        for (const auto& stream : streams) {
+            headerSize += 8 + ((strlen(stream.first) + 1 + 3) & ~3);
+        }
+
+        Image image;
+        auto offset = headerSize;
+        for (const auto& stream : streams) {
+            if (stream.second == &tables) {
+                image.stopSignature = offset + stopSignature;
+            }
+            if (stream.second == &blobs) {
+                image.blobsOffset = offset;
+                image.blobsEnd = offset + blobs.size();
+            }
+            Put32(header, (DWORD)offset);
+            Put32(header, (DWORD)stream.second->size());
+            header.insert(header.end(), stream.first, stream.first + strlen(stream.first) + 1);
+            Align4(header);
+            offset += stream.second->size();
+        }
+        image.metadata = header;
+        for (const auto& stream : streams) {
+            image.metadata.insert(image.metadata.end(), stream.second->begin(), stream.second->end());
+        }
+        return image;
+    }
+
+    // reads every row the way the plan compiler and the profiler do, on an
+    // exactly sized copy so a read past the end is caught by the sanitizers
+    bool ReadAll(const std::vector<BYTE>& metadata, size_t size)
+    {
+        std::unique_ptr<BYTE[]> copy(new BYTE[size == 0 ? 1 : size]);
+        memcpy(copy.get(), metadata.data(), size);
+        MetadataReader reader;
+        if (!reader.Open(copy.get(), (ULONG)size)) {
+            return false;
+        }
+        GUID mvid;
+        reader.GetModuleMvid(&mvid);
+        LPCSTR name;
+        LPCSTR nameSpace;
+        reader.GetAssemblyName(&name);
+        size_t length = 0;
+        for (ULONG rid = 1; rid <= reader.GetRowCount(TableTypeDef); rid++) {
+            DWORD flags;
+            mdMethodDef first;
+            mdMethodDef end;
+            if (reader.GetTypeDefProps(TokenFromRid(rid, mdtTypeDef), &name, &nameSpace, &flags)) {
+                length += strlen(name) + strlen(nameSpace);
+            }
+            reader.GetTypeDefMethods(TokenFromRid(rid, mdtTypeDef), &first, &end);
+        }
+        for (ULONG rid = 1; rid <= reader.GetRowCount(TableMethodDef); rid++) {
+            PCCOR_SIGNATURE signature;
+            ULONG cbSignature;
+            if (reader.GetMethodProps(TokenFromRid(rid, mdtMethodDef), &name, &signature, &cbSignature)) {
+                length += strlen(name) + cbSignature;
+            }
+        }
+        for (ULONG rid = 1; rid <= reader.GetRowCount(TableTypeRef); rid++) {
+            mdToken scope;
+            if (reader.GetTypeRefProps(TokenFromRid(rid, mdtTypeRef), &scope, &name, &nameSpace)) {
+                length += strlen(name) + strlen(nameSpace);
+            }
+        }
+        for (ULONG rid = 1; rid <= reader.GetRowCount(TableAssemblyRef); rid++) {
+            const void* publicKeyOrToken;
+            ULONG cbPublicKeyOrToken;
+            if (reader.GetAssemblyRefProps(TokenFromRid(rid, mdtAssemblyRef), &name, &publicKeyOrToken, &cbPublicKeyOrToken)) {
+                length += strlen(name) + cbPublicKeyOrToken;
+            }
+        }
+        return length > 0;
+    }
+
+    void TestSynthesizedImage()
+    {
+        const auto image = BuildImage();
+        MetadataReader reader;
+        EXPECT(reader.Open(image.metadata.data(), (ULONG)image.metadata.size()));
+
+        GUID mvid;
+        EXPECT(reader.GetModuleMvid(&mvid));
+        EXPECT(memcmp(&mvid, Mvid, sizeof(Mvid)) == 0);
+        LPCSTR name;
+        LPCSTR nameSpace;
+        EXPECT(reader.GetAssemblyName(&name) && strcmp(name, "Sample") == 0);
+
+        EXPECT(reader.GetRowCount(TableTypeDef) == 2);
+        DWORD flags;
+        EXPECT(reader.GetTypeDefProps(TokenFromRid(2, mdtTypeDef), &name, &nameSpace, &flags));
+        EXPECT(strcmp(name, "Worker") == 0 && strcmp(nameSpace, "Sample") == 0 && flags == 0x00100001);
+        mdMethodDef first;
+        mdMethodDef end;
+        EXPECT(reader.GetTypeDefMethods(TokenFromRid(2, mdtTypeDef), &first, &end));
+        EXPECT(first == TokenFromRid(1, mdtMethodDef) && end == TokenFromRid(3, mdtMethodDef));
+
+        PCCOR_SIGNATURE signature;
+        ULONG cbSignature;
+        EXPECT(reader.GetMethodProps(TokenFromRid(1, mdtMethodDef), &name, &signature, &cbSignature));
+        EXPECT(strcmp(name, "Run") == 0 && cbSignature == RunSignature.size());
+        EXPECT(memcmp(signature, RunSignature.data(), cbSignature) == 0);
+        EXPECT(!reader.GetMethodProps(TokenFromRid(3, mdtMethodDef), &name, &signature, &cbSignature));
+
+        mdToken scope;
+        EXPECT(reader.GetTypeRefProps(TokenFromRid(1, mdtTypeRef), &scope, &name, &nameSpace));
+        EXPECT(strcmp(name, "Object") == 0 && strcmp(nameSpace, "System") == 0);
+        EXPECT(scope == TokenFromRid(1, mdtAssemblyRef));
+
+        const void* publicKeyOrToken;
+        ULONG cbPublicKeyOrToken;
+        EXPECT(reader.GetAssemblyRefProps(scope, &name, &publicKeyOrToken, &cbPublicKeyOrToken));
+        EXPECT(strcmp(name, "mscorlib") == 0 && cbPublicKeyOrToken == PublicKeyToken.size());
+
+        EXPECT(ReadAll(image.metadata, image.metadata.size()));
+    }
+
+    // every stream ends at the end of the metadata or before it, so no prefix
+    // opens and none is read past its end
+    void TestTruncatedImage()
+    {
+        const auto image = BuildImage();
+        for (size_t size = 0; size < image.metadata.size(); size++) {
+            EXPECT(!ReadAll(image.metadata, size));
+        }
+    }
+
+    void TestCorruptHeaps()
+    {
+        // the last string loses its NUL and runs into the end of #Strings
+        auto image = BuildImage();
+        auto metadata = image.metadata;
+        for (auto i = image.blobsOffset - 1; metadata[i] == 0; i--) {
+            metadata[i] = 'x';
+        }
+        {
+            MetadataReader reader;
+            EXPECT(reader.Open(metadata.data(), (ULONG)metadata.size()));
+            mdToken scope;
+            LPCSTR name;
+            LPCSTR nameSpace;
+            const void* publicKeyOrToken;
+            ULONG cbPublicKeyOrToken;
+            EXPECT(reader.GetTypeRefProps(TokenFromRid(1, mdtTypeRef), &scope, &name, &nameSpace));
+            EXPECT(reader.GetAssemblyRefProps(scope, &name, &publicKeyOrToken, &cbPublicKeyOrToken));
+            EXPECT(strcmp(name, "") == 0);
+        }
+
+        // blob lengths past the end of #Blob, in 1, 2 and 4 byte encodings
+        for (const BYTE lead : { 0x7F, 0xBF, 0xDF }) {
+            metadata = image.metadata;
+            metadata[image.blobsOffset + 1] = lead;
+            MetadataReader reader;
+            EXPECT(reader.Open(metadata.data(), (ULONG)metadata.size()));
+            LPCSTR name;
+            PCCOR_SIGNATURE signature;
+            ULONG cbSignature;
+            EXPECT(!reader.GetMethodProps(TokenFromRid(1, mdtMethodDef), &name, &signature, &cbSignature));
+            EXPECT(reader.GetMethodProps(TokenFromRid(2, mdtMethodDef), &name, &signature, &cbSignature));
+        }
+
+        // multi byte length prefixes cut off by the end of #Blob
+        for (const BYTE lead : { 0xBF, 0xDF }) {
+            metadata = image.metadata;
+            metadata[image.blobsEnd - 1] = lead;
+            const auto lastByte = (WORD)(image.blobsEnd - 1 - image.blobsOffset);
+            memcpy(&metadata[image.stopSignature], &lastByte, sizeof(lastByte));
+            MetadataReader reader;
+            EXPECT(reader.Open(metadata.data(), (ULONG)metadata.size()));
+            LPCSTR name;
+            PCCOR_SIGNATURE signature;
+            ULONG cbSignature;
+            EXPECT(reader.GetMethodProps(TokenFromRid(1, mdtMethodDef), &name, &signature, &cbSignature));
+            EXPECT(!reader.GetMethodProps(TokenFromRid(2, mdtMethodDef), &name, &signature, &cbSignature));
+        }
+    }
+
+    // the last stream name has no NUL before the end of the metadata
+    void TestUnterminatedStreamName()
+    {
+        std::vector<BYTE> metadata;
+        Put32(metadata, 0x424A5342);
+        Put16(metadata, 1);
+        Put16(metadata, 1);
+        Put32(metadata, 0);
+        Put32(metadata, 4);
+        metadata.insert(metadata.end(), { 'v', '4', 0, 0 });
+        Put16(metadata, 0);
+        Put16(metadata, 1);
+        Put32(metadata, 0);
+        Put32(metadata, 0);
+        metadata.insert(metadata.end(), { '#', '~', '~', '~' });
+        EXPECT(!ReadAll(metadata, metadata.size()));
+        metadata.resize(metadata.size() - 2);
+        metadata.insert(metadata.end(), { 0, 0 });
+        EXPECT(!ReadAll(metadata, metadata.size()));
+    }
+
+    LPCBYTE RvaToPointer(const std::vector<BYTE>& file, DWORD rva, DWORD size)
+    {
+        DWORD peOffset;
+        memcpy(&peOffset, &file[0x3C], sizeof(peOffset));
+        WORD sectionCount;
+        WORD optionalHeaderSize;
+        memcpy(&sectionCount, &file[peOffset + 6], sizeof(sectionCount));
+        memcpy(&optionalHeaderSize, &file[peOffset + 20], sizeof(optionalHeaderSize));
+        const auto sections = peOffset + 24 + optionalHeaderSize;
+        for (WORD s = 0; s < sectionCount; s++) {
+            DWORD virtualSize;
+            DWORD virtualAddress;
+            DWORD rawOffset;
+            memcpy(&virtualSize, &file[sections + s * 40 + 8], sizeof(DWORD));
+            memcpy(&virtualAddress, &file[sections + s * 40 + 12], sizeof(DWORD));
+            memcpy(&rawOffset, &file[sections + s * 40 + 20], sizeof(DWORD));
+            if (rva >= virtualAddress && rva - virtualAddress + size <= virtualSize &&
+                rawOffset + (rva - virtualAddress) + size <= file.size()) {
+                return &file[rawOffset + (rva - virtualAddress)];
+            }
+        }
+        return nullptr;
+    }
+
+    // metadata of a managed PE file: the CLI header is data directory 14
+    bool ReadPeMetadata(const std::string& path, std::vector<BYTE>* metadata)
+    {
+        std::ifstream in(path, std::ios::binary);
+        const std::vector<BYTE> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (file.size() < 0x40) {
+            return false;
+        }
+        DWORD peOffset;
+        memcpy(&peOffset, &file[0x3C], sizeof(peOffset));
+        if (peOffset + 24 + 2 > file.size()) {
+            return false;
+        }
+        WORD magic;
+        memcpy(&magic, &file[peOffset + 24], sizeof(magic));
+        const auto directories = peOffset + 24 + (magic == 0x20B ? 112 : 96);
+        if (directories + 15 * 8 > file.size()) {
+            return false;
+        }
+        DWORD cliRva;
+        memcpy(&cliRva, &file[directories + 14 * 8], sizeof(cliRva));
+        const auto cliHeader = RvaToPointer(file, cliRva, 72);
+        if (cliHeader == nullptr) {
+            return false;
+        }
+        DWORD metadataRva;
+        DWORD metadataSize;
+        memcpy(&metadataRva, cliHeader + 8, sizeof(metadataRva));
+        memcpy(&metadataSize, cliHeader + 12, sizeof(metadataSize));
+        const auto pMetadata = RvaToPointer(file, metadataRva, metadataSize);
+        if (pMetadata == nullptr) {
+            return false;
+        }
+        metadata->assign(pMetadata, pMetadata + metadataSize);
+        return true;
+    }
+
+    // an assembly the compiler and runtime actually produced, with large
+    // heaps and coded indexes, whole and cut short
+    void TestManagedAssembly(const std::string& path)
+    {
+        std::vector<BYTE> metadata;
+        EXPECT(ReadPeMetadata(path, &metadata));
+        if (metadata.empty()) {
+            return;
+        }
+        MetadataReader reader;
+        EXPECT(reader.Open(metadata.data(), (ULONG)metadata.size()));
+        LPCSTR name;
+        EXPECT(reader.GetAssemblyName(&name) && strcmp(name, "System.Private.CoreLib") == 0);
+        EXPECT(reader.GetRowCount(TableTypeDef) > 1000);
+        EXPECT(ReadAll(metadata, metadata.size()));
+
+        for (size_t size = 0; size < metadata.size(); size += 1 + metadata.size() / 97) {
+            EXPECT(!ReadAll(metadata, size));
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    TestSynthesizedImage();
+    TestTruncatedImage();
+    TestCorruptHeaps();
+    TestUnterminatedStreamName();
+    // System.Private.CoreLib.dll of an installed runtime, when there is one
+    if (argc > 1) {
+        TestManagedAssembly(argv[1]);
+    }
+    return TEST_RESULT();
+}
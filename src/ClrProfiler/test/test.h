@@ -0,0 +1,26 @@
+#ifndef CLR_PROFILER_TEST_TEST_H_
+#define CLR_PROFILER_TEST_TEST_H_
+
+#include <cstdio>
+
+// checks of the native tests, a failed EXPECT is printed and makes
+// TEST_RESULT() non zero so ctest reports the executable as failed
+namespace trace_test {
+    inline int& Failures()
+    {
+        static int failures = 0;
+        return failures;
+    }
+}
+
+#define EXPECT(cond)                                                              \
+    do {                                                                          \
+        if (!(cond)) {                                                            \
+            std::printf("%s:%d: EXPECT(%s) failed\n", __FILE__, __LINE__, #cond); \
+            trace_test::Failures()++;                                             \
+        }                                                                         \
+    } while (0)
+
+#define TEST_RESULT() (trace_test::Failures() == 0 ? 0 : 1)
+
+#endif  // CLR_PROFILER_TEST_TEST_H_
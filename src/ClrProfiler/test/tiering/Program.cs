@@ -0,0 +1,10 @@
+namespace Samples.Console
+{
+    class Program
+    {
+        static void Main(string[] args)
+        {
+            Tiering.Run();
+        }
+    }
+}
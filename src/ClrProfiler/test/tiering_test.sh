@@ -0,0 +1,68 @@
+#!/bin/sh
+# usage: tiering_test.sh <ClrProfiler.so> [dotnet]
+# runs the Samples.Console tiering scenario with a counter probe on Work and
+# checks the instrumented Work got tier-1 code and that its probe counted
+# every call, so the tier-1 code still runs the probe
+set -e
+
+profiler=$1
+dotnet=${2:-dotnet}
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+fail() {
+    echo "tiering_test: $1"
+    for f in "$work"/home/logs/*.log "$work/jit.txt" "$work/out.txt"; do
+        [ -f "$f" ] && { echo "== $f"; cat "$f"; }
+    done
+    exit 1
+}
+
+"$dotnet" build "$here/tiering/TieringTest.csproj" -c Release --artifacts-path "$work/artifacts" \
+    > "$work/build.txt" 2>&1 || { cat "$work/build.txt"; exit 1; }
+
+mkdir -p "$work/home"
+cat > "$work/home/trace.json" <<JSON
+{
+    "managedAssembly": {
+        "publicKey": "b2248d6c400b487d",
+        "version": "1.0.0.0"
+    },
+    "instrumentation": [
+        {
+            "assemblyName": "TieringTest",
+            "className": "Samples.Console.Tiering",
+            "methods": [
+                {
+                    "methodName": "Work",
+                    "probe": "counter"
+                }
+            ]
+        }
+    ]
+}
+JSON
+
+CORECLR_ENABLE_PROFILING=1 \
+CORECLR_PROFILER={cf0d821e-299b-5307-a3d8-b283c03916dd} \
+CORECLR_PROFILER_PATH="$profiler" \
+CORECLR_PROFILER_HOME="$work/home" \
+DOTNET_JitStdOutFile="$work/jit.txt" \
+DOTNET_JitDisasmSummary=1 \
+    "$dotnet" "$work/artifacts/bin/TieringTest/release/TieringTest.dll" > "$work/out.txt" 2>&1 \
+    || fail "the scenario failed"
+
+calls=$(sed -n 's/^Tiering Work \([0-9]*\) calls$/\1/p' "$work/out.txt")
+[ -n "$calls" ] || fail "no call count printed"
+
+grep -q "Samples.Console.Tiering:Work(int) \[Tier1," "$work/jit.txt" \
+    || fail "Work got no tier-1 code"
+
+log=$(cat "$work"/home/logs/*.log 2>/dev/null || true)
+echo "$log" | grep -q "MethodName:Work ProbeId:[0-9]* .*IL ReWirte" \
+    || fail "Work was not rewritten"
+echo "$log" | grep -q "Method:Samples.Console.Tiering.Work Hits:$calls " \
+    || fail "the probe of Work did not count all $calls calls"
+
+echo "tiering_test: Work reached tier-1 and its probe counted $calls calls"
@@ -0,0 +1,159 @@
+#include <chrono>
+#include "../trace_matcher.h"
+#include "test.h"
+
+using namespace trace;
+
+namespace
+{
+    // joins names the way the matcher does internally
+    const WSTRING Separator(1, (WCHAR)1);
+
+    TraceAssembly Rule(const WSTRING& assemblyName, const WSTRING& className, const WSTRING& methodName)
+    {
+        TraceAssembly assembly;
+        assembly.assemblyName = assemblyName;
+        assembly.className = className;
+        assembly.methods.push_back(TraceMethod(methodName, ""_W));
+        return assembly;
+    }
+
+    bool Matches(const TraceMatcher& matcher, const WSTRING& assemblyName, const WSTRING& className, const WSTRING& methodName)
+    {
+        std::vector<TraceRule> rules;
+        return matcher.Match(assemblyName, className, methodName, &rules);
+    }
+
+    void TestLiterals()
+    {
+        TraceMatcher matcher;
+        matcher.Compile({ Rule("App"_W, "App.Service"_W, "Run"_W) });
+        EXPECT(matcher.MatchAssembly("App"_W));
+        EXPECT(!matcher.MatchAssembly("Ap"_W));
+        EXPECT(!matcher.MatchAssembly("Apps"_W));
+        EXPECT(Matches(matcher, "App"_W, "App.Service"_W, "Run"_W));
+        EXPECT(!Matches(matcher, "App"_W, "App.Service"_W, "Runs"_W));
+        EXPECT(!Matches(matcher, "App"_W, "App.Servic"_W, "Run"_W));
+    }
+
+    void TestWildcards()
+    {
+        TraceMatcher matcher;
+        matcher.Compile({ Rule("App.*"_W, "*Controller"_W, "Get?"_W) });
+        EXPECT(matcher.MatchAssembly("App."_W));
+        EXPECT(matcher.MatchAssembly("App.Web"_W));
+        EXPECT(!matcher.MatchAssembly("App"_W));
+        EXPECT(Matches(matcher, "App.Web"_W, "HomeController"_W, "GetA"_W));
+        EXPECT(Matches(matcher, "App.Web"_W, "Controller"_W, "GetA"_W));
+        EXPECT(!Matches(matcher, "App.Web"_W, "HomeController"_W, "Get"_W));
+        EXPECT(!Matches(matcher, "App.Web"_W, "HomeControllers"_W, "GetA"_W));
+    }
+
+    void TestWildcardsStayInsideTheirName()
+    {
+        TraceMatcher matcher;
+        matcher.Compile({ Rule("Foo*"_W, "Baz"_W, "M"_W), Rule("Lib*Core"_W, "*"_W, "*"_W) });
+
+        // Foo* does not match Foo<sep>Bar
+        EXPECT(matcher.MatchAssembly("FooBar"_W));
+        EXPECT(!matcher.MatchAssembly("Foo"_W + Separator + "Bar"_W));
+        EXPECT(Matches(matcher, "FooBar"_W, "Baz"_W, "M"_W));
+        EXPECT(!Matches(matcher, "Foo"_W, "Bar"_W, "M"_W));
+
+        // a '*' inside a pattern must not swallow the separator either
+        EXPECT(matcher.MatchAssembly("LibCore"_W));
+        EXPECT(matcher.MatchAssembly("Lib.Net.Core"_W));
+        EXPECT(!matcher.MatchAssembly("Lib"_W));
+        EXPECT(!matcher.MatchAssembly("Lib"_W + Separator + "Core"_W));
+        EXPECT(!Matches(matcher, "Lib"_W, "Core"_W, "M"_W));
+        EXPECT(Matches(matcher, "LibCore"_W, "Any"_W, "M"_W));
+    }
+
+    void TestOverlappingRules()
+    {
+        TraceMatcher matcher;
+        matcher.Compile({ Rule("App"_W, "*"_W, "Run"_W), Rule("A*"_W, "Service"_W, "R*"_W) });
+        std::vector<TraceRule> both;
+        EXPECT(matcher.Match("App"_W, "Service"_W, "Run"_W, &both) && both.size() == 2);
+        std::vector<TraceRule> second;
+        EXPECT(matcher.Match("Api"_W, "Service"_W, "Read"_W, &second) && second.size() == 1 && second[0].assemblyIndex == 1);
+        EXPECT(!Matches(matcher, "Api"_W, "Worker"_W, "Run"_W));
+    }
+
+    const char* const Words[] = {
+        "Order", "Cart", "User", "Price", "Stock", "Ship", "Mail", "Audit", "Cache", "Token",
+        "Queue", "Report", "Search", "Login", "Tax", "Batch", "Export", "Import", "Rule", "Quota"
+    };
+    const size_t WordCount = sizeof(Words) / sizeof(Words[0]);
+
+    // MyCorp.* / MyCorp.*<Word>* / *<Word>* for every word
+    std::vector<TraceAssembly> InfixRules()
+    {
+        std::vector<TraceAssembly> rules;
+        for (size_t i = 0; i < WordCount; i++) {
+            const auto word = ToWSTRING(Words[i]);
+            rules.push_back(Rule("MyCorp.*"_W, "MyCorp.*"_W + word + "*"_W, "*"_W + word + "*"_W));
+        }
+        return rules;
+    }
+
+    // rules i and j match a class naming word i and a method naming word j
+    // exactly when i == j, and every rule whose word both names contain
+    void CheckInfixRules(const TraceMatcher& matcher)
+    {
+        for (size_t i = 0; i < WordCount; i++) {
+            for (size_t j = 0; j < WordCount; j++) {
+                const auto className = "MyCorp.Shop."_W + ToWSTRING(Words[i]) + "Service"_W;
+                const auto methodName = "Get"_W + ToWSTRING(Words[j]) + "Async"_W;
+                std::vector<TraceRule> rules;
+                const auto matched = matcher.Match("MyCorp.Shop"_W, className, methodName, &rules);
+                EXPECT(matched == (i == j));
+                EXPECT(!matched || (rules.size() == 1 && rules[0].assemblyIndex == i));
+            }
+        }
+        std::vector<TraceRule> rules;
+        EXPECT(matcher.Match("MyCorp.Shop"_W, "MyCorp.OrderCartService"_W, "CartOrder"_W, &rules) && rules.size() == 2);
+        EXPECT(!matcher.MatchAssembly("Other.Shop"_W));
+        EXPECT(!matcher.MatchClass("MyCorp.Shop"_W, "MyCorp.Shop.Service"_W));
+    }
+
+    // eager subset construction of these rules takes minutes past ten of them
+    void TestManyInfixRules()
+    {
+        const auto start = std::chrono::steady_clock::now();
+        TraceMatcher matcher;
+        matcher.Compile(InfixRules());
+        CheckInfixRules(matcher);
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        EXPECT(elapsed < std::chrono::seconds(2));
+    }
+
+    // a cache too small for one lookup is dropped again and again, the
+    // answers stay the same
+    void TestSmallStateCache()
+    {
+        TraceMatcher matcher;
+        matcher.Compile(InfixRules(), 4);
+        CheckInfixRules(matcher);
+    }
+
+    void TestNoRules()
+    {
+        TraceMatcher matcher;
+        matcher.Compile({});
+        EXPECT(!matcher.MatchAssembly("App"_W));
+        EXPECT(!Matches(matcher, "App"_W, "C"_W, "M"_W));
+    }
+}
+
+int main()
+{
+    TestLiterals();
+    TestWildcards();
+    TestWildcardsStayInsideTheirName();
+    TestOverlappingRules();
+    TestManyInfixRules();
+    TestSmallStateCache();
+    TestNoRules();
+    return TEST_RESULT();
+}
@@ -0,0 +1,99 @@
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "../work_queue.h"
+#include "test.h"
+
+using namespace trace;
+
+namespace
+{
+    void TestRunsInOrder()
+    {
+        WorkQueue queue;
+        queue.Start();
+        std::mutex lock;
+        std::condition_variable signal;
+        auto ran = 0;
+        auto inOrder = true;
+        for (auto i = 0; i < 100; i++) {
+            queue.Post([&, i]() {
+                std::lock_guard<std::mutex> guard(lock);
+                inOrder = inOrder && ran == i;
+                ran++;
+                signal.notify_all();
+            });
+        }
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            signal.wait(guard, [&] { return ran == 100; });
+        }
+        queue.Stop();
+        EXPECT(inOrder);
+    }
+
+    void TestStopCancelsQueuedTasks()
+    {
+        WorkQueue queue;
+        queue.Start();
+
+        // holds the worker until the other tasks are queued behind it
+        std::mutex lock;
+        std::condition_variable signal;
+        auto started = false;
+        auto release = false;
+        queue.Post([&]() {
+            std::unique_lock<std::mutex> guard(lock);
+            started = true;
+            signal.notify_all();
+            signal.wait(guard, [&] { return release; });
+        });
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            signal.wait(guard, [&] { return started; });
+        }
+
+        std::atomic<int> ran{ 0 };
+        std::atomic<int> cancelled{ 0 };
+        for (auto i = 0; i < 10; i++) {
+            queue.Post([&]() { ran++; }, [&]() { cancelled++; });
+        }
+        // no cancel given, dropped silently
+        queue.Post([]() {});
+
+        // the worker may get to some tasks before Stop takes the queue, every
+        // other one has to be cancelled
+        std::thread stopper([&]() { queue.Stop(); });
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            release = true;
+        }
+        signal.notify_all();
+        stopper.join();
+        EXPECT(ran + cancelled == 10);
+
+        // posted after Stop, cancelled right away
+        const auto ranBefore = ran.load();
+        queue.Post([&]() { ran++; }, [&]() { cancelled++; });
+        EXPECT(ran == ranBefore);
+        EXPECT(ran + cancelled == 11);
+    }
+
+    void TestStopWithoutStart()
+    {
+        WorkQueue queue;
+        auto cancelled = 0;
+        queue.Post([]() {}, [&]() { cancelled++; });
+        queue.Stop();
+        EXPECT(cancelled == 1);
+    }
+}
+
+int main()
+{
+    TestRunsInOrder();
+    TestStopCancelsQueuedTasks();
+    TestStopWithoutStart();
+    return TEST_RESULT();
+}
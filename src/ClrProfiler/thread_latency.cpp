@@ -0,0 +1,113 @@
+#include "thread_latency.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+namespace trace
+{
+    // latency one thread timed for one probe
+    struct ThreadLatency
+    {
+        // written by the thread only, read by the merge
+        std::atomic<UINT64> latency[LatencyBucketCount];
+        // part of latency already added to the probe's counters
+        UINT64 merged[LatencyBucketCount];
+    };
+
+    class LatencyThread
+    {
+    private:
+        // guards growing probes against a merge from another thread
+        std::mutex probeLock;
+        // indexed by probe id, only the thread itself adds to it
+        std::vector<std::unique_ptr<ThreadLatency>> probes{};
+    public:
+        LatencyThread();
+        ~LatencyThread();
+
+        void Record(UINT32 probeId, INT64 start);
+        void Merge();
+    };
+
+    struct LatencyThreads
+    {
+        std::mutex lock;
+        std::unordered_set<LatencyThread*> threads;
+    };
+
+    // never destroyed, threads may still exit after static destructors ran
+    static LatencyThreads& Threads()
+    {
+        static auto threads = new LatencyThreads();
+        return *threads;
+    }
+
+    static thread_local LatencyThread latencyThread;
+
+    LatencyThread::LatencyThread()
+    {
+        auto& registry = Threads();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        registry.threads.insert(this);
+    }
+
+    LatencyThread::~LatencyThread()
+    {
+        {
+            auto& registry = Threads();
+            std::lock_guard<std::mutex> guard(registry.lock);
+            registry.threads.erase(this);
+        }
+        Merge();
+    }
+
+    void LatencyThread::Record(UINT32 probeId, INT64 start)
+    {
+        if (probeId >= probes.size() || !probes[probeId]) {
+            std::lock_guard<std::mutex> guard(probeLock);
+            if (probeId >= probes.size()) {
+                probes.resize(probeId + 1);
+            }
+            probes[probeId].reset(new ThreadLatency());
+        }
+        // the only writer, no interlock needed
+        auto& bucket = probes[probeId]->latency[TimingProbeBucket(start)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    void LatencyThread::Merge()
+    {
+        std::lock_guard<std::mutex> guard(probeLock);
+        for (UINT32 probeId = 0; probeId < probes.size(); probeId++) {
+            const auto& probe = probes[probeId];
+            const auto pCounters = probe ? ProbeTable::Instance()->GetCounters(probeId) : nullptr;
+            if (pCounters == nullptr) {
+                continue;
+            }
+            for (int bucket = 0; bucket < LatencyBucketCount; bucket++) {
+                const auto count = probe->latency[bucket].load(std::memory_order_relaxed);
+                if (count != probe->merged[bucket]) {
+                    InterlockedExchangeAdd64((LONGLONG volatile*)&pCounters->latency[bucket],
+                        (LONGLONG)(count - probe->merged[bucket]));
+                    probe->merged[bucket] = count;
+                }
+            }
+        }
+    }
+
+    void RecordThreadLatency(UINT32 probeId, INT64 start)
+    {
+        latencyThread.Record(probeId, start);
+    }
+
+    void MergeThreadLatency()
+    {
+        auto& registry = Threads();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        for (const auto thread : registry.threads) {
+            thread->Merge();
+        }
+    }
+}
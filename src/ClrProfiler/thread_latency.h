@@ -0,0 +1,19 @@
+#ifndef CLR_PROFILER_THREAD_LATENCY_H_
+#define CLR_PROFILER_THREAD_LATENCY_H_
+
+#include "cor.h"
+#include "probe_table.h"
+
+namespace trace {
+
+    // adds a call of the probe that started at start to the calling thread's
+    // own latency histogram of the probe, timed calls on different threads
+    // never share a cache line
+    void RecordThreadLatency(UINT32 probeId, INT64 start);
+
+    // adds what every thread recorded since the last merge to the latency of
+    // the probes' ProbeCounters, a thread merges itself when it exits
+    void MergeThreadLatency();
+}
+
+#endif  // CLR_PROFILER_THREAD_LATENCY_H_
@@ -0,0 +1,266 @@
+#include "trace_matcher.h"
+#include <algorithm>
+
+namespace trace
+{
+    // joins assembly, class and method name, wildcards never match it
+    const WCHAR NameSeparator = (WCHAR)1;
+
+    // nfa states are positions in the joined patterns, the state id of
+    // position p in pattern r is bases[r] + p
+    class PatternNfa
+    {
+    public:
+        std::vector<WSTRING> patterns;
+        std::vector<TraceRule> rules;
+        std::vector<int> bases;
+        std::vector<int> ruleOf;
+
+        void Add(const WSTRING& pattern, const TraceRule& rule)
+        {
+            const auto r = (int)patterns.size();
+            patterns.push_back(pattern);
+            rules.push_back(rule);
+            bases.push_back((int)ruleOf.size());
+            ruleOf.insert(ruleOf.end(), pattern.length() + 1, r);
+        }
+
+        WCHAR At(int id, bool* end) const
+        {
+            const auto r = ruleOf[id];
+            const auto p = (size_t)(id - bases[r]);
+            *end = p == patterns[r].length();
+            return *end ? 0 : patterns[r][p];
+        }
+
+        void Closure(std::vector<int>& set) const
+        {
+            for (size_t i = 0; i < set.size(); i++) {
+                bool end;
+                // '*' may match nothing
+                if (At(set[i], &end) == '*' && !end) {
+                    set.push_back(set[i] + 1);
+                }
+            }
+            std::sort(set.begin(), set.end());
+            set.erase(std::unique(set.begin(), set.end()), set.end());
+        }
+
+        std::vector<WCHAR> Literals(const std::vector<int>& set) const
+        {
+            std::vector<WCHAR> literals;
+            for (const auto id : set) {
+                bool end;
+                const auto ch = At(id, &end);
+                if (!end && ch != '*' && ch != '?') {
+                    literals.push_back(ch);
+                }
+            }
+            std::sort(literals.begin(), literals.end());
+            literals.erase(std::unique(literals.begin(), literals.end()), literals.end());
+            return literals;
+        }
+
+        // isOther stands for any character that is no literal of the set
+        std::vector<int> Step(const std::vector<int>& set, WCHAR c, bool isOther) const
+        {
+            std::vector<int> next;
+            for (const auto id : set) {
+                bool end;
+                const auto ch = At(id, &end);
+                if (end) {
+                    continue;
+                }
+                if (ch == '*') {
+                    if (c != NameSeparator) {
+                        next.push_back(id);
+                    }
+                }
+                else if (ch == '?') {
+                    if (c != NameSeparator) {
+                        next.push_back(id + 1);
+                    }
+                }
+                else if (!isOther && ch == c) {
+                    next.push_back(id + 1);
+                }
+            }
+            Closure(next);
+            return next;
+        }
+    };
+
+    TraceMatcher::TraceMatcher() = default;
+
+    TraceMatcher::~TraceMatcher() = default;
+
+    void TraceMatcher::Compile(const std::vector<TraceAssembly>& traceAssemblies, size_t maxStates)
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        states.clear();
+        stateIds.clear();
+        nfa.reset();
+        this->maxStates = std::max<size_t>(maxStates, 2);
+
+        std::unique_ptr<PatternNfa> patterns(new PatternNfa());
+        for (size_t i = 0; i < traceAssemblies.size(); i++) {
+            const auto& assembly = traceAssemblies[i];
+            for (size_t j = 0; j < assembly.methods.size(); j++) {
+                WSTRING pattern = assembly.assemblyName;
+                pattern.push_back(NameSeparator);
+                pattern += assembly.className;
+                pattern.push_back(NameSeparator);
+                pattern += assembly.methods[j].methodName;
+                patterns->Add(pattern, TraceRule{ i, j });
+            }
+        }
+        if (patterns->patterns.empty()) {
+            return;
+        }
+        nfa = std::move(patterns);
+
+        std::vector<int> start(nfa->bases);
+        nfa->Closure(start);
+        Intern(start);
+    }
+
+    // the empty set is the dead state -1
+    int TraceMatcher::Intern(std::vector<int>& set) const
+    {
+        if (set.empty()) {
+            return -1;
+        }
+        const auto it = stateIds.find(set);
+        if (it != stateIds.end()) {
+            return it->second;
+        }
+
+        const auto id = (int)states.size();
+        states.push_back(DfaState{});
+        auto& state = states.back();
+        for (const auto nfaState : set) {
+            bool end;
+            nfa->At(nfaState, &end);
+            if (end) {
+                state.rules.push_back(nfa->rules[nfa->ruleOf[nfaState]]);
+            }
+        }
+        stateIds.emplace(set, id);
+        state.set = std::move(set);
+        return id;
+    }
+
+    // returns the id of the state once expanded, a full cache is dropped
+    // first, all but the start state and this one
+    int TraceMatcher::Expand(int state) const
+    {
+        if (states.size() >= maxStates) {
+            auto start = states[0].set;
+            auto set = states[state].set;
+            states.clear();
+            stateIds.clear();
+            Intern(start);
+            state = Intern(set);
+        }
+
+        const auto set = states[state].set;
+        auto other = nfa->Step(set, 0, true);
+        const auto otherwise = Intern(other);
+
+        // the separator always gets its own edge, otherwise '*' would take it
+        auto literals = nfa->Literals(set);
+        literals.insert(std::lower_bound(literals.begin(), literals.end(), NameSeparator), NameSeparator);
+        literals.erase(std::unique(literals.begin(), literals.end()), literals.end());
+
+        std::vector<std::pair<WCHAR, int>> edges;
+        for (const auto c : literals) {
+            auto next = nfa->Step(set, c, false);
+            const auto target = Intern(next);
+            if (target != otherwise) {
+                edges.push_back(std::make_pair(c, target));
+            }
+        }
+
+        auto& dfaState = states[state];
+        dfaState.edges = std::move(edges);
+        dfaState.otherwise = otherwise;
+        dfaState.expanded = true;
+        return state;
+    }
+
+    int TraceMatcher::Step(int state, WCHAR c) const
+    {
+        if (!states[state].expanded) {
+            state = Expand(state);
+        }
+        const auto& dfaState = states[state];
+        const auto it = std::lower_bound(dfaState.edges.begin(), dfaState.edges.end(), c,
+            [](const std::pair<WCHAR, int>& edge, WCHAR ch) { return edge.first < ch; });
+        if (it != dfaState.edges.end() && it->first == c) {
+            return it->second;
+        }
+        return dfaState.otherwise;
+    }
+
+    int TraceMatcher::Step(int state, const WSTRING& text) const
+    {
+        for (size_t i = 0; i < text.length() && state >= 0; i++) {
+            state = Step(state, text[i]);
+        }
+        return state;
+    }
+
+    // state after the assembly name and, unless null, the class name, each
+    // with its separator, under cacheLock
+    int TraceMatcher::StepNames(const WSTRING& assemblyName, const WSTRING* className) const
+    {
+        auto state = Step(0, assemblyName);
+        if (state >= 0) {
+            state = Step(state, NameSeparator);
+        }
+        if (className != nullptr) {
+            state = Step(state, *className);
+            if (state >= 0) {
+                state = Step(state, NameSeparator);
+            }
+        }
+        return state;
+    }
+
+    bool TraceMatcher::MatchAssembly(const WSTRING& assemblyName) const
+    {
+        if (!nfa) {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(cacheLock);
+        return StepNames(assemblyName, nullptr) >= 0;
+    }
+
+    bool TraceMatcher::MatchClass(const WSTRING& assemblyName, const WSTRING& className) const
+    {
+        if (!nfa) {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(cacheLock);
+        return StepNames(assemblyName, &className) >= 0;
+    }
+
+    bool TraceMatcher::Match(const WSTRING& assemblyName,
+        const WSTRING& className,
+        const WSTRING& methodName,
+        std::vector<TraceRule>* rules) const
+    {
+        rules->clear();
+        if (!nfa) {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(cacheLock);
+        auto state = StepNames(assemblyName, &className);
+        state = Step(state, methodName);
+        if (state < 0) {
+            return false;
+        }
+        *rules = states[state].rules;
+        return !rules->empty();
+    }
+}
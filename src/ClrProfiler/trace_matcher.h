@@ -0,0 +1,80 @@
+#ifndef CLR_PROFILER_TRACE_MATCHER_H_
+#define CLR_PROFILER_TRACE_MATCHER_H_
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "string.h"  // NOLINT
+#include "config_loader.h"
+
+namespace trace {
+
+    // a configured method, indexes into TraceConfig::traceAssemblies and its methods
+    struct TraceRule
+    {
+        size_t assemblyIndex;
+        size_t methodIndex;
+    };
+
+    class PatternNfa;
+
+    // assemblyName, className and methodName of every rule may use '*' (any
+    // sequence) and '?' (any single character), a wildcard never crosses from
+    // one name into the next. All rules are matched by one DFA so a lookup
+    // costs one transition per character whatever the rule count. Its states
+    // are built on first use, eager construction blows up with infix '*', and
+    // the cache of them is dropped once it holds maxStates.
+    class TraceMatcher
+    {
+    private:
+        struct DfaState
+        {
+            // nfa states this state stands for
+            std::vector<int> set;
+            // edges and otherwise are valid once expanded
+            bool expanded = false;
+            // sorted by character, characters not listed go to otherwise
+            std::vector<std::pair<WCHAR, int>> edges;
+            int otherwise = -1;
+            // rules accepted in this state
+            std::vector<TraceRule> rules;
+        };
+
+        std::unique_ptr<PatternNfa> nfa;
+        size_t maxStates = 0;
+
+        // lookups run on the loader, worker and jit threads
+        mutable std::mutex cacheLock;
+        mutable std::vector<DfaState> states{};
+        mutable std::map<std::vector<int>, int> stateIds{};
+
+        int Intern(std::vector<int>& set) const;
+        int Expand(int state) const;
+        int Step(int state, WCHAR c) const;
+        int Step(int state, const WSTRING& text) const;
+        int StepNames(const WSTRING& assemblyName, const WSTRING* className) const;
+    public:
+        static const size_t DefaultMaxStates = 4096;
+
+        TraceMatcher();
+        ~TraceMatcher();
+
+        void Compile(const std::vector<TraceAssembly>& traceAssemblies, size_t maxStates = DefaultMaxStates);
+
+        // true when the assembly name matches the assembly pattern of any rule
+        bool MatchAssembly(const WSTRING& assemblyName) const;
+
+        // true when assembly and class name match the first two patterns of any rule
+        bool MatchClass(const WSTRING& assemblyName, const WSTRING& className) const;
+
+        // rules gets the rules matching all three names, false when there are none
+        bool Match(const WSTRING& assemblyName,
+            const WSTRING& className,
+            const WSTRING& methodName,
+            std::vector<TraceRule>* rules) const;
+    };
+}
+
+#endif  // CLR_PROFILER_TRACE_MATCHER_H_
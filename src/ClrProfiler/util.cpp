@@ -1,5 +1,6 @@
 #include "util.h"
 
+#include <algorithm>
 #include <cwctype>
 #include <iterator>
 #include <string>
@@ -78,6 +79,77 @@ std::vector<WSTRING> GetEnvironmentValues(const WSTRING &name) {
   return GetEnvironmentValues(name, L';');
 }
 
+WSTRING GetCurrentProcessName() {
+#ifdef _WIN32
+  const size_t max_buf_size = 4096;
+  WCHAR buf[max_buf_size];
+  const auto len = GetModuleFileName(nullptr, buf, max_buf_size);
+  auto name = WSTRING(buf).substr(0, len);
+#else
+  char buf[4096];
+  const auto len = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+  if (len <= 0) {
+    return ""_W;
+  }
+  auto name = ToWSTRING(std::string(buf, len));
+#endif
+  const auto pos = name.find_last_of(PathSeparator);
+  if (pos != WSTRING::npos) {
+    name = name.substr(pos + 1);
+  }
+#ifdef _WIN32
+  const auto ext = ".exe"_W;
+  if (name.length() > ext.length()) {
+    auto suffix = name.substr(name.length() - ext.length());
+    std::transform(suffix.begin(), suffix.end(), suffix.begin(), ::towlower);
+    if (suffix == ext) {
+      name = name.substr(0, name.length() - ext.length());
+    }
+  }
+#endif
+  return name;
+}
+
+WSTRING GetCurrentProcessCommandLine() {
+#ifdef _WIN32
+  return WSTRING(GetCommandLine());
+#else
+  std::ifstream stream("/proc/self/cmdline", std::ios::binary);
+  std::string cmdline((std::istreambuf_iterator<char>(stream)),
+                      std::istreambuf_iterator<char>());
+  // arguments are separated and terminated by '\0'
+  while (!cmdline.empty() && cmdline.back() == '\0') {
+    cmdline.pop_back();
+  }
+  std::replace(cmdline.begin(), cmdline.end(), '\0', ' ');
+  return ToWSTRING(cmdline);
+#endif
+}
+
+bool WildcardMatch(const WSTRING &pattern, const WSTRING &text) {
+  size_t p = 0, t = 0;
+  size_t star = WSTRING::npos, mark = 0;
+  while (t < text.length()) {
+    if (p < pattern.length() &&
+        (pattern[p] == '?' || pattern[p] == text[t])) {
+      p++;
+      t++;
+    } else if (p < pattern.length() && pattern[p] == '*') {
+      star = p++;
+      mark = t;
+    } else if (star != WSTRING::npos) {
+      p = star + 1;
+      t = ++mark;
+    } else {
+      return false;
+    }
+  }
+  while (p < pattern.length() && pattern[p] == '*') {
+    p++;
+  }
+  return p == pattern.length();
+}
+
 constexpr char HexMap[] = { '0', '1', '2', '3', '4', '5', '6', '7',
                '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' };
 
@@ -108,4 +180,12 @@ void SetClrProfilerFlag(bool flag) {
 WSTRING GetClrProfilerHome() {
     return  PROFILER_FLAG ? CORECLR_PROFILER_HOME : COR_PROFILER_HOME;
 }
+
+WSTRING GetClrProfilerProcesses() {
+    return  PROFILER_FLAG ? CORECLR_PROFILER_PROCESSES : COR_PROFILER_PROCESSES;
+}
+
+WSTRING GetClrProfilerLogLevel() {
+    return  PROFILER_FLAG ? CORECLR_PROFILER_LOG_LEVEL : COR_PROFILER_LOG_LEVEL;
+}
 }  // namespace trace
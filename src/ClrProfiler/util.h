@@ -24,9 +24,15 @@ namespace trace {
 
     const WSTRING CORECLR_PROFILER_HOME = "CORECLR_PROFILER_HOME"_W;
     const WSTRING COR_PROFILER_HOME = "COR_PROFILER_HOME"_W;
+    const WSTRING CORECLR_PROFILER_PROCESSES = "CORECLR_PROFILER_PROCESSES"_W;
+    const WSTRING COR_PROFILER_PROCESSES = "COR_PROFILER_PROCESSES"_W;
+    const WSTRING CORECLR_PROFILER_LOG_LEVEL = "CORECLR_PROFILER_LOG_LEVEL"_W;
+    const WSTRING COR_PROFILER_LOG_LEVEL = "COR_PROFILER_LOG_LEVEL"_W;
 
     void SetClrProfilerFlag(bool flag);
     WSTRING GetClrProfilerHome();
+    WSTRING GetClrProfilerProcesses();
+    WSTRING GetClrProfilerLogLevel();
 
 #ifdef _WIN32
     const auto PathSeparator = "\\"_W;
@@ -105,6 +111,18 @@ namespace trace {
     // GetEnvironmentValues calls GetEnvironmentValues with a semicolon delimiter.
     std::vector<WSTRING> GetEnvironmentValues(const WSTRING &name);
 
+    // GetCurrentProcessName returns the executable file name of the current
+    // process, without directory and without the .exe extension.
+    WSTRING GetCurrentProcessName();
+
+    // GetCurrentProcessCommandLine returns the command line of the current
+    // process, arguments are separated by a space.
+    WSTRING GetCurrentProcessCommandLine();
+
+    // WildcardMatch matches text against a pattern where '*' matches any
+    // sequence and '?' matches any single character.
+    bool WildcardMatch(const WSTRING &pattern, const WSTRING &text);
+
     //HexStr
     WSTRING HexStr(const unsigned char *data, int len);
 
@@ -0,0 +1,61 @@
+#include "work_queue.h"
+
+namespace trace
+{
+    void WorkQueue::Start()
+    {
+        worker = std::thread(&WorkQueue::Run, this);
+    }
+
+    void WorkQueue::Stop()
+    {
+        std::deque<Task> dropped;
+        {
+            std::lock_guard<std::mutex> guard(queueLock);
+            stopping = true;
+            dropped.swap(tasks);
+        }
+        queueSignal.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+        for (const auto& task : dropped) {
+            if (task.cancel) {
+                task.cancel();
+            }
+        }
+    }
+
+    void WorkQueue::Post(std::function<void()> task, std::function<void()> cancel)
+    {
+        {
+            std::unique_lock<std::mutex> guard(queueLock);
+            if (stopping) {
+                guard.unlock();
+                if (cancel) {
+                    cancel();
+                }
+                return;
+            }
+            tasks.push_back(Task{ std::move(task), std::move(cancel) });
+        }
+        queueSignal.notify_one();
+    }
+
+    void WorkQueue::Run()
+    {
+        while (true) {
+            Task task;
+            {
+                std::unique_lock<std::mutex> guard(queueLock);
+                queueSignal.wait(guard, [this] { return stopping || !tasks.empty(); });
+                if (stopping) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task.run();
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef CLR_PROFILER_WORK_QUEUE_H_
+#define CLR_PROFILER_WORK_QUEUE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace trace {
+
+    // runs posted tasks one at a time, in the order they were posted,
+    // on a background thread of the profiler
+    class WorkQueue
+    {
+    private:
+        std::mutex queueLock;
+        std::condition_variable queueSignal;
+        struct Task
+        {
+            std::function<void()> run;
+            std::function<void()> cancel;
+        };
+        std::deque<Task> tasks{};
+        bool stopping = false;
+        std::thread worker;
+
+        void Run();
+    public:
+        void Start();
+        // waits for the running task, tasks still queued are dropped and
+        // their cancel runs instead
+        void Stop();
+
+        // cancel runs in place of a task that never will, when it is dropped
+        // by Stop or posted after it, so whoever waits for the task is released
+        void Post(std::function<void()> task, std::function<void()> cancel = nullptr);
+    };
+}
+
+#endif  // CLR_PROFILER_WORK_QUEUE_H_